@@ -35,6 +35,7 @@
 #include <sstream>
 #include <exception>
 #include <random>
+#include <numeric>
 #include <queue>
 #include "btree_map.h"
 
@@ -54,8 +55,13 @@
 #include <boost/accumulators/statistics/weighted_mean.hpp>
 #include <boost/lockfree/queue.hpp>
 #include <boost/thread/thread.hpp>
-#include <boost/math/special_functions/digamma.hpp>
 #include <boost/math/distributions/beta.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
 
 
 //#include <Eigen/Core>
@@ -75,11 +81,14 @@
 #include "tbb/blocked_range.h"
 #include "tbb/task_scheduler_init.h"
 #include "tbb/partitioner.h"
+#include "tbb/enumerable_thread_specific.h"
 
 #include "BiasIndex.hpp"
 #include "ezETAProgressBar.hpp"
 #include "LookUpTableUtils.hpp"
 #include "SailfishMath.hpp"
+#include "OptimizerTelemetry.hpp"
+#include "NUMAPolicy.hpp"
 
 template <typename ReadHash>
 class CollapsedIterativeOptimizer {
@@ -97,7 +106,7 @@ private:
 
     struct TranscriptGeneVectors;
     using TranscriptIDVector = std::vector<TranscriptID>;
-    using KmerIDMap = std::vector<TranscriptIDVector>;
+    using KmerIDMap = LUTTools::KmerLUT;
 
 
     using TranscriptKmerSet = std::tuple<TranscriptID, std::vector<KmerID>>;
@@ -234,6 +243,20 @@ private:
         std::vector<KmerID> updatedBinmers;
     };
 
+    /**
+     * The k-mer equivalence classes, laid out (in compressed sparse row form)
+     * for the E-step: the transcripts of class c are
+     * transcripts[offsets[c]] ... transcripts[offsets[c+1] - 1], and counts[c]
+     * is the number of k-mers observed from class c.
+     */
+    struct EquivClassIndex {
+        std::vector<uint64_t> offsets;
+        std::vector<TranscriptID> transcripts;
+        std::vector<KmerQuantity> counts;
+
+        inline size_t numClasses() const { return counts.size(); }
+    };
+
     bool loggedCounts_;
     uint32_t numThreads_;
     size_t merLen_;
@@ -259,6 +282,76 @@ private:
     std::vector<KmerQuantity> kmerGroupCounts_;
     std::vector<KmerQuantity> logKmerGroupCounts_;
     std::vector<Count> kmerGroupSizes_;
+
+    // The observed classes (those with a non-zero count), as the E-step walks
+    // them (built once, by initialize_)
+    EquivClassIndex equivClasses_;
+
+    // The per-transcript state of the EM, as parallel arrays, so that each
+    // pass over the transcripts streams through only the fields it uses
+    // (rather than through the much larger TranscriptInfo records)
+    std::vector<double> emLogInvEffLen_;       // LOG_0 where the effective length is 0
+    std::vector<uint32_t> emNumClasses_;       // the classes in which each transcript occurs
+    std::vector<tbb::atomic<double>> emMass_;  // the mass of the latest E-step
+    std::vector<uint8_t> emBinMersZeroed_;
+    // rho[t] is the (log) weight of transcript t in an E-step, and
+    // expRho[t] = exp(rho[t]) (or 0 where rho[t] = LOG_0)
+    std::vector<double> emRho_;
+    std::vector<double> emExpRho_;
+
+    /**
+     * NUMA placement (see setNUMA).  The classes are placed by first touch,
+     * from the workers that walk them; the partitioner replays the same
+     * assignment of ranges to threads on each full E-step, so that each
+     * worker goes on walking the classes on its own node.  The per-transcript
+     * arrays, which every worker reads (or adds to) at random, are interleaved.
+     */
+    bool numa_{false};
+    std::unique_ptr<NUMAThreadPinner> numaPinner_;
+    tbb::affinity_partitioner emClassPartitioner_;
+
+    /**
+     * Unless they would take more memory than this, each thread of the E-step
+     * accumulates mass into a dense vector of its own, and these are summed
+     * afterwards; otherwise, mass is added directly (and atomically) to
+     * emMass_, where threads contend on the popular transcripts.
+     */
+    static constexpr size_t MaxThreadLocalMassBytes = size_t(1) << 30;
+    bool emThreadLocalMass_{false};
+    tbb::enumerable_thread_specific<std::vector<double>> emLocalMass_;
+
+    /**
+     * The active set of the EM (see setActiveSet).  A transcript is active
+     * while its abundance is still changing; once every transcript of a class
+     * is inactive, the class is frozen --- the mass it assigned to its
+     * transcripts (in emFrozenMass_) is re-used, rather than re-computed, by
+     * each E-step.  The active set is rebuilt, after a pass over all of the
+     * classes, every ActiveSetVerifyInterval iterations of SQUAREM.
+     */
+    static constexpr size_t ActiveSetVerifyInterval = 8;
+    // A transcript stays active while its relative change is at least this
+    // fraction of the convergence threshold
+    static constexpr double ActiveSetTolerance = 0.5;
+    // An active set with more than this fraction of the classes is not used
+    static constexpr double MaxActiveClassFraction = 0.5;
+    // The (Dirichlet) prior count of every transcript, added by each M-step
+    static constexpr double PriorAlpha = 0.01;
+    bool emActiveSetEnabled_{false};
+    bool emActiveSetInUse_{false};
+    bool emFrozenMassStale_{false};
+    std::vector<uint8_t> emActive_;
+    std::vector<KmerID> emActiveClasses_;
+    std::vector<KmerID> emFrozenClasses_;
+    std::vector<double> emFrozenMass_;
+
+    // Progress and timings of each phase (and iteration) of the optimizer
+    OptimizerTelemetry telemetry_;
+
+    // A previous solution from which to start the EM (see setWarmStart)
+    std::string warmStartFile_;
+    // The share of the initial (count-based) estimate mixed into a warm
+    // start, so that transcripts absent from the previous solution can gain mass
+    static constexpr double WarmStartInitialShare = 0.01;
     
 
     /**
@@ -583,6 +676,35 @@ private:
         return diff;
     }
 
+    /**
+     * The largest relative change from v0 to v1 (over the entries where
+     * either exceeds minVal), computed without materializing the individual
+     * changes.  If active is given, each entry is also marked as active
+     * (or not) by whether its relative change is at least activeTol.
+     */
+    double maxRelativeChange_(const std::vector<double>& v0, const std::vector<double>& v1, double minVal,
+                              std::vector<uint8_t>* active=nullptr, double activeTol=0.0) {
+        if (active) { active->resize(v0.size()); }
+        return tbb::parallel_reduce(
+          BlockedIndexRange(size_t(0), v0.size()),
+          double(0.0),
+          [&v0, &v1, minVal, active, activeTol](const BlockedIndexRange& range, double maxChange) -> double {
+            for (auto tid : boost::irange(range.begin(), range.end())) {
+              double oldVal = v0[tid];
+              double newVal = v1[tid];
+              double change = 0.0;
+              if (oldVal > minVal or newVal > minVal) {
+                  change = std::abs(newVal - oldVal) / oldVal;
+              }
+              if (active) { (*active)[tid] = !(change < activeTol); }
+              maxChange = std::max(maxChange, change);
+            }
+            return maxChange;
+          },
+          [](double a, double b) -> double { return std::max(a, b); }
+        );
+    }
+
     template <typename T>
     std::vector<T> relAbsDiff_(std::vector<T>& v0, std::vector<T>& v1, T minVal) {
         std::vector<T> relDiff(v0.size(), T());
@@ -736,43 +858,44 @@ private:
     }
 
     double logLikelihood3_(std::vector<double>& sampProbs) {
+        // The log-probability of sampling a k-mer of each transcript (only
+        // the observed classes contribute, so only those are visited)
+        std::vector<double> logProbs(sampProbs.size(), 0.0);
+        tbb::parallel_for(BlockedIndexRange(size_t(0), sampProbs.size()),
+          [&logProbs, &sampProbs, this](const BlockedIndexRange& range) -> void {
+            // logArray needs a positive, normal argument; a transcript that
+            // can not be sampled (or has no effective length) is given a
+            // placeholder, and contributes nothing
+            auto sampleable = [&sampProbs, this](size_t tid) -> bool {
+                double effLen = this->transcripts_[tid].effectiveLength;
+                return sampProbs[tid] > sailfish::math::EPSILON and effLen > 0.0 and
+                       std::isnormal(sampProbs[tid] / effLen);
+            };
+            for (auto tid = range.begin(); tid != range.end(); ++tid) {
+                logProbs[tid] = sampleable(tid) ? sampProbs[tid] / this->transcripts_[tid].effectiveLength : 1.0;
+            }
+            sailfish::math::logArray(&logProbs[range.begin()], &logProbs[range.begin()], range.size());
+            for (auto tid = range.begin(); tid != range.end(); ++tid) {
+                if (!sampleable(tid)) { logProbs[tid] = 0.0; }
+            }
+        });
 
-      std::vector<double> likelihoods(transcriptsForKmer_.size(), 0.0);
-
-        // Compute the log-likelihood
-        tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcriptsForKmer_.size())),
-          // for each transcript
-          [&likelihoods, &sampProbs, this](const BlockedIndexRange& range) ->void {
+        auto& ec = equivClasses_;
+        return tbb::parallel_reduce(
+          BlockedIndexRange(size_t(0), ec.numClasses()),
+          double(0.0),
+          [&logProbs, &ec](const BlockedIndexRange& range, double likelihood) -> double {
             for (auto kid = range.begin(); kid != range.end(); ++kid) {
-              double kmerLikelihood = 0.0;
-              KmerQuantity totalKmerMass = kmerGroupCounts_[kid];
-              for (auto& tid : this->transcriptsForKmer_[kid]) {
-                  // double logProbSampleTID = (sampProbs[tid] > sailfish::math::EPSILON) ? 
-                  //     std::log(sampProbs[tid]) : sailfish::math::LOG_0;
-                  
-                  double logProbSampleTID = (sampProbs[tid] > sailfish::math::EPSILON) ? 
-                      //std::log(sampProbs[tid]) : sailfish::math::LOG_0;
-                  std::log(sampProbs[tid] / this->transcripts_[tid].effectiveLength) : sailfish::math::LOG_0;
-                  
-                  if (logProbSampleTID != sailfish::math::LOG_0) { 
-                      kmerLikelihood += kmerGroupCounts_[kid] * logProbSampleTID;
-                  }
-              }
-              // If this k-mer is present
-              if (totalKmerMass > 0) {
-                  
-                  if (kmerLikelihood == sailfish::math::LOG_0) {
-                      std::cerr << "kmer group: " << kid << " has probability (" << kmerLikelihood << "); too low\n";
-                  } else {
-                      likelihoods[kid] = kmerLikelihood; 
-                  }
-                  
-              }
+                double kmerLikelihood = 0.0;
+                for (auto i = ec.offsets[kid]; i < ec.offsets[kid + 1]; ++i) {
+                    kmerLikelihood += logProbs[ec.transcripts[i]];
+                }
+                likelihood += ec.counts[kid] * kmerLikelihood;
             }
-          });
-
-      return psum_(likelihoods);
-
+            return likelihood;
+          },
+          [](double a, double b) -> double { return a + b; }
+        );
     }
     
     double logLikelihood2_(std::vector<double>& sampProbs) {
@@ -864,7 +987,8 @@ private:
         [&](const BlockedIndexRange& range ) -> void {
           for (auto j = range.begin(); j != range.end(); ++j) {
             if (isActiveKmer[j]) {
-              m[ transcriptsForKmer_[j]  ].push_back(j);
+              auto transcripts = transcriptsForKmer_[j];
+              m[ TranscriptIDVector(transcripts.begin(), transcripts.end()) ].push_back(j);
             }
             ++prog;
           }
@@ -933,7 +1057,7 @@ private:
       // set with those holding the info for our collapsed kmer sets
       std::swap(kmerGroupPromiscuities, kmerGroupPromiscuities_);
       std::swap(kmerGroupCounts, kmerGroupCounts_);
-      std::swap(transcriptsForKmer, transcriptsForKmer_);
+      transcriptsForKmer_ = LUTTools::KmerLUT::fromLists(transcriptsForKmer);
 
       /*
       uint64_t groupCounts = 0;
@@ -994,19 +1118,17 @@ private:
       // the transcript.  For efficiency, we also compute the kmer promiscuity values for each kmer
       // group here --- the promiscuity of a kmer group is simply the number of distinct transcripts in
       // which this group of kmers appears.
-      auto prevTID = std::numeric_limits<TranscriptID>::max();
-      KmerQuantity numDistinctTranscripts = 0.0;
+      // (The look-up table stores the distinct transcripts of each class,
+      // along with the number of times the class occurs in each)
+      auto transcripts = transcriptsForKmer_[kmerClassID];
+      auto multiplicities = transcriptsForKmer_.multiplicities(kmerClassID);
 
       //cerr << "numKmerClasses = " << numKmerClasses << ", kmerClassID = " << kmerClassID << ", transcriptsForKmer_.size() = " << transcriptsForKmer_.size() << "\n";
-      for (auto& tid : transcriptsForKmer_[kmerClassID]) {
-        transcripts_[tid].binMers[kmerClassID] += 1;
-        // Since the transcript IDs are sorted we just have to check
-        // if this id is different from the previous one
-        if (tid != prevTID) { numDistinctTranscripts += 1.0; }
-        prevTID = tid;
+      for (size_t i = 0; i < transcripts.size(); ++i) {
+        transcripts_[transcripts[i]].binMers[kmerClassID] += multiplicities[i];
       }
       // Set the promiscuity and the set of transcripts for this kmer group
-      kmerGroupPromiscuities_[kmerClassID] = numDistinctTranscripts;
+      kmerGroupPromiscuities_[kmerClassID] = transcripts.size();
 
       logKmerGroupCounts_[kmerClassID] = kmerGroupCounts_[kmerClassID] > 0 ? std::log(kmerGroupCounts_[kmerClassID]) : sailfish::math::LOG_0;
       //kmerGroupPromiscuities_[kmerClassID] = transcriptsForKmer_[kmerClassID].size();
@@ -1102,22 +1224,9 @@ private:
        //         }
        // });
 
-        size_t numRes = 0;
-        std::cerr << "\n\nRemoving duplicates from kmer transcript lists ... ";
-        tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcriptsForKmer_.size())),
-            [&numRes, this](const BlockedIndexRange& range) -> void {
-                for (auto idx = range.begin(); idx != range.end(); ++idx) {
-                  auto& transcripts = this->transcriptsForKmer_[idx];
-                  // should already be sorted -- extra check can be removed eventually
-                  std::is_sorted(transcripts.begin(), transcripts.end());
-                  // Uniqify the transcripts
-                  auto it = std::unique(transcripts.begin(), transcripts.end());
-                  transcripts.resize(std::distance(transcripts.begin(), it));
-                  ++numRes;
-                }
-         });
-
-         std::cerr << "done\n";
+        // N.B. The transcript lists of the look-up table are already
+        // distinct (duplicates are folded into their multiplicities), so
+        // they need not be uniqued here.
 
          std::cerr << "Computing kmer group promiscuity rates\n";
          /* -- done
@@ -1151,11 +1260,79 @@ private:
                 }
             });
         */
+        buildEquivClassIndex_();
         std::cerr << "done\n";
 
         //return mappedReads;
     }
 
+    /**
+     * Lay out the equivalence classes, and the per-transcript fields used by
+     * the EM, contiguously.  The class counts must be final by now.  A class
+     * that was not observed in this sample contributes nothing to the EM (or
+     * to the likelihood), so only the observed classes are laid out; for a
+     * shallow or targeted library, these are only a small fraction of all of
+     * the classes.
+     */
+    void buildEquivClassIndex_() {
+        size_t numTranscripts = transcripts_.size();
+        auto& ec = equivClasses_;
+
+        std::vector<KmerID> observed;
+        for (KmerID c = 0; c < kmerGroupCounts_.size(); ++c) {
+            if (kmerGroupCounts_[c] > 0.0) { observed.push_back(c); }
+        }
+        size_t numClasses = observed.size();
+
+        ec.offsets.assign(numClasses + 1, 0);
+        for (size_t i = 0; i < numClasses; ++i) {
+            ec.offsets[i + 1] = ec.offsets[i] + transcriptsForKmer_[observed[i]].size();
+        }
+        ec.counts.assign(numClasses, 0.0);
+        ec.transcripts.assign(ec.offsets[numClasses], 0);
+        if (numa_) {
+            NUMAPolicy::resetFirstTouch(ec.counts.data(), ec.counts.size() * sizeof(ec.counts[0]));
+            NUMAPolicy::resetFirstTouch(ec.transcripts.data(), ec.transcripts.size() * sizeof(ec.transcripts[0]));
+            NUMAPolicy::interleave(ec.offsets.data(), ec.offsets.size() * sizeof(ec.offsets[0]));
+        }
+        // The classes are filled by the same partitioning over which the
+        // E-step will walk them
+        tbb::parallel_for(BlockedIndexRange(size_t(0), numClasses),
+            [this, &ec, &observed](const BlockedIndexRange& range) -> void {
+              for (auto i = range.begin(); i != range.end(); ++i) {
+                auto transcripts = this->transcriptsForKmer_[observed[i]];
+                std::copy(transcripts.begin(), transcripts.end(), ec.transcripts.begin() + ec.offsets[i]);
+                ec.counts[i] = this->kmerGroupCounts_[observed[i]];
+              }
+        }, emClassPartitioner_);
+        telemetry_.set("observed_classes", numClasses);
+        telemetry_.set("classes", kmerGroupCounts_.size());
+        telemetry_.set("class_entries", ec.transcripts.size());
+
+        emLogInvEffLen_.resize(numTranscripts);
+        emNumClasses_.resize(numTranscripts);
+        emMass_.resize(numTranscripts);
+        emBinMersZeroed_.assign(numTranscripts, 0);
+        for (size_t tid = 0; tid < numTranscripts; ++tid) {
+            auto& ts = transcripts_[tid];
+            emLogInvEffLen_[tid] = (ts.effectiveLength > 0) ? ts.logInvEffectiveLength : sailfish::math::LOG_0;
+            emNumClasses_[tid] = ts.binMers.size();
+            emMass_[tid] = 0.0;
+        }
+        emRho_.assign(numTranscripts, 0.0);
+        emExpRho_.assign(numTranscripts, 0.0);
+        if (numa_) {
+            NUMAPolicy::interleave(emLogInvEffLen_.data(), numTranscripts * sizeof(emLogInvEffLen_[0]));
+            NUMAPolicy::interleave(emMass_.data(), numTranscripts * sizeof(emMass_[0]));
+            NUMAPolicy::interleave(emRho_.data(), numTranscripts * sizeof(emRho_[0]));
+            NUMAPolicy::interleave(emExpRho_.data(), numTranscripts * sizeof(emExpRho_[0]));
+        }
+
+        size_t numThreads = std::max(numThreads_, uint32_t(1));
+        emThreadLocalMass_ = (numThreads * numTranscripts * sizeof(double) <= MaxThreadLocalMassBytes);
+        telemetry_.set("thread_local_mass", emThreadLocalMass_ ? 1 : 0);
+    }
+
     void _dumpCoverage( const boost::filesystem::path &cfname) {
         auto memberships = LUTTools::readKmerEquivClasses(kmerEquivClassFname_);
 
@@ -1265,114 +1442,301 @@ private:
 
     }
 
-    void EMUpdate_( const std::vector<double>& meansIn, std::vector<double>& meansOut, bool accel) {
-      assert(meansIn.size() == meansOut.size());
-
-      auto reqNumJobs = transcriptsForKmer_.size();
-
-      std::atomic<size_t> numJobs{0};
-      std::atomic<size_t> completedJobs{0};
+    /**
+     * Distribute the counts of the given classes (or, if classes is null, of
+     * the first numClasses classes) among their transcripts, in proportion to
+     * expRho; the mass is added to emMass_ (or to the threads' local masses).
+     */
+    void distributeClassMass_(const std::vector<double>& expRho, const KmerID* classes, size_t numClasses) {
+      auto& ec = equivClasses_;
+      // for each kmer group
+      auto distribute = [&expRho, &ec, classes, this](const BlockedIndexRange& range) -> void {
+        double* localMass{nullptr};
+        if (this->emThreadLocalMass_) {
+            auto& local = this->emLocalMass_.local();
+            if (local.empty()) { local.resize(this->transcripts_.size(), 0.0); }
+            localMass = local.data();
+        }
+        for (auto i : boost::irange(range.begin(), range.end())) {
+            auto kid = (classes) ? classes[i] : i;
+            double count = ec.counts[kid];
+            auto begin = ec.transcripts.data() + ec.offsets[kid];
+            auto end = ec.transcripts.data() + ec.offsets[kid + 1];
+
+            /**
+             * Compute the total mass of all transcripts containing this k-mer
+             */
+            double totalMass = 0.0;
+            for (auto t = begin; t != end; ++t) { totalMass += expRho[*t]; }
+
+            double norm = (totalMass >  sailfish::math::EPSILON) ? 1.0 / totalMass : 0.0;
+            double scale = norm * count;
+            if (localMass) {
+                for (auto t = begin; t != end; ++t) { localMass[*t] += expRho[*t] * scale; }
+            } else {
+                for (auto t = begin; t != end; ++t) {
+                    if (expRho[*t] > 0.0) { atomicAdd_(this->emMass_[*t], expRho[*t] * scale); }
+                }
+            }
+        } // for kid in range
+      };
+      // A pass over every class keeps each range on the thread (and so the
+      // node) that laid it out
+      if (classes) {
+          tbb::parallel_for(BlockedIndexRange(size_t(0), numClasses), distribute);
+      } else {
+          tbb::parallel_for(BlockedIndexRange(size_t(0), numClasses), distribute, emClassPartitioner_);
+      }
+    }
 
-      // Print out our progress
-      auto pbthread = std::thread(
-        [&completedJobs, reqNumJobs]() -> bool {
-          auto prevNumJobs = 0;
-          ez::ezETAProgressBar show_progress(reqNumJobs);
-          show_progress.start();
-          while ( prevNumJobs < reqNumJobs ) {
-            if ( prevNumJobs < completedJobs ) {
-              show_progress += completedJobs - prevNumJobs;
+    // Gather the threads' partial masses of transcripts [begin, end) into
+    // emMass_ (and clear them for the next E-step)
+    void gatherLocalMass_(size_t begin, size_t end) {
+        if (!emThreadLocalMass_) { return; }
+        for (auto& local : emLocalMass_) {
+            if (local.empty()) { continue; }
+            for (size_t tid = begin; tid < end; ++tid) {
+                emMass_[tid] = emMass_[tid] + local[tid];
+                local[tid] = 0.0;
             }
-            prevNumJobs = completedJobs.load();
-            boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
-          }
-          if (!show_progress.isDone()) { show_progress.done(); }
-          return true;
+        }
+    }
+
+    /**
+     * Rebuild the active set from the transcripts marked in emActive_.  If
+     * too many classes remain active for the active set to pay off, the
+     * E-step goes on walking every class.
+     */
+    void updateActiveSet_() {
+        auto& ec = equivClasses_;
+        size_t numClasses = ec.numClasses();
+        std::vector<uint8_t> classActive(numClasses, 0);
+        tbb::parallel_for(BlockedIndexRange(size_t(0), numClasses),
+            [&ec, &classActive, this](const BlockedIndexRange& range) -> void {
+              for (auto kid : boost::irange(range.begin(), range.end())) {
+                  for (auto i = ec.offsets[kid]; i < ec.offsets[kid + 1]; ++i) {
+                      if (this->emActive_[ec.transcripts[i]]) { classActive[kid] = 1; break; }
+                  }
+              }
         });
 
-      std::vector<double> rho(transcripts_.size(), 0.0);
+        emActiveClasses_.clear();
+        emFrozenClasses_.clear();
+        for (KmerID kid = 0; kid < numClasses; ++kid) {
+            if (classActive[kid]) { emActiveClasses_.push_back(kid); } else { emFrozenClasses_.push_back(kid); }
+        }
+
+        emActiveSetInUse_ = (emActiveClasses_.size() <= MaxActiveClassFraction * numClasses);
+        emFrozenMassStale_ = emActiveSetInUse_;
+        telemetry_.set("active_classes", emActiveClasses_.size());
+    }
+
+    void EMUpdate_( const std::vector<double>& meansIn, std::vector<double>& meansOut, bool accel) {
+      assert(meansIn.size() == meansOut.size());
+
+      auto& ec = equivClasses_;
+      auto stepStart = OptimizerTelemetry::Clock::now();
+
+      auto& rho = emRho_;
+      auto& expRho = emExpRho_;
     
       size_t numTranscripts = transcripts_.size();
-      double priorAlpha = 0.01;
-      double totalKmerCount = (priorAlpha * numTranscripts) + psum_(kmerGroupCounts_); 
-      double logAlpha0 = boost::math::digamma(totalKmerCount);
-      tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcripts_.size())),
-          // for each kmer group
-          [&completedJobs, &rho, logAlpha0, totalKmerCount, &meansIn, &meansOut, accel, reqNumJobs, this](const BlockedIndexRange& range) -> void {
+      double priorAlpha = PriorAlpha;
+      double totalKmerCount = (priorAlpha * numTranscripts) + psum_(ec.counts);
+      double logAlpha0 = sailfish::math::digamma(totalKmerCount);
+      tbb::parallel_for(BlockedIndexRange(size_t(0), numTranscripts),
+          [&rho, &expRho, logAlpha0, totalKmerCount, &meansIn, accel, this](const BlockedIndexRange& range) -> void {
+            auto begin = range.begin();
+            auto len = range.size();
+            // Gather the counts (into expRho, for now), and take their
+            // digamma as a batch; transcripts that will get no mass are
+            // marked in rho, and given a placeholder count
             for (auto tid : boost::irange(range.begin(), range.end())) {
-                auto& t = this->transcripts_[tid];
-                double tMass = t.totalMass;
+                double tMass = this->emMass_[tid];
                 double currCount = (accel) ? meansIn[tid] * totalKmerCount : tMass;
-                if (currCount >= 1.0 and t.effectiveLength > 0) { 
-                    rho[tid] = boost::math::digamma(currCount) - logAlpha0 + t.logInvEffectiveLength;
-                } else {
-                    rho[tid] = sailfish::math::LOG_0;
+                bool valid = currCount >= 1.0 and this->emLogInvEffLen_[tid] != sailfish::math::LOG_0;
+                rho[tid] = (valid) ? 0.0 : sailfish::math::LOG_0;
+                expRho[tid] = (valid) ? currCount : 1.0;
+                this->emMass_[tid] = 0.0;
+            }
+            sailfish::math::digammaArray(&expRho[begin], &expRho[begin], len);
+            for (auto tid : boost::irange(range.begin(), range.end())) {
+                if (rho[tid] != sailfish::math::LOG_0) {
+                    rho[tid] = expRho[tid] - logAlpha0 + this->emLogInvEffLen_[tid];
                 }
             }
+            sailfish::math::expArray(&rho[begin], &expRho[begin], len);
+            for (auto tid : boost::irange(range.begin(), range.end())) {
+                if (rho[tid] == sailfish::math::LOG_0) { expRho[tid] = 0.0; }
+            }
       });
 
-      tbb::parallel_for(BlockedIndexRange(size_t{0}, transcripts_.size()), [this](const BlockedIndexRange& range) -> void {
-              for (auto tid : boost::irange(range.begin(), range.end())) { this->transcripts_[tid].resetMass();}}
-      ); 
-
       //  E-Step : reassign the kmer group counts proportionally to each transcript
-      tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcriptsForKmer_.size())),
-          // for each kmer group
-          [&completedJobs, &meansIn, &rho, &meansOut, priorAlpha, reqNumJobs, this](const BlockedIndexRange& range) -> void {
-            for (auto kid : boost::irange(range.begin(), range.end())) {
-                // for each transcript containing this kmer group
-                auto kmer = kid;
-                auto& transcripts = this->transcriptsForKmer_[kmer];
+      size_t classesVisited{0};
+      if (emActiveSetInUse_) {
+          // The frozen classes are only walked when they change; emMass_
+          // (which is otherwise clear at this point) is used to gather their mass
+          if (emFrozenMassStale_) {
+              distributeClassMass_(expRho, emFrozenClasses_.data(), emFrozenClasses_.size());
+              emFrozenMass_.resize(numTranscripts);
+              tbb::parallel_for(BlockedIndexRange(size_t(0), numTranscripts),
+                  [this](const BlockedIndexRange& range) -> void {
+                    this->gatherLocalMass_(range.begin(), range.end());
+                    for (auto tid : boost::irange(range.begin(), range.end())) {
+                        this->emFrozenMass_[tid] = this->emMass_[tid];
+                        this->emMass_[tid] = 0.0;
+                    }
+              });
+              classesVisited += emFrozenClasses_.size();
+              emFrozenMassStale_ = false;
+          }
+          distributeClassMass_(expRho, emActiveClasses_.data(), emActiveClasses_.size());
+          classesVisited += emActiveClasses_.size();
+      } else {
+          distributeClassMass_(expRho, nullptr, ec.numClasses());
+          classesVisited += ec.numClasses();
+      }
 
-                double totalMass = 0.0;
-                //double logTotalMass = sailfish::math::LOG_0;
-                /**
-                 * Compute the total mass of all transcripts containing this k-mer
-                 */
-                for ( auto tid : transcripts ) {
+      // M-Step : the new estimated abundance of each transcript is simply the
+      // mass assigned to it (a transcript in no class keeps its old estimate)
+      bool addFrozenMass = emActiveSetInUse_;
+      tbb::parallel_for(BlockedIndexRange(size_t(0), numTranscripts),
+          [&rho, &meansOut, priorAlpha, addFrozenMass, this](const BlockedIndexRange& range) -> void {
+            this->gatherLocalMass_(range.begin(), range.end());
+            for (auto tid : boost::irange(range.begin(), range.end())) {
+                if (this->emNumClasses_[tid] == 0) { continue; }
+                if (addFrozenMass) { this->emMass_[tid] = this->emMass_[tid] + this->emFrozenMass_[tid]; }
+                meansOut[tid] = priorAlpha + this->emMass_[tid];
+                // A transcript that can not be assigned any mass has none of
+                // its k-mers; this is only rarely the case, so the
+                // TranscriptInfo is only visited then (and only once)
+                if (rho[tid] == sailfish::math::LOG_0 and !this->emBinMersZeroed_[tid]) {
                     auto& trans = this->transcripts_[tid];
-                    //totalMass += meansIn[tid] / trans.effectiveLength;
-                    if (rho[tid] != sailfish::math::LOG_0) {
-                        totalMass += std::exp(rho[tid]);
-                        //logTotalMass = sailfish::math::logAdd(logTotalMass, rho[tid]);
+                    if (trans.effectiveLength > 0) {
+                        for (auto& kv : trans.binMers) { kv.second = 0; }
+                        this->emBinMersZeroed_[tid] = 1;
                     }
                 }
+            }
+      });
 
-                double norm = (totalMass >  sailfish::math::EPSILON) ? 1.0 / totalMass : 0.0;
-                for ( auto tid : transcripts ) {
-                  auto& trans = this->transcripts_[tid];
-                  auto lastIndex = trans.binMers.size()  - 1;
-                 
-                  if (trans.effectiveLength > 0) {
-                      if (rho[tid] != sailfish::math::LOG_0) {
-                          auto newMass = std::exp(rho[tid]) * norm * this->kmerGroupCounts_[kmer];
-                          trans.addMass(newMass);
-                      }  else {
-                          trans.binMers[kmer] = 0;
-                      }
-                          
-                  }
 
-                  // M-Step
-                  // If we've seen all of the k-mers that appear in this transcript,
-                  // then we can compute it's new estimated abundance
-                  if (trans.updated++ == lastIndex) {
-                      //trans.mean = meansOut[tid] = this->_computeMean(trans);
-                      //meansOut[tid] = trans.totalMass;// / this->transcripts_[tid].effectiveLength;
-                      meansOut[tid] = priorAlpha + trans.totalMass;
-                      trans.updated.store(0);
-                  }
+          // Make the output a proper probability vector
+          normalize_(meansOut);
+
+          telemetry_.add("em_steps", 1);
+          telemetry_.add("classes_visited", classesVisited);
+          telemetry_.add("em_seconds", OptimizerTelemetry::since(stepStart));
+    }
+
+    /**
+     * Read the estimated number of k-mers of each transcript from a previous
+     * solution: either a snapshot (as written by writeSnapshot) or the
+     * quant.sf file written by writeAbundances.  Transcripts are matched by
+     * name; found[tid] is set for each transcript that appears.
+     */
+    bool readWarmStart_(const std::string& fname, std::vector<double>& mass, std::vector<uint8_t>& found) {
+        mass.assign(transcripts_.size(), 0.0);
+        found.assign(transcripts_.size(), 0);
+        size_t numRead{0};
+        auto record = [&](const std::string& name, double m) -> void {
+            ++numRead;
+            auto tid = transcriptGeneMap_.findTranscriptID(name);
+            if (tid == transcriptGeneMap_.INVALID or tid >= transcripts_.size() or
+                transcriptGeneMap_.transcriptName(tid) != name or !std::isfinite(m)) { return; }
+            mass[tid] = std::max(m, 0.0);
+            found[tid] = 1;
+        };
+
+        std::ifstream ifs(fname, std::ios::binary);
+        if (!ifs.good()) {
+            std::cerr << "could not open " << fname << " to warm-start the optimizer\n";
+            return false;
+        }
+        try {
+            std::vector<std::string> names;
+            std::vector<double> masses;
+            boost::archive::binary_iarchive ia(ifs);
+            ia >> names >> masses;
+            for (size_t i = 0; i < std::min(names.size(), masses.size()); ++i) { record(names[i], masses[i]); }
+        } catch (boost::archive::archive_exception& e) {
+            // Not a snapshot; read it as a quant.sf file, where the estimated
+            // number of k-mers is the 6th column
+            ifs.clear();
+            ifs.seekg(0);
+            std::string line;
+            std::vector<std::string> fields;
+            while (std::getline(ifs, line)) {
+                if (line.empty() or line[0] == '#') { continue; }
+                boost::split(fields, line, boost::is_any_of("\t"));
+                if (fields.size() < 6) { continue; }
+                try {
+                    record(fields[0], std::stod(fields[5]));
+                } catch (std::exception& e) {
+                    continue;
                 }
+            }
+        }
 
-              ++completedJobs;
-            } // for kid in range
-          });
-           
-          // wait for all kmer groups to be processed
-          pbthread.join();
+        size_t numFound = std::count(found.begin(), found.end(), 1);
+        std::cerr << "read " << numRead << " abundances from " << fname << "; " << numFound <<
+                     " of " << transcripts_.size() << " transcripts were found\n";
+        return numFound > 0;
+    }
 
-          // Make the output a proper probability vector
-          normalize_(meansOut);
+    /**
+     * Replace the initial estimate (means, which must sum to 1) with the
+     * solution in warmStartFile_, scaled to the k-mer counts of this sample.
+     */
+    void warmStart_(std::vector<double>& means) {
+        std::vector<double> mass;
+        std::vector<uint8_t> found;
+        if (!readWarmStart_(warmStartFile_, mass, found)) {
+            std::cerr << "starting from the k-mer counts instead\n";
+            return;
+        }
+
+        // A transcript missing from the previous solution keeps its initial
+        // estimate, relative to the transcripts that are present
+        double warmTotal{0.0}, initialTotal{0.0};
+        for (size_t tid = 0; tid < means.size(); ++tid) {
+            if (found[tid]) { warmTotal += mass[tid]; initialTotal += means[tid]; }
+        }
+        if (warmTotal <= 0.0) {
+            std::cerr << "the previous solution assigns no k-mers; starting from the k-mer counts instead\n";
+            return;
+        }
+        double scale = initialTotal / warmTotal;
+
+        std::vector<double> warm(means.size(), 0.0);
+        for (size_t tid = 0; tid < means.size(); ++tid) {
+            warm[tid] = (found[tid]) ? mass[tid] * scale : means[tid];
+            warm[tid] = (1.0 - WarmStartInitialShare) * warm[tid] + WarmStartInitialShare * means[tid];
+        }
+        normalize_(warm);
+
+        // The E-step's weights start from the transcripts' masses (in k-mers)
+        double totalCount = psum_(kmerGroupCounts_);
+        for (size_t tid = 0; tid < means.size(); ++tid) {
+            means[tid] = warm[tid];
+            transcripts_[tid].totalMass = warm[tid] * totalCount;
+        }
+    }
+
+    static inline void atomicAdd_(tbb::atomic<double>& x, double v) {
+        double orig, returned = x;
+        do {
+            orig = returned;
+            returned = x.compare_and_swap(orig + v, orig);
+        } while (returned != orig);
+    }
+
+    // Move the masses between the TranscriptInfo records and the EM's state
+    void loadEMMasses_() {
+        for (size_t tid = 0; tid < transcripts_.size(); ++tid) { emMass_[tid] = transcripts_[tid].totalMass; }
+    }
+    void storeEMMasses_() {
+        for (size_t tid = 0; tid < transcripts_.size(); ++tid) { transcripts_[tid].totalMass = emMass_[tid]; }
     }
 
 
@@ -1386,6 +1750,80 @@ public:
                                  transcriptGeneMap_(transcriptGeneMap), biasIndex_(biasIndex),
                                  numThreads_(numThreads) {}
 
+    /**
+     * Write a record of each phase and iteration of the optimizer (as lines
+     * of JSON) to the given file.
+     */
+    void setTelemetryFile(const std::string& fname) { telemetry_.open(fname); }
+
+    /**
+     * If set, once the EM is close to converging, its E-step skips the
+     * classes whose transcripts have all stopped changing (re-using the mass
+     * they last assigned), and only periodically walks all of them again.
+     * Convergence is only ever declared after such a complete pass.
+     */
+    void setActiveSet(bool activeSet) { emActiveSetEnabled_ = activeSet; }
+
+    /**
+     * If set (and the machine has more than one NUMA node), pin the worker
+     * threads to the nodes, round-robin, and place the state of the EM on
+     * them: each range of classes on the node of the worker that walks it,
+     * and the per-transcript arrays interleaved over all of the nodes.
+     * Must be called before optimize.
+     */
+    void setNUMA(bool numa) {
+        numa_ = numa and NUMAPolicy::available();
+        if (numa_) {
+            numaPinner_.reset(new NUMAThreadPinner);
+            std::cerr << "placing the EM over " << NUMAPolicy::numNodes() << " NUMA nodes\n";
+        } else {
+            numaPinner_.reset();
+            if (numa) { std::cerr << "only one NUMA node; --numa has no effect\n"; }
+        }
+    }
+
+    /**
+     * Start the EM from a previous solution (a snapshot, or a quant.sf file)
+     * rather than from the k-mer counts; for closely related samples, this
+     * converges in far fewer iterations.
+     */
+    void setWarmStart(const std::string& fname) { warmStartFile_ = fname; }
+
+    /**
+     * Write the estimated number of k-mers from each transcript (by name), as
+     * a snapshot from which a later run may be warm-started.  Returns false
+     * (and removes the file) if the snapshot could not be written.
+     */
+    bool writeSnapshot(const boost::filesystem::path& fname) {
+        std::vector<std::string> names(transcripts_.size());
+        std::vector<double> masses(transcripts_.size(), 0.0);
+        for (size_t tid = 0; tid < transcripts_.size(); ++tid) {
+            names[tid] = transcriptGeneMap_.transcriptName(tid);
+            double m = transcripts_[tid].totalMass;
+            masses[tid] = (std::isfinite(m) and m > 0.0) ? m : 0.0;
+        }
+        std::ofstream ofs(fname.string(), std::ios::binary);
+        bool written = ofs.good();
+        if (written) {
+            try {
+                boost::archive::binary_oarchive oa(ofs);
+                oa << names << masses;
+            } catch (boost::archive::archive_exception& e) {
+                written = false;
+            }
+            ofs.flush();
+            written = written and ofs.good();
+            ofs.close();
+            written = written and !ofs.fail();
+        }
+        if (!written) {
+            std::cerr << "could not write the snapshot " << fname << "\n";
+            boost::system::error_code removeError;
+            boost::filesystem::remove(fname, removeError);
+        }
+        return written;
+    }
+
 
     KmerQuantity optimize(const std::string& klutfname,
                           const std::string& tlutfname,
@@ -1402,7 +1840,9 @@ public:
         
         kmerEquivClassFname_ = kmerEquivClassFname;
         const bool discardZeroCountKmers = true;
+        auto initStart = OptimizerTelemetry::Clock::now();
         initialize_(klutfname, tlutfname, kmerEquivClassFname, discardZeroCountKmers);
+        telemetry_.phase("initialize", OptimizerTelemetry::since(initStart));
 
         KmerQuantity globalError {0.0};
         bool done {false};
@@ -1466,6 +1906,8 @@ public:
         std::cerr << "\nThere were " << uniquelyAnchoredTranscripts.load() << " uniquely anchored transcripts\n";
         std::cerr << "There were " << nonZeroTranscripts.load() << " transcripts with at least one overlapping k-mer\n";
         std::cerr << "done\n";
+        if (!warmStartFile_.empty()) { warmStart_(means0); }
+        loadEMMasses_();
         size_t outerIterations = 1;
 
         /**
@@ -1486,9 +1928,13 @@ public:
         if (std::isfinite(maxDelta)) {
             hasConverged = [maxDelta, &accel, this] (std::vector<double>& v0, std::vector<double>& v1) -> bool {
                 double minVal = 1e-7;
-                auto relDiff = this->relAbsDiff_(v0, v1, minVal);
-                double maxRelativeChange = *std::max_element( relDiff.begin(), relDiff.end() );
-                std::cerr << "max relative change: " << maxRelativeChange << "\n";
+                // Which transcripts are still changing is only of interest
+                // after a pass over all of the classes
+                bool track = this->emActiveSetEnabled_ and !this->emActiveSetInUse_;
+                double maxRelativeChange = this->maxRelativeChange_(v0, v1, minVal,
+                                                                    (track) ? &this->emActive_ : nullptr,
+                                                                    ActiveSetTolerance * maxDelta);
+                this->telemetry_.set("max_relative_change", maxRelativeChange);
                 if (maxRelativeChange < 10.0*maxDelta) { accel = true; }// else { accel = true; }
                 return maxRelativeChange < maxDelta;
             };
@@ -1499,39 +1945,54 @@ public:
             };
         }
 
-        std::string clearline = "                                                                                \r\r";
+        emActiveSetInUse_ = false;
+        bool verifyActiveSet{false};
+        size_t sinceActiveSetBuilt{ActiveSetVerifyInterval};
 
         // Until we've reached the specified maximum number of iterations, or hit ourt
         // tolerance threshold
         for ( size_t iter = 0; iter < numIt; ++iter ) {
-            std::string jumpBack = "\x1b[A";
-            std::cerr << clearline << "SQUAREM iteraton [" << iter << "]\n";
-            jumpBack += "\x1b[A";
+          telemetry_.beginIteration("squarem", iter);
 
+          // Every so often (and before convergence is declared) the E-step
+          // walks all of the classes, so that frozen transcripts that have
+          // begun to change again become active
+          bool rebuildActiveSet = verifyActiveSet or sinceActiveSetBuilt >= ActiveSetVerifyInterval;
+          if (rebuildActiveSet) { emActiveSetInUse_ = false; }
 
           // Theta_1 = EMUpdate(Theta_0)
-          std::cerr << clearline << "1/3\n";
+          bool activeStep = emActiveSetInUse_;
           EMUpdate_(means0, means1, accel);
-          jumpBack += "\x1b[A\x1b[A";
           
           // Check for data-driven convergence criteria
-          if (hasConverged(means0, means1)) {
+          bool converged = hasConverged(means0, means1);
+          if (converged and activeStep) {
+              verifyActiveSet = true;
+          } else if (converged) {
+              telemetry_.endIteration();
+              telemetry_.endPhase("squarem");
               std::cerr << "convergence criteria met; terminating SQUAREM\n";
               break;
           }
+
+          // Once the estimates are close to converging, find the classes
+          // that still need to be walked
+          if (emActiveSetEnabled_ and accel and rebuildActiveSet) {
+              updateActiveSet_();
+              verifyActiveSet = false;
+              sinceActiveSetBuilt = 0;
+          }
+          ++sinceActiveSetBuilt;
           
           if (!std::isfinite(negLogLikelihoodOld)) {
             negLogLikelihoodOld = -expectedLogLikelihood_(means0);
           }
 
           // Theta_2 = EMUpdate(Theta_1)
-          std::cerr << clearline << "2/3\n";
           EMUpdate_(means1, means2, accel);
-          jumpBack += "\x1b[A\x1b[A";
 
           double delta = pabsdiff_(means1, means2);
-          std::cerr << clearline << "delta = " << std::setw(6) << std::setfill(' ') << delta << "\n";
-          jumpBack += "\x1b[A";
+          telemetry_.set("delta", delta);
 
           // r = Theta_1 - Theta_0
           // v = (Theta_2 - Theta_1) - r
@@ -1560,10 +2021,8 @@ public:
 
           // Stabilization step
           if (std::abs(alphaS - 1.0) > 0.01) {
-              std::cerr << clearline << "alpha = " <<  std::setw(6) << std::setfill(' ') << alphaS << ". ";
-            std::cerr << "Performing a stabilization step.\n";
+            telemetry_.set("stabilized", 1);
             EMUpdate_(meansPrime, meansPrime, accel);
-            jumpBack += "\x1b[A\x1b[A";
           }
 
           
@@ -1588,7 +2047,7 @@ public:
             if (alphaS == maxStep) { maxStep = std::max(maxStep0, maxStep/mStep); }
             alphaS = 1.0;
           }
-          std::cerr << clearline << "alpha = " << std::setw(6) << std::setfill(' ') << alphaS << ", ";
+          telemetry_.set("alpha", alphaS);
           //}
 
           if (alphaS == maxStep) { maxStep = mStep * maxStep; }
@@ -1596,27 +2055,185 @@ public:
           std::swap(meansPrime, means0);
 
           if (!std::isnan(negLogLikelihoodNew)) {
-            std::cerr << "negLogLikelihood = " << std::setw(6) << std::setfill(' ') << negLogLikelihoodNew << "\n";
-            jumpBack += "\x1b[A";
+            telemetry_.set("neg_log_likelihood", negLogLikelihoodNew);
             negLogLikelihoodOld = negLogLikelihoodNew;
 
           }
-        
-          // If it's not the final iteration, then jump back and clear the console.
-          if (iter < numIt - 1) { std::cerr << jumpBack; }
 
+          telemetry_.endIteration();
         }
+        telemetry_.endPhase("squarem");
+        emActiveSetInUse_ = false;
+        storeEMMasses_();
 
     }
 
 
+    /**
+     * Estimate the uncertainty in the abundances by a parametric (Poisson)
+     * bootstrap: each replicate draws the count of every equivalence class
+     * from a Poisson distribution with the observed count as its mean, and
+     * re-runs the EM on those counts, starting from the solution found by
+     * optimize (which must be called first).  The replicates are scheduled
+     * on the (shared) TBB thread pool, one replicate per task, and each is
+     * appended to outputFile as soon as it is done.  The 2.5% and 97.5%
+     * quantiles of each transcript's fraction become its fracLow and fracHigh
+     * (so that writeAbundances may report them).
+     *
+     * outputFile begins with the number of transcripts and of replicates (as
+     * 64-bit integers), followed by one record per replicate: its index (a
+     * 64-bit integer) and the estimated number of k-mers from each
+     * transcript (as 32-bit floats, in the order of quant.sf).  The records
+     * are in the order in which the replicates finished.  Returns false (and
+     * removes outputFile) if the replicates could not be written.
+     */
+    bool bootstrap(size_t numBootstraps, size_t maxIter, double maxDelta,
+                   const boost::filesystem::path& outputFile, uint64_t seed=271828) {
+        using sailfish::math::LOG_0;
+        if (numBootstraps == 0) { return true; }
+
+        auto start = OptimizerTelemetry::Clock::now();
+        auto& ec = equivClasses_;
+        size_t numTranscripts = transcripts_.size();
+        size_t numClasses = ec.numClasses();
+
+        // Every replicate starts from the solution
+        std::vector<double> solution(numTranscripts, 0.0);
+        for (size_t tid = 0; tid < numTranscripts; ++tid) {
+            double m = transcripts_[tid].totalMass;
+            solution[tid] = (std::isfinite(m) and m > 0.0) ? m : 0.0;
+        }
+
+        std::ofstream ofs(outputFile.string(), std::ios::binary);
+        if (!ofs.good()) {
+            std::cerr << "could not open " << outputFile << " for writing; not bootstrapping\n";
+            return false;
+        }
+        uint64_t header[2] = {numTranscripts, numBootstraps};
+        ofs.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        std::cerr << "Computing " << numBootstraps << " bootstrap replicates\n";
+        std::vector<float> fractions(numBootstraps * numTranscripts, 0.0f);
+        std::mutex outputMutex;
+        size_t numDone{0};
+
+        tbb::parallel_for(BlockedIndexRange(size_t(0), numBootstraps, 1),
+          [&, this](const BlockedIndexRange& range) -> void {
+            std::vector<double> counts(numClasses, 0.0);
+            std::vector<double> mass(numTranscripts), nextMass(numTranscripts);
+            std::vector<double> rho(numTranscripts), expRho(numTranscripts);
+            std::vector<float> record(numTranscripts);
+
+            for (auto rep = range.begin(); rep != range.end(); ++rep) {
+                std::seed_seq seq{seed, static_cast<uint64_t>(rep)};
+                std::mt19937_64 gen(seq);
+                for (size_t kid = 0; kid < numClasses; ++kid) {
+                    double c = ec.counts[kid];
+                    counts[kid] = (c > 0.0) ? std::poisson_distribution<uint64_t>(c)(gen) : 0.0;
+                }
+
+                // The same update as EMUpdate_ (the common digamma of the
+                // total count cancels out of every class), including its prior
+                std::copy(solution.begin(), solution.end(), mass.begin());
+                for (size_t it = 0; it < maxIter; ++it) {
+                    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                        bool valid = mass[tid] >= 1.0 and this->emLogInvEffLen_[tid] != LOG_0;
+                        rho[tid] = (valid) ? 0.0 : LOG_0;
+                        expRho[tid] = (valid) ? mass[tid] : 1.0;
+                    }
+                    sailfish::math::digammaArray(expRho.data(), expRho.data(), numTranscripts);
+                    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                        if (rho[tid] != LOG_0) { rho[tid] = expRho[tid] + this->emLogInvEffLen_[tid]; }
+                    }
+                    sailfish::math::expArray(rho.data(), expRho.data(), numTranscripts);
+                    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                        if (rho[tid] == LOG_0) { expRho[tid] = 0.0; }
+                    }
+
+                    std::fill(nextMass.begin(), nextMass.end(), 0.0);
+                    for (size_t kid = 0; kid < numClasses; ++kid) {
+                        if (counts[kid] == 0.0) { continue; }
+                        auto begin = ec.transcripts.data() + ec.offsets[kid];
+                        auto end = ec.transcripts.data() + ec.offsets[kid + 1];
+                        double totalMass = 0.0;
+                        for (auto t = begin; t != end; ++t) { totalMass += expRho[*t]; }
+                        if (totalMass <= sailfish::math::EPSILON) { continue; }
+                        double scale = counts[kid] / totalMass;
+                        for (auto t = begin; t != end; ++t) { nextMass[*t] += expRho[*t] * scale; }
+                    }
+                    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                        nextMass[tid] = (this->emNumClasses_[tid] == 0) ? mass[tid] : PriorAlpha + nextMass[tid];
+                    }
+
+                    // The convergence criterion of optimize, on the fractions
+                    double oldTotal = std::accumulate(mass.begin(), mass.end(), 0.0);
+                    double newTotal = std::accumulate(nextMass.begin(), nextMass.end(), 0.0);
+                    double oldNorm = (oldTotal > 0.0) ? 1.0 / oldTotal : 0.0;
+                    double newNorm = (newTotal > 0.0) ? 1.0 / newTotal : 0.0;
+                    double minVal = 1e-7;
+                    double maxRelativeChange = 0.0;
+                    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                        double oldVal = mass[tid] * oldNorm;
+                        double newVal = nextMass[tid] * newNorm;
+                        if (oldVal > minVal or newVal > minVal) {
+                            maxRelativeChange = std::max(maxRelativeChange, std::abs(newVal - oldVal) / oldVal);
+                        }
+                    }
+                    std::swap(mass, nextMass);
+                    if (maxRelativeChange < maxDelta) { break; }
+                }
+
+                double total = std::accumulate(mass.begin(), mass.end(), 0.0);
+                double norm = (total > 0.0) ? 1.0 / total : 0.0;
+                float* repFractions = &fractions[rep * numTranscripts];
+                for (size_t tid = 0; tid < numTranscripts; ++tid) {
+                    record[tid] = mass[tid];
+                    repFractions[tid] = mass[tid] * norm;
+                }
+
+                std::lock_guard<std::mutex> lock(outputMutex);
+                uint64_t repIndex = rep;
+                ofs.write(reinterpret_cast<const char*>(&repIndex), sizeof(repIndex));
+                ofs.write(reinterpret_cast<const char*>(record.data()), sizeof(float) * numTranscripts);
+                std::cerr << "\rfinished " << ++numDone << " of " << numBootstraps << " bootstrap replicates";
+            }
+        });
+        std::cerr << "\n";
+        ofs.flush();
+        bool written = ofs.good();
+        ofs.close();
+        if (!written or ofs.fail()) {
+            std::cerr << "could not write the bootstrap replicates to " << outputFile << "\n";
+            boost::system::error_code removeError;
+            boost::filesystem::remove(outputFile, removeError);
+            return false;
+        }
+
+        // The confidence interval of each transcript's (nucleotide) fraction
+        tbb::parallel_for(BlockedIndexRange(size_t(0), numTranscripts),
+          [&, this](const BlockedIndexRange& range) -> void {
+            std::vector<float> samples(numBootstraps);
+            size_t lowRank = static_cast<size_t>(std::floor(0.025 * (numBootstraps - 1)));
+            size_t highRank = static_cast<size_t>(std::ceil(0.975 * (numBootstraps - 1)));
+            for (auto tid = range.begin(); tid != range.end(); ++tid) {
+                for (size_t rep = 0; rep < numBootstraps; ++rep) {
+                    samples[rep] = fractions[rep * numTranscripts + tid];
+                }
+                std::nth_element(samples.begin(), samples.begin() + lowRank, samples.end());
+                this->transcripts_[tid].fracLow = samples[lowRank];
+                std::nth_element(samples.begin(), samples.begin() + highRank, samples.end());
+                this->transcripts_[tid].fracHigh = samples[highRank];
+            }
+        });
+        telemetry_.phase("bootstrap", OptimizerTelemetry::since(start));
+        return true;
+    }
+
     void writeAbundances(const boost::filesystem::path& outputFilePath,
                          const std::string& headerLines,
                          double minAbundance,
                          bool haveCI) {
 
-        haveCI = false;
-
         std::cerr << "Writing output\n";
         ez::ezETAProgressBar pb(transcripts_.size());
         pb.start();
@@ -1795,7 +2412,9 @@ public:
          kmerEquivClassFname_ = kmerEquivClassFname;
         // Prepare the necessary structures
         const bool discardZeroCountKmers = false;
+        auto initStart = OptimizerTelemetry::Clock::now();
         initialize_(klutfname, tlutfname, kmerEquivClassFname, discardZeroCountKmers);
+        telemetry_.phase("initialize", OptimizerTelemetry::since(initStart));
 
         const size_t numTranscripts = transcripts_.size();
         const size_t numKmers = transcriptsForKmer_.size();
@@ -1805,11 +2424,10 @@ public:
         if (std::isfinite(maxDelta)) {
             hasConverged = [maxDelta, this] (std::vector<double>& v0, std::vector<double>& v1) -> bool {
                 double maxVal = *std::max_element(v1.begin(), v1.end());
-                std::cerr << "maxVal: " << maxVal << "\n";
                 double minVal = 1e-7;
-                auto relDiff = this->relAbsDiff_(v0, v1, minVal);
-                double maxRelativeChange = *std::max_element( relDiff.begin(), relDiff.end() );
-                std::cerr << "max relative change: " << maxRelativeChange << "\n";
+                double maxRelativeChange = this->maxRelativeChange_(v0, v1, minVal);
+                this->telemetry_.set("max_value", maxVal);
+                this->telemetry_.set("max_relative_change", maxRelativeChange);
                 return maxRelativeChange < maxDelta;
             };
         } else {
@@ -1894,50 +2512,48 @@ public:
 
         std::vector<double> expctedLogThetas(transcripts_.size(), 0.0);
         std::vector<double> logRho(transcripts_.size(), -std::numeric_limits<double>::infinity());
-        std::string clearline = "                                                                                \r\r";
-
+        std::vector<double> rho(transcripts_.size(), 0.0);
 
         for (size_t currIt : boost::irange({0}, numIt)) {
-            std::string jumpBack = "\x1b[A";
-            std::cerr << clearline << "iteration : " << currIt << "\n";
+            telemetry_.beginIteration("vb", currIt);
             // log rho_{ntsoa} = E_{theta}[log theta_t] + log P(S_n | T_n) + [other terms sum to 0]
             // E_{theta}[log theta_t] = digamma(alpha_t) - digamma(\sum_{t'} alpha_{t'})
             double sumAlpha = psum_(posteriorAlphas);
-            double digammaSumAlpha = boost::math::digamma(sumAlpha);
+            double digammaSumAlpha = sailfish::math::digamma(sumAlpha);
+            // Take the digamma of all of the alphas as a batch (with a
+            // placeholder where there is no alpha), then the exp of logRho
+            for (size_t i : boost::irange({0}, numTranscripts)) {
+                logRho[i] = (posteriorAlphas[i] > 0.0) ? posteriorAlphas[i] : 1.0;
+            }
+            sailfish::math::digammaArray(logRho.data(), logRho.data(), numTranscripts);
             for (size_t i : boost::irange({0}, numTranscripts)) {
                 auto& ts = transcripts_[i];
-                //double digammaAlphaT = boost::math::digamma(posteriorAlphas[i]);
-
                 logRho[i] = (ts.effectiveLength > 0 and posteriorAlphas[i] > 0.0) ?
-                    (boost::math::digamma(posteriorAlphas[i]) - digammaSumAlpha) + std::log(1.0 / ts.effectiveLength) :
+                    (logRho[i] - digammaSumAlpha) + std::log(1.0 / ts.effectiveLength) :
                     -std::numeric_limits<double>::infinity();
             }
+            // exp(-infinity) = 0, so rho is 0 wherever logRho was not set
+            sailfish::math::expArray(logRho.data(), rho.data(), numTranscripts);
 
             std::atomic<size_t> numUpdated{0};
 
             //  E-Step : reassign the kmer group counts proportionally to each transcript
             tbb::parallel_for(BlockedIndexRange(size_t(0), numKmers),
                  // for each kmer group
-                 [&meansOld, &meansNew, &logRho, &posteriorAlphas, &numUpdated, DirichletPriorAlpha, this](const BlockedIndexRange& range) -> void {
+                 [&meansOld, &meansNew, &rho, &posteriorAlphas, &numUpdated, DirichletPriorAlpha, this](const BlockedIndexRange& range) -> void {
                      for (auto kid : boost::irange(range.begin(), range.end())) {
                          auto kmer = kid;
                          // for each transcript containing this kmer group
-                         auto& transcripts = this->transcriptsForKmer_[kmer];
+                         auto transcripts = this->transcriptsForKmer_[kmer];
 
                          double totalMass = 0.0;
-                         for ( auto tid : transcripts ) {
-                             auto el = this->transcripts_[tid].effectiveLength;
-                             double rho = (el > 0) ? std::exp(logRho[tid]) : 0.0;
-                             totalMass += rho;
-                         }
+                         for ( auto tid : transcripts ) { totalMass += rho[tid]; }
 
                          double norm = (totalMass > 0.0) ? (1.0 / totalMass) : 0.0;
                          for ( auto tid : transcripts ) {
                              auto& trans = this->transcripts_[tid];
                              auto lastIndex = trans.binMers.size()  - 1;
-                             auto el = trans.effectiveLength;
-                             double rho = (el > 0) ? std::exp(logRho[tid]) : 0.0;
-                             trans.binMers[kmer] = rho * norm *
+                             trans.binMers[kmer] = rho[tid] * norm *
                                  kmerGroupBiases_[kmer] * this->kmerGroupCounts_[kmer];
 
                              // If we've seen all of the k-mers that appear in this transcript,
@@ -1967,12 +2583,10 @@ public:
                      } // for kid in range
            });
 
-            std::cerr << clearline << "numUpdated = " << numUpdated << " : numTranscripts = " << numTranscripts << "\n";
-            jumpBack += "\x1b[A";
+            telemetry_.set("num_updated", numUpdated);
 
             auto posteriorAlphaSum = psum_(posteriorAlphas);
-            std::cerr << clearline << "posterior alpha sum: " << posteriorAlphaSum << "\n";
-            jumpBack += "\x1b[A";
+            telemetry_.set("posterior_alpha_sum", posteriorAlphaSum);
             for (size_t i : boost::irange({0}, numTranscripts)) {
                 meansNew[i] = posteriorAlphas[i] / posteriorAlphaSum;
                 transcripts_[i].mean = meansNew[i];
@@ -1980,10 +2594,11 @@ public:
 
             // Check for data-driven convergence criteria
             if (hasConverged(meansOld, meansNew)) {
-              std::cerr << clearline << "convergence criteria met; terminating VB\n";
+              telemetry_.endIteration();
+              telemetry_.endPhase("vb");
+              std::cerr << "convergence criteria met; terminating VB\n";
               break;
             }
-            jumpBack += "\x1b[A";
 
             std::swap(meansNew, meansOld);
 
@@ -1995,10 +2610,10 @@ public:
                 filterByCoverage_(cutoff, posteriorAlphas);
             }
 
-            std::cerr << clearline << "cutoff = " << cutoff << "\n";
-            jumpBack += "\x1b[A";
-            std::cerr << jumpBack;
+            telemetry_.set("cutoff", cutoff);
+            telemetry_.endIteration();
         }
+        telemetry_.endPhase("vb");
 
         // Compute the confidence intervals for the expression values
         // The marginal for each transcript fraction takes the form of a Beta distribution
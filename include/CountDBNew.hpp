@@ -29,11 +29,15 @@
 #include <limits>
 #include <algorithm>
 #include <memory>
+#include <stdexcept>
+#include <string>
 
 #include <sys/mman.h>
 
 #include "tbb/concurrent_hash_map.h"
 #include "PerfectHashIndex.hpp"
+#include "MemoryMappedFile.hpp"
+#include "NUMAPolicy.hpp"
 
 /**
 *  This class provides low-overhead access to the counts of various
@@ -52,6 +56,9 @@ class CountDBNew {
    // We'll return this invalid id if a kmer is not found in our DB
    size_t INVALID = std::numeric_limits<size_t>::max();
 
+   // The version of the mapped count layout written by dumpCountsToFile
+   static constexpr uint32_t CountsVersion = 2;
+
    CountDBNew( std::shared_ptr<PerfectHashIndex>& index ) : 
       index_(index), counts_( std::vector< AtomicCount >( index->numKeys() ) ),
       length_(0), numLengths_(0) {}
@@ -63,23 +70,30 @@ class CountDBNew {
     numLengths_ = other.numLengths_.load();
    }
 
+   /**
+    * Load the counts written by dumpCountsToFile.  Counts in the mapped
+    * layout are mapped copy-on-write: they are shared (through the page
+    * cache) with other processes until they are modified.
+    */
    static CountDBNew fromFile( const std::string& fname, std::shared_ptr<PerfectHashIndex>& index ) {
-    std::ifstream in(fname, std::ios::in | std::ios::binary );
-
-    // Read in the total read length and # of reads
-    uint64_t length = 0;
-    uint64_t numLengths = 0;
-    in.read(reinterpret_cast<char*>(&length), sizeof(length));
-    in.read(reinterpret_cast<char*>(&numLengths), sizeof(numLengths));
+    auto file = std::make_shared<MemoryMappedFile>(fname, true);
+    auto header = file->header(MappedFileKind::COUNTS);
+    if (header == nullptr) { return fromLegacyFile_(fname, index); }
+    if (header->version != CountsVersion) {
+      throw std::runtime_error("count file " + fname + " has unsupported version " +
+                               std::to_string(header->version));
+    }
 
+    uint64_t length = header->values[0];
+    uint64_t numLengths = header->values[1];
     std::cerr << "read length = " << length << ", numLengths = " << numLengths << "\n";
-    // Read in the count vector
-    std::vector<AtomicCount> counts(index->numKeys());
-    in.read( reinterpret_cast<char*>(&counts[0]), sizeof(AtomicCount) * index->numKeys() );
-    in.close();
 
-    CountDBNew cdb(index);
-    cdb.counts_ = std::move(counts);
+    MappedArray<AtomicCount> counts(file, header->sections[0]);
+    if (counts.size() != index->numKeys()) {
+      throw std::runtime_error("count file " + fname + " does not match the index");
+    }
+
+    CountDBNew cdb(index, std::move(counts));
     cdb.length_ = length;
     cdb.numLengths_ = numLengths;
     return cdb;
@@ -108,7 +122,7 @@ class CountDBNew {
       return (idx == INVALID) ? 0 : counts_[idx].load();
    }
 
-   std::vector<AtomicCount>::size_type size() { return counts_.size(); }
+   size_t size() { return counts_.size(); }
 
    // increment the count for kmer 'k' by 'amt'
    // returns true if k existed in the database and false otherwise
@@ -119,10 +133,15 @@ class CountDBNew {
     return valid;
    }
 
-   inline void incAtIndex(std::vector<AtomicCount>::size_type idx, uint32_t amt=1) {
+   inline void incAtIndex(size_t idx, uint32_t amt=1) {
      counts_[idx] += amt;
    }
 
+   // Hint that the count at idx is about to be incremented
+   inline void prefetchAtIndex(size_t idx) {
+     __builtin_prefetch(&counts_[idx], 1);
+   }
+
    void will_need(uint32_t threadIdx, uint32_t numThreads) {
      auto pageSize = sysconf(_SC_PAGESIZE);
      size_t numPages{0};
@@ -142,25 +161,129 @@ class CountDBNew {
      }
    }
 
+   // Interleave the pages of the counts over the NUMA nodes; returns false
+   // if they were left where they are
+   bool interleave() {
+     return NUMAPolicy::interleave(counts_.data(), sizeof(AtomicCount) * counts_.size());
+   }
+
    bool dumpCountsToFile( const std::string& fname ) {
-    std::ofstream counts(fname, std::ios::out | std::ios::binary );
-    uint64_t length = length_.load();
-    uint64_t numLengths = numLengths_.load();
-    counts.write(reinterpret_cast<char*>(&length), sizeof(length));
-    counts.write(reinterpret_cast<char*>(&numLengths), sizeof(numLengths));
-    size_t numCounts = counts_.size();
-    counts.write( reinterpret_cast<char*>(&counts_[0]), sizeof(counts_[0]) * numCounts );
-    counts.close();
+    MappedFileWriter out(fname, MappedFileKind::COUNTS, CountsVersion);
+    out.setValue(0, length_.load());
+    out.setValue(1, numLengths_.load());
+    out.addSection(counts_.data(), counts_.size());
+    return out.close();
    }
 
    inline uint32_t kmerLength() { return index_->kmerLength(); }
-   const std::vector<Kmer>& kmers() { return index_->kmers(); }
+   const MappedArray<Kmer>& kmers() { return index_->kmers(); }
   private:
+   CountDBNew( std::shared_ptr<PerfectHashIndex>& index, MappedArray<AtomicCount>&& counts ) :
+      index_(index), counts_(std::move(counts)), length_(0), numLengths_(0) {}
+
+   static CountDBNew fromLegacyFile_( const std::string& fname, std::shared_ptr<PerfectHashIndex>& index ) {
+    std::ifstream in(fname, std::ios::in | std::ios::binary );
+
+    // Read in the total read length and # of reads
+    uint64_t length = 0;
+    uint64_t numLengths = 0;
+    in.read(reinterpret_cast<char*>(&length), sizeof(length));
+    in.read(reinterpret_cast<char*>(&numLengths), sizeof(numLengths));
+
+    std::cerr << "read length = " << length << ", numLengths = " << numLengths << "\n";
+    // Read in the count vector
+    std::vector<AtomicCount> counts(index->numKeys());
+    in.read( reinterpret_cast<char*>(&counts[0]), sizeof(AtomicCount) * index->numKeys() );
+    in.close();
+
+    CountDBNew cdb(index, MappedArray<AtomicCount>(std::move(counts)));
+    cdb.length_ = length;
+    cdb.numLengths_ = numLengths;
+    return cdb;
+   }
+
     std::shared_ptr<PerfectHashIndex> index_;
-    std::vector< AtomicCount > counts_;
+    MappedArray< AtomicCount > counts_;
     AtomicLength length_;
     AtomicLengthCount numLengths_;
 };
 
+/**
+*  A small, fixed-size, thread-local table of pending count increments
+*  for a CountDBNew.  Increments to k-mers that are resident in the table
+*  are accumulated locally, without touching the shared count vector.
+*  Each key may only live in a short probe window of the table; when the
+*  window is full, the entry with the smallest pending count is flushed
+*  to the shared counts to make room.  Thus, the table tends to retain the
+*  most frequently incremented (hottest) k-mers, while its memory use is
+*  bounded by its capacity regardless of the size of the index.
+**/
+class CountShard {
+  using Count = uint32_t;
+  using Index = uint64_t;
+
+  struct Entry {
+    Index idx;
+    Count count;
+  };
+
+  // Number of consecutive slots in which a given key may reside
+  static constexpr size_t ProbeWindow = 8;
+  // Flush an entry once its pending count reaches this value
+  static constexpr Count MaxPending = std::numeric_limits<Count>::max() >> 1;
+
+  public:
+   /**
+   * @param db the database to which the pending counts are flushed
+   * @param logCapacity the table will hold (at most) 2^logCapacity k-mers
+   **/
+   CountShard( CountDBNew& db, uint32_t logCapacity=16 ) :
+     db_(db), mask_((size_t(1) << logCapacity) - 1),
+     entries_(size_t(1) << logCapacity, Entry{EMPTY, 0}) {}
+
+   ~CountShard() { flush(); }
+
+   inline void incAtIndex(Index idx) {
+     size_t slot = hash_(idx) & mask_;
+     size_t victim = slot;
+     for (size_t i = 0; i < ProbeWindow; ++i) {
+       auto& e = entries_[(slot + i) & mask_];
+       if (e.idx == idx) {
+         if (++e.count == MaxPending) { db_.incAtIndex(e.idx, e.count); e.count = 0; }
+         return;
+       }
+       if (e.idx == EMPTY) { e.idx = idx; e.count = 1; return; }
+       if (e.count < entries_[victim].count) { victim = (slot + i) & mask_; }
+     }
+     // The window is full; evict the coldest entry in favor of this one.
+     auto& e = entries_[victim];
+     db_.incAtIndex(e.idx, e.count);
+     e.idx = idx; e.count = 1;
+   }
+
+   // Add all pending counts to the shared database and empty the table
+   void flush() {
+     for (auto& e : entries_) {
+       if (e.idx != EMPTY and e.count > 0) { db_.incAtIndex(e.idx, e.count); }
+       e.idx = EMPTY; e.count = 0;
+     }
+   }
+
+  private:
+   static constexpr Index EMPTY = std::numeric_limits<Index>::max();
+
+   // The finalizer of MurmurHash3; k-mer indices are not uniformly distributed
+   inline static uint64_t hash_(uint64_t x) {
+     x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+     x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+     x ^= x >> 33;
+     return x;
+   }
+
+   CountDBNew& db_;
+   size_t mask_;
+   std::vector<Entry> entries_;
+};
+
 
 #endif // COUNTDBNEW_HPP
\ No newline at end of file
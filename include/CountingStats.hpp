@@ -0,0 +1,143 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __COUNTING_STATS_HPP__
+#define __COUNTING_STATS_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * The work done by a single counting thread.  Reading a clock around every
+ * stage of every read would cost more than some of the stages themselves,
+ * so the stages are only timed on every TimingStride-th read; the stage
+ * times reported are extrapolated from those reads.
+ */
+struct CountingThreadStats {
+  static constexpr uint64_t TimingStride = 16;
+
+  uint64_t reads{0};
+  uint64_t kmers{0};
+  uint64_t timedReads{0};
+  // Nanoseconds, over the timed reads only
+  uint64_t parseNs{0};     // waiting on the parser for the next read
+  uint64_t encodeNs{0};    // encoding the read into k-mers
+  uint64_t hashNs{0};      // resolving the k-mers in the index
+  uint64_t incrementNs{0}; // incrementing the counts
+  double wallSeconds{0.0};
+
+  // The estimated total seconds spent in a stage (given its timed ns)
+  inline double extrapolate(uint64_t ns) const {
+    return (timedReads == 0) ? 0.0 : (ns * 1e-9) * (static_cast<double>(reads) / timedReads);
+  }
+};
+
+/**
+ * Periodically samples the number of reads waiting in the queue of each
+ * streaming parser.  A queue that is usually empty means the counting
+ * threads are starved for input (I/O or decompression bound), while one
+ * that is usually full means the parser is ahead of them.
+ */
+class QueueOccupancySampler {
+public:
+  struct Queue {
+    std::string file;
+    size_t capacity;
+    std::function<size_t()> size;
+    uint64_t samples{0};
+    uint64_t emptySamples{0};
+    uint64_t fullSamples{0};
+    double sumSize{0.0};
+    size_t maxSize{0};
+  };
+
+  explicit QueueOccupancySampler(std::chrono::milliseconds interval=std::chrono::milliseconds(100));
+  ~QueueOccupancySampler();
+
+  void addQueue(const std::string& file, size_t capacity, std::function<size_t()> size);
+  void start();
+  void stop();
+  inline const std::vector<Queue>& queues() const { return queues_; }
+
+private:
+  void sample_();
+
+  std::chrono::milliseconds interval_;
+  std::vector<Queue> queues_;
+  bool running_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+};
+
+/**
+ * Hardware counters (through perf_event_open) for this process and every
+ * thread it creates once they are opened.  Counters the kernel will not
+ * provide (e.g. under a restrictive perf_event_paranoid, or in a virtual
+ * machine) are simply omitted.
+ */
+class PerfCounters {
+public:
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  inline bool available() const { return !counters_.empty(); }
+  void start();
+  void stop();
+  // The name and value of each counter that could be opened
+  std::vector<std::pair<std::string, uint64_t>> read() const;
+
+private:
+  std::vector<std::pair<std::string, int>> counters_;
+};
+
+/**
+ * Everything recorded about one run of the counting phase.
+ */
+struct CountingStats {
+  std::vector<CountingThreadStats> threads;
+  std::vector<QueueOccupancySampler::Queue> queues;
+  std::vector<std::pair<std::string, uint64_t>> perf;
+  double wallSeconds{0.0};
+
+  // The extrapolated seconds spent, over all threads, in each stage
+  double parseSeconds() const;
+  double encodeSeconds() const;
+  double hashSeconds() const;
+  double incrementSeconds() const;
+  // The most reads handled by any thread, relative to the mean
+  double readImbalance() const;
+
+  void writeJSON(std::ostream& out) const;
+};
+
+#endif // __COUNTING_STATS_HPP__
@@ -0,0 +1,67 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __EQUIV_CLASS_BUILDER_HPP__
+#define __EQUIV_CLASS_BUILDER_HPP__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "LookUpTableUtils.hpp"
+
+/**
+ * Partitions the k-mers into equivalence classes: two k-mers are equivalent
+ * if they occur the same number of times in every transcript.  Rather than
+ * refining a partition one transcript at a time (which must be done
+ * serially), each k-mer accumulates a 128-bit signature --- the sum, over
+ * the transcripts in which it occurs, of a hash of the transcript and the
+ * number of occurrences.  The sum doesn't depend on the order in which the
+ * transcripts are added, so they may be added concurrently; k-mers with
+ * equal signatures are in the same class (barring a collision, with
+ * probability ~ n^2 / 2^128 for n classes).  K-mers that occur in no
+ * transcript form a single class.
+ *
+ * The classes are labeled in order of their first k-mer, which is how the
+ * (serial) partition refinement labeled them as well; so the memberships
+ * don't depend on the order in which the transcripts were added.
+ */
+class EquivClassBuilder {
+public:
+  explicit EquivClassBuilder(LUTTools::KmerID numKmers);
+
+  // Add the k-mers of a transcript (in any order, with repeats); may be
+  // called concurrently
+  void addTranscript(LUTTools::TranscriptID transcriptID, const std::vector<LUTTools::KmerID>& kmers);
+
+  // Once every transcript has been added, label the classes [0, #classes)
+  void relabel();
+  // The class of each k-mer (once relabeled)
+  const std::vector<LUTTools::KmerID>& partitionMembership() const { return membership_; }
+
+private:
+  LUTTools::KmerID numKmers_;
+  // The low and high words of the signature of k-mer i are at 2i and 2i+1
+  std::unique_ptr<std::atomic<uint64_t>[]> signatures_;
+  std::vector<LUTTools::KmerID> membership_;
+};
+
+#endif // __EQUIV_CLASS_BUILDER_HPP__
@@ -0,0 +1,252 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __KMER_ENCODER_HPP__
+#define __KMER_ENCODER_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Encodes an entire read (or transcript) at once.  A single pass converts
+ * the ASCII sequence to 2-bit codes (vectorized where the target supports
+ * it), records the positions of any non-nucleotide characters, and produces
+ * the arrays of forward and reverse-complement k-mers for every window that
+ * consists only of nucleotides.
+ *
+ * The encoding agrees with Jellyfish's: A,C,G,T (in either case) map to
+ * 0,1,2,3; newlines are skipped; any other character (e.g. 'N') resets the
+ * current k-mer.
+ */
+class KmerEncoder {
+  using Kmer = uint64_t;
+
+  public:
+   // Codes of the characters that are not nucleotides
+   static constexpr uint8_t CODE_RESET = 4;
+   static constexpr uint8_t CODE_IGNORE = 5;
+
+   explicit KmerEncoder(uint32_t merLen) :
+     merLen_(merLen),
+     lshift_(2 * (merLen - 1)),
+     masq_((merLen >= 32) ? ~Kmer(0) : ((Kmer(1) << (2 * merLen)) - 1)),
+     numKmers_(0) {
+     for (size_t i = 0; i < 256; ++i) { codeTable_[i] = CODE_RESET; }
+     codeTable_['A'] = codeTable_['a'] = 0;
+     codeTable_['C'] = codeTable_['c'] = 1;
+     codeTable_['G'] = codeTable_['g'] = 2;
+     codeTable_['T'] = codeTable_['t'] = 3;
+     codeTable_['\n'] = codeTable_['\r'] = CODE_IGNORE;
+   }
+
+   /**
+    * Encode the sequence [seq, seq+len).
+    *
+    * @return the number of (valid) k-mers in the sequence
+    */
+   size_t encode(const char* seq, size_t len) {
+     if (len > codes_.size()) { codes_.resize(len); }
+     // There can be no more k-mers than windows of the sequence
+     size_t maxNumKmers = (len >= merLen_) ? len - merLen_ + 1 : 0;
+     if (maxNumKmers > fwdMers_.size()) {
+       fwdMers_.resize(maxNumKmers);
+       revMers_.resize(maxNumKmers);
+       kmerEnds_.resize(maxNumKmers);
+     }
+     nPositions_.clear();
+
+     bool clean = toCodes_(seq, len);
+     numKmers_ = (clean) ? rollClean_(len) : roll_(len);
+     return numKmers_;
+   }
+
+   /**
+    * Encode a sequence which has already been converted to codes (e.g. by
+    * unpacking a 2-bit sequence store); every code must be < 4 or CODE_RESET.
+    *
+    * @return the number of (valid) k-mers in the sequence
+    */
+   size_t encodeCodes(const uint8_t* codes, size_t len) {
+     if (len > codes_.size()) { codes_.resize(len); }
+     size_t maxNumKmers = (len >= merLen_) ? len - merLen_ + 1 : 0;
+     if (maxNumKmers > fwdMers_.size()) {
+       fwdMers_.resize(maxNumKmers);
+       revMers_.resize(maxNumKmers);
+       kmerEnds_.resize(maxNumKmers);
+     }
+     nPositions_.clear();
+
+     bool clean = true;
+     for (size_t i = 0; i < len; ++i) {
+       codes_[i] = codes[i];
+       if (codes[i] > 3) { clean = false; }
+     }
+     numKmers_ = (clean) ? rollClean_(len) : roll_(len);
+     return numKmers_;
+   }
+
+   inline size_t numKmers() const { return numKmers_; }
+   // The forward k-mers of the last encoded sequence
+   inline const Kmer* fwdMers() const { return fwdMers_.data(); }
+   // The reverse-complement of each k-mer in fwdMers()
+   inline const Kmer* revMers() const { return revMers_.data(); }
+   // The offset (in the sequence) of the last base of each k-mer
+   inline const uint32_t* kmerEnds() const { return kmerEnds_.data(); }
+   // The offsets of the characters that reset the k-mer (e.g. 'N')
+   inline const std::vector<uint32_t>& nPositions() const { return nPositions_; }
+   // The per-base codes of the last encoded sequence
+   inline const uint8_t* codes() const { return codes_.data(); }
+
+  private:
+   /**
+    * Fill codes_ with the code of each character of seq.  Blocks consisting
+    * entirely of nucleotides are converted with vector instructions; any
+    * other block falls back to the lookup table.
+    *
+    * @return true if every character was a nucleotide
+    */
+   bool toCodes_(const char* seq, size_t len) {
+     bool clean = true;
+     size_t i = 0;
+     uint8_t* out = codes_.data();
+#if defined(__AVX2__)
+     const __m256i fold = _mm256_set1_epi8(static_cast<char>(0xDF));
+     const __m256i lowBits = _mm256_set1_epi8(0x3);
+     const __m256i a = _mm256_set1_epi8('A'), c = _mm256_set1_epi8('C');
+     const __m256i g = _mm256_set1_epi8('G'), t = _mm256_set1_epi8('T');
+     for (; i + 32 <= len; i += 32) {
+       __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(seq + i));
+       __m256i u = _mm256_and_si256(v, fold);
+       __m256i isNuc = _mm256_or_si256(
+           _mm256_or_si256(_mm256_cmpeq_epi8(u, a), _mm256_cmpeq_epi8(u, c)),
+           _mm256_or_si256(_mm256_cmpeq_epi8(u, g), _mm256_cmpeq_epi8(u, t)));
+       if (static_cast<uint32_t>(_mm256_movemask_epi8(isNuc)) == 0xFFFFFFFFu) {
+         // A->0, C->1, G->2, T->3 (regardless of case) is ((x >> 1) ^ (x >> 2)) & 3
+         __m256i code = _mm256_and_si256(
+             _mm256_xor_si256(_mm256_srli_epi16(v, 1), _mm256_srli_epi16(v, 2)), lowBits);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), code);
+       } else {
+         clean &= scalarCodes_(seq, i, i + 32);
+       }
+     }
+#elif defined(__SSE2__)
+     const __m128i fold = _mm_set1_epi8(static_cast<char>(0xDF));
+     const __m128i lowBits = _mm_set1_epi8(0x3);
+     const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C');
+     const __m128i g = _mm_set1_epi8('G'), t = _mm_set1_epi8('T');
+     for (; i + 16 <= len; i += 16) {
+       __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(seq + i));
+       __m128i u = _mm_and_si128(v, fold);
+       __m128i isNuc = _mm_or_si128(
+           _mm_or_si128(_mm_cmpeq_epi8(u, a), _mm_cmpeq_epi8(u, c)),
+           _mm_or_si128(_mm_cmpeq_epi8(u, g), _mm_cmpeq_epi8(u, t)));
+       if (_mm_movemask_epi8(isNuc) == 0xFFFF) {
+         // A->0, C->1, G->2, T->3 (regardless of case) is ((x >> 1) ^ (x >> 2)) & 3
+         __m128i code = _mm_and_si128(
+             _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_srli_epi16(v, 2)), lowBits);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), code);
+       } else {
+         clean &= scalarCodes_(seq, i, i + 16);
+       }
+     }
+#endif
+     clean &= scalarCodes_(seq, i, len);
+     return clean;
+   }
+
+   inline bool scalarCodes_(const char* seq, size_t begin, size_t end) {
+     uint8_t notNuc = 0;
+     for (size_t i = begin; i < end; ++i) {
+       uint8_t code = codeTable_[static_cast<uint8_t>(seq[i])];
+       codes_[i] = code;
+       notNuc |= (code > 3);
+     }
+     return notNuc == 0;
+   }
+
+   // Produce the k-mers of a sequence consisting only of nucleotides
+   size_t rollClean_(size_t len) {
+     if (len < merLen_) { return 0; }
+     Kmer kmer{0}, rkmer{0};
+     const uint8_t* codes = codes_.data();
+     size_t i = 0;
+     for (; i < merLen_ - 1; ++i) {
+       kmer = ((kmer << 2) & masq_) | codes[i];
+       rkmer = (rkmer >> 2) | (Kmer(0x3 - codes[i]) << lshift_);
+     }
+     size_t n = 0;
+     for (; i < len; ++i, ++n) {
+       kmer = ((kmer << 2) & masq_) | codes[i];
+       rkmer = (rkmer >> 2) | (Kmer(0x3 - codes[i]) << lshift_);
+       fwdMers_[n] = kmer;
+       revMers_[n] = rkmer;
+       kmerEnds_[n] = i;
+     }
+     return n;
+   }
+
+   // Produce the k-mers of a sequence that may contain non-nucleotides
+   size_t roll_(size_t len) {
+     Kmer kmer{0}, rkmer{0};
+     uint32_t cmlen{0};
+     size_t n = 0;
+     for (size_t i = 0; i < len; ++i) {
+       uint8_t c = codes_[i];
+       if (c < 4) {
+         kmer = ((kmer << 2) & masq_) | c;
+         rkmer = (rkmer >> 2) | (Kmer(0x3 - c) << lshift_);
+         if (++cmlen >= merLen_) {
+           cmlen = merLen_;
+           fwdMers_[n] = kmer;
+           revMers_[n] = rkmer;
+           kmerEnds_[n] = i;
+           ++n;
+         }
+       } else if (c == CODE_RESET) {
+         cmlen = 0; kmer = rkmer = 0;
+         nPositions_.push_back(i);
+       }
+     }
+     return n;
+   }
+
+   uint32_t merLen_;
+   Kmer lshift_;
+   Kmer masq_;
+   uint8_t codeTable_[256];
+
+   size_t numKmers_;
+   std::vector<uint8_t> codes_;
+   std::vector<Kmer> fwdMers_;
+   std::vector<Kmer> revMers_;
+   std::vector<uint32_t> kmerEnds_;
+   std::vector<uint32_t> nPositions_;
+};
+
+#endif // __KMER_ENCODER_HPP__
@@ -0,0 +1,104 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __KMER_LUT_BUILDER_HPP__
+#define __KMER_LUT_BUILDER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include "LookUpTableUtils.hpp"
+
+/**
+ * Builds the k-mer look-up table (the transcripts containing each k-mer
+ * class, and how many times) from the classes of each transcript.  A
+ * transcript contributes one (class, transcript, multiplicity) entry per
+ * distinct class it contains; each thread appends its entries to buckets of
+ * its own, one per range of classes.  Once every transcript has been added,
+ * the buckets are built into their slices of the table independently (and in
+ * parallel), so there is no single thread through which every entry must
+ * pass.
+ *
+ * The entries held in memory by all of the threads are bounded by a budget;
+ * when a thread's share of it is full, its buckets are appended to spill
+ * files (one per bucket), which are read back when the bucket is built.
+ */
+class KmerLUTBuilder {
+public:
+  /**
+   * @param numClasses the number of k-mer classes
+   * @param memoryBudget the bytes of entries that may be held in memory
+   * @param numThreads the number of threads that will add transcripts
+   * @param spillDir the (existing) directory in which spill files are
+   *        created, if need be; they are removed once the table is built
+   */
+  KmerLUTBuilder(size_t numClasses, size_t memoryBudget, size_t numThreads, const std::string& spillDir);
+  ~KmerLUTBuilder();
+
+  // Add the classes of a transcript (in any order, with repeats); may be
+  // called concurrently
+  void addTranscript(LUTTools::TranscriptID transcriptID, const std::vector<LUTTools::KmerID>& classes);
+
+  // Once every transcript has been added, build the table
+  LUTTools::KmerLUT build();
+
+  // The number of entries that were spilled to disk
+  inline size_t numSpilled() const { return numSpilled_; }
+
+private:
+  struct Entry {
+    uint32_t classOffset; // within its bucket
+    LUTTools::TranscriptID transcriptID;
+    uint32_t multiplicity;
+  };
+
+  struct Local {
+    explicit Local(size_t numBuckets) : buckets(numBuckets), numEntries(0) {}
+    std::vector<std::vector<Entry>> buckets;
+    std::vector<LUTTools::KmerID> classes;
+    size_t numEntries;
+  };
+
+  std::string spillFile_(size_t bucket) const;
+  void spill_(Local& local);
+
+  size_t numClasses_;
+  size_t classesPerBucket_;
+  size_t numBuckets_;
+  // The entries a thread may hold before it spills them
+  size_t localCapacity_;
+  std::string spillDir_;
+
+  tbb::enumerable_thread_specific<Local> locals_;
+  // The entries of each bucket in its spill file, guarded by its mutex
+  std::vector<size_t> spilledSizes_;
+  std::unique_ptr<std::mutex[]> spillMutexes_;
+  std::atomic<size_t> numSpilled_;
+};
+
+#endif // __KMER_LUT_BUILDER_HPP__
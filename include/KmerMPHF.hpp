@@ -0,0 +1,344 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __KMER_MPHF_HPP__
+#define __KMER_MPHF_HPP__
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <limits>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+#include "MemoryMappedFile.hpp"
+
+/**
+ * A minimal perfect hash function over a set of k-mers, built with the
+ * "hash and displace" scheme of PTHash (Pibiri & Trani, SIGIR 2021).
+ *
+ * The keys are split into partitions of ~PartitionSize keys, which are built
+ * independently (and in parallel).  Within a partition, each key hashes to a
+ * bucket, and each bucket is assigned a 16-bit "pilot" such that the keys of
+ * the bucket land, via hash(key, pilot), in distinct free slots of a table
+ * that is slightly larger than the partition.  Slots beyond the size of the
+ * partition are remapped onto the holes it leaves, so that the function is
+ * minimal.
+ *
+ * A query hashes the key, reads the (small, cache-resident) descriptor of its
+ * partition and then its pilot.  The keys that land beyond the size of the
+ * partition (about 1 - Alpha of them, i.e. ~2%) make a second, dependent
+ * read, of the free slot onto which their slot is remapped.  So a query
+ * costs one random access, occasionally two; BDZ must probe three random
+ * locations of its table for every key.
+ */
+class KmerMPHF {
+  using Kmer = uint64_t;
+
+  public:
+   using Pilot = uint16_t;
+
+   // The descriptor of a single partition
+   struct Partition {
+     uint64_t seed;
+     uint64_t keyOffset;
+     uint64_t pilotOffset;
+     uint64_t freeOffset;
+     uint32_t numKeys;
+     uint32_t tableSize;
+     uint32_t numBuckets;
+     uint32_t numDenseBuckets;
+   };
+
+   // The average number of keys in a partition
+   static constexpr size_t PartitionSize = 1 << 17;
+
+   // The id of every key when the key set is empty
+   static constexpr size_t INVALID = std::numeric_limits<size_t>::max();
+
+   KmerMPHF() : seed_(0x5bd1e9955bd1e995ULL), numKeys_(0) {}
+
+   /**
+    * A function from its (previously built) parts; e.g. the sections of a
+    * mapped index.
+    */
+   KmerMPHF(uint64_t seed, uint64_t numKeys, MappedArray<Partition>&& partitions,
+            MappedArray<Pilot>&& pilots, MappedArray<uint32_t>&& freeSlots) :
+     seed_(seed), numKeys_(numKeys), partitions_(std::move(partitions)),
+     pilots_(std::move(pilots)), freeSlots_(std::move(freeSlots)) {}
+
+   /**
+    * Build the function over keys, which must be distinct.  The partitions
+    * are built in parallel with the current TBB scheduler.
+    */
+   void build(const std::vector<Kmer>& keys) {
+     numKeys_ = keys.size();
+     if (numKeys_ == 0) {
+       partitions_ = MappedArray<Partition>(); pilots_ = MappedArray<Pilot>();
+       freeSlots_ = MappedArray<uint32_t>();
+       return;
+     }
+
+     size_t numPartitions = (numKeys_ + PartitionSize - 1) / PartitionSize;
+     std::vector<Partition> partitions(numPartitions);
+
+     std::vector<uint64_t> hashes(numKeys_);
+     tbb::parallel_for(tbb::blocked_range<size_t>(0, numKeys_),
+       [this, &keys, &hashes](const tbb::blocked_range<size_t>& r) -> void {
+         for (size_t i = r.begin(); i < r.end(); ++i) { hashes[i] = mix_(keys[i] ^ seed_); }
+       });
+
+     // Group the hashes by partition (a counting sort)
+     std::vector<uint64_t> offsets(numPartitions + 1, 0);
+     for (auto h : hashes) { ++offsets[fastrange_(h, numPartitions) + 1]; }
+     std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+     std::vector<uint64_t> grouped(numKeys_);
+     {
+       std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+       for (auto h : hashes) { grouped[next[fastrange_(h, numPartitions)]++] = h; }
+     }
+     std::vector<uint64_t>().swap(hashes);
+
+     // Lay out the pilots and free slots of every partition
+     size_t numPilots{0}, numFree{0};
+     for (size_t i = 0; i < numPartitions; ++i) {
+       auto& p = partitions[i];
+       p.numKeys = offsets[i + 1] - offsets[i];
+       // An empty partition is only ever reached by keys outside of the set;
+       // it maps them all to the first key.
+       p.keyOffset = (p.numKeys > 0) ? offsets[i] : 0;
+       p.tableSize = std::max(static_cast<uint32_t>(std::ceil(p.numKeys / Alpha)), p.numKeys + 1);
+       double logn = std::max(std::log2(static_cast<double>(std::max(p.numKeys, 2u))), 1.0);
+       p.numBuckets = std::max(static_cast<uint32_t>(std::ceil(C * p.numKeys / logn)), 2u);
+       p.numDenseBuckets = std::min(std::max(static_cast<uint32_t>(DenseBucketFraction * p.numBuckets), 1u),
+                                    p.numBuckets - 1);
+       p.pilotOffset = numPilots; numPilots += p.numBuckets;
+       p.freeOffset = numFree; numFree += p.tableSize - p.numKeys;
+     }
+     std::vector<Pilot> pilots(numPilots, 0);
+     std::vector<uint32_t> freeSlots(numFree, 0);
+
+     tbb::parallel_for(size_t(0), numPartitions,
+       [this, &partitions, &pilots, &freeSlots, &grouped, &offsets](size_t i) -> void {
+         auto& p = partitions[i];
+         // Should the pilot search fail, the partition is simply rebuilt
+         // with a different seed
+         for (uint64_t attempt = 0; ; ++attempt) {
+           p.seed = mix_(seed_ + i * 0x9E3779B97F4A7C15ULL + attempt);
+           if (buildPartition_(p, &grouped[offsets[i]], &pilots[p.pilotOffset],
+                               &freeSlots[p.freeOffset])) { break; }
+         }
+       });
+
+     partitions_ = MappedArray<Partition>(std::move(partitions));
+     pilots_ = MappedArray<Pilot>(std::move(pilots));
+     freeSlots_ = MappedArray<uint32_t>(std::move(freeSlots));
+   }
+
+   /**
+    * The id (in [0, numKeys())) of key.  Keys outside of the set are mapped
+    * to an arbitrary id (or to INVALID, if the set is empty).
+    */
+   inline size_t lookup(Kmer key) const {
+     if (partitions_.empty()) { return INVALID; }
+     uint64_t h = mix_(key ^ seed_);
+     const Partition& p = partitions_[fastrange_(h, partitions_.size())];
+     uint64_t g = mix_(h ^ p.seed);
+     return slot_(p, g, pilots_[p.pilotOffset + bucket_(p, g)]);
+   }
+
+   /**
+    * Look up a block of keys.  The hashing of every key in a block is done
+    * in one (branch-free) pass, which also prefetches each key's pilot; the
+    * pilots are then read and the slots computed in a second pass.
+    */
+   void lookupBatch(const Kmer* keys, size_t n, size_t* ids) const {
+     constexpr size_t BlockSize = 32;
+     const Partition* parts[BlockSize];
+     uint64_t gs[BlockSize];
+     const Pilot* pilots[BlockSize];
+     size_t numPartitions = partitions_.size();
+     if (numPartitions == 0) {
+       for (size_t i = 0; i < n; ++i) { ids[i] = INVALID; }
+       return;
+     }
+
+     for (size_t b = 0; b < n; b += BlockSize) {
+       size_t m = std::min(BlockSize, n - b);
+       for (size_t i = 0; i < m; ++i) {
+         uint64_t h = mix_(keys[b + i] ^ seed_);
+         parts[i] = &partitions_[fastrange_(h, numPartitions)];
+         gs[i] = mix_(h ^ parts[i]->seed);
+         pilots[i] = &pilots_[parts[i]->pilotOffset + bucket_(*parts[i], gs[i])];
+         __builtin_prefetch(pilots[i]);
+       }
+       for (size_t i = 0; i < m; ++i) {
+         ids[b + i] = slot_(*parts[i], gs[i], *pilots[i]);
+       }
+     }
+   }
+
+   inline size_t numKeys() const { return numKeys_; }
+
+   size_t sizeInBytes() const {
+     return partitions_.size() * sizeof(Partition) + pilots_.size() * sizeof(Pilot) +
+            freeSlots_.size() * sizeof(uint32_t);
+   }
+
+   inline uint64_t seed() const { return seed_; }
+   const MappedArray<Partition>& partitions() const { return partitions_; }
+   const MappedArray<Pilot>& pilots() const { return pilots_; }
+   const MappedArray<uint32_t>& freeSlots() const { return freeSlots_; }
+
+  private:
+   // The load factor of the table of each partition
+   static constexpr double Alpha = 0.98;
+   // A partition of n keys has C * n / log2(n) buckets
+   static constexpr double C = 6.0;
+   // DenseKeyFraction of the keys are placed in DenseBucketFraction of the
+   // buckets; the large buckets are placed first, while the table is empty.
+   static constexpr double DenseBucketFraction = 0.3;
+   static constexpr uint32_t DenseKeyThreshold = 2576980377u; // 0.6 * 2^32
+
+   // The finalizer of MurmurHash3; a bijection on 64-bit integers
+   static inline uint64_t mix_(uint64_t k) {
+     k ^= k >> 33;
+     k *= 0xff51afd7ed558ccdULL;
+     k ^= k >> 33;
+     k *= 0xc4ceb9fe1a85ec53ULL;
+     k ^= k >> 33;
+     return k;
+   }
+
+   // Map x uniformly to [0, n) (Lemire's multiply-shift reduction)
+   static inline uint64_t fastrange_(uint64_t x, uint64_t n) {
+     return static_cast<uint64_t>((static_cast<unsigned __int128>(x) * n) >> 64);
+   }
+
+   static inline uint32_t fastrange32_(uint32_t x, uint32_t n) {
+     return static_cast<uint32_t>((static_cast<uint64_t>(x) * n) >> 32);
+   }
+
+   static inline uint32_t bucket_(const Partition& p, uint64_t g) {
+     uint32_t lo = static_cast<uint32_t>(g);
+     return (static_cast<uint32_t>(g >> 32) < DenseKeyThreshold) ?
+            fastrange32_(lo, p.numDenseBuckets) :
+            p.numDenseBuckets + fastrange32_(lo, p.numBuckets - p.numDenseBuckets);
+   }
+
+   static inline uint64_t position_(uint64_t g, Pilot pilot, uint32_t tableSize) {
+     return fastrange_(mix_(g ^ (static_cast<uint64_t>(pilot) * 0x9E3779B97F4A7C15ULL)), tableSize);
+   }
+
+   inline size_t slot_(const Partition& p, uint64_t g, Pilot pilot) const {
+     uint64_t pos = position_(g, pilot, p.tableSize);
+     if (pos >= p.numKeys) { pos = freeSlots_[p.freeOffset + pos - p.numKeys]; }
+     return p.keyOffset + pos;
+   }
+
+   /**
+    * Search for the pilots of partition p, whose keys have the given
+    * (first-level) hashes, and fill in its pilots and free slots.
+    *
+    * @return false if some bucket could not be placed with any pilot
+    */
+   bool buildPartition_(const Partition& p, const uint64_t* hashes, Pilot* pilots,
+                        uint32_t* freeSlots) {
+
+     // (bucket, hash) for every key, grouped by bucket
+     std::vector<std::pair<uint32_t, uint64_t>> keys(p.numKeys);
+     for (size_t i = 0; i < p.numKeys; ++i) {
+       uint64_t g = mix_(hashes[i] ^ p.seed);
+       keys[i] = std::make_pair(bucket_(p, g), g);
+     }
+     std::sort(keys.begin(), keys.end());
+
+     std::vector<uint32_t> bucketStart(p.numBuckets + 1, 0);
+     for (size_t i = 0; i < p.numKeys; ++i) {
+       if (i > 0 and keys[i] == keys[i - 1]) {
+         throw std::runtime_error("KmerMPHF: the key set contains duplicates");
+       }
+       ++bucketStart[keys[i].first + 1];
+     }
+     std::partial_sum(bucketStart.begin(), bucketStart.end(), bucketStart.begin());
+
+     // Place the largest buckets first
+     std::vector<uint32_t> order(p.numBuckets);
+     std::iota(order.begin(), order.end(), 0);
+     std::stable_sort(order.begin(), order.end(),
+       [&bucketStart](uint32_t a, uint32_t b) -> bool {
+         return (bucketStart[a + 1] - bucketStart[a]) > (bucketStart[b + 1] - bucketStart[b]);
+       });
+
+     std::vector<uint64_t> taken((p.tableSize + 63) / 64, 0);
+     auto isTaken = [&taken](uint64_t pos) -> bool { return (taken[pos >> 6] >> (pos & 63)) & 1; };
+     auto flip = [&taken](uint64_t pos) -> void { taken[pos >> 6] ^= (uint64_t(1) << (pos & 63)); };
+
+     std::vector<uint64_t> positions;
+     for (auto b : order) {
+       uint32_t begin = bucketStart[b], end = bucketStart[b + 1];
+       pilots[b] = 0;
+       if (begin == end) { break; } // every remaining bucket is empty
+
+       bool placed{false};
+       for (uint32_t pilot = 0; pilot <= std::numeric_limits<Pilot>::max() and !placed; ++pilot) {
+         positions.clear();
+         placed = true;
+         for (uint32_t k = begin; k < end; ++k) {
+           uint64_t pos = position_(keys[k].second, static_cast<Pilot>(pilot), p.tableSize);
+           if (isTaken(pos)) { placed = false; break; }
+           flip(pos); positions.push_back(pos);
+         }
+         if (placed) {
+           pilots[b] = static_cast<Pilot>(pilot);
+         } else {
+           for (auto pos : positions) { flip(pos); }
+         }
+       }
+       if (!placed) { return false; }
+     }
+
+     // Remap the slots beyond the end of the partition onto its holes
+     uint32_t hole{0};
+     for (uint32_t pos = p.numKeys; pos < p.tableSize; ++pos) {
+       if (isTaken(pos)) {
+         while (isTaken(hole)) { ++hole; }
+         freeSlots[pos - p.numKeys] = hole++;
+       } else {
+         freeSlots[pos - p.numKeys] = 0;
+       }
+     }
+     return true;
+   }
+
+   uint64_t seed_;
+   uint64_t numKeys_;
+   MappedArray<Partition> partitions_;
+   MappedArray<Pilot> pilots_;
+   MappedArray<uint32_t> freeSlots_;
+};
+
+#endif // __KMER_MPHF_HPP__
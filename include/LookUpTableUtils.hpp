@@ -44,6 +44,7 @@
 
 #include <boost/range/irange.hpp>
 #include "ezETAProgressBar.hpp"
+#include "MemoryMappedFile.hpp"
 
 namespace LUTTools {
 
@@ -62,22 +63,112 @@ struct TranscriptInfo{
   std::vector<KmerID> kmers; // TranscriptID => KmerID
 };
 
+// The versions of the mapped .klut, kmerEquivClasses.bin and .tfp layouts
+constexpr uint32_t KmerLUTVersion = 2;
+constexpr uint32_t KmerEquivClassesVersion = 2;
+constexpr uint32_t TranscriptFingerprintsVersion = 1;
+
+/**
+ * The (sorted, distinct) transcripts containing each k-mer equivalence
+ * class, stored in compressed sparse row form: the transcripts of class i
+ * are transcripts()[offsets()[i] .. offsets()[i+1]), and the number of
+ * times the class occurs in each of them is the corresponding entry of
+ * multiplicities().
+ */
+class KmerLUT {
+public:
+  /**
+   * A view of the transcripts of a single class
+   */
+  class TranscriptRange {
+  public:
+    TranscriptRange(const TranscriptID* b, const TranscriptID* e) : begin_(b), end_(e) {}
+    inline const TranscriptID* begin() const { return begin_; }
+    inline const TranscriptID* end() const { return end_; }
+    inline size_t size() const { return end_ - begin_; }
+    inline bool empty() const { return begin_ == end_; }
+    inline TranscriptID operator[](size_t i) const { return begin_[i]; }
+  private:
+    const TranscriptID* begin_;
+    const TranscriptID* end_;
+  };
+
+  KmerLUT() {}
+  KmerLUT(MappedArray<Offset>&& offsets, MappedArray<TranscriptID>&& transcripts,
+          MappedArray<uint32_t>&& multiplicities) :
+    offsets_(std::move(offsets)), transcripts_(std::move(transcripts)),
+    multiplicities_(std::move(multiplicities)) {}
+
+  /**
+   * Pack a table built in memory; each list must be sorted, and may contain
+   * a transcript several times.
+   */
+  static KmerLUT fromLists(const std::vector<TranscriptList>& lists);
+
+  inline size_t size() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+
+  inline TranscriptRange operator[](size_t i) const {
+    return TranscriptRange(transcripts_.data() + offsets_[i], transcripts_.data() + offsets_[i + 1]);
+  }
+
+  // The multiplicity of each transcript of operator[](i)
+  inline const uint32_t* multiplicities(size_t i) const { return multiplicities_.data() + offsets_[i]; }
+
+  const MappedArray<Offset>& offsets() const { return offsets_; }
+  const MappedArray<TranscriptID>& transcripts() const { return transcripts_; }
+  const MappedArray<uint32_t>& multiplicities() const { return multiplicities_; }
+
+private:
+  MappedArray<Offset> offsets_;
+  MappedArray<TranscriptID> transcripts_;
+  MappedArray<uint32_t> multiplicities_;
+};
+
 /**
- *  \brief Dump the k-mer memberships vector to the file fname
+ *  \brief Dump the k-mer memberships vector to the file fname (throws
+ *  std::runtime_error if it can't be written, as do the other dump
+ *  functions that write the mapped layout)
  **/
 void dumpKmerEquivClasses(
                           const std::vector<KmerID>& memberships,
                           const std::string& fname);
 
-std::vector<KmerID> readKmerEquivClasses(const std::string& fname);
+/**
+ *  \brief Map the k-mer memberships vector written by dumpKmerEquivClasses
+ **/
+MappedArray<KmerID> readKmerEquivClasses(const std::string& fname);
 
 void dumpKmerLUT(
     std::vector<TranscriptList> &transcriptsForKmerClass,
     const std::string &fname);
 
+/**
+ *  \brief Dump a k-mer look-up table that is already packed
+ **/
+void dumpKmerLUT(
+    const KmerLUT &transcriptsForKmerClass,
+    const std::string &fname);
+
+/**
+ *  \brief Map the k-mer look-up table written by dumpKmerLUT
+ **/
 void readKmerLUT(
     const std::string &fname,
-    std::vector<TranscriptList> &transcriptsForKmer);
+    KmerLUT &transcriptsForKmer);
+
+
+/**
+ *  \brief Dump the fingerprint of each transcript's sequence (indexed by
+ *  transcript ID; 0 for a transcript that isn't in the index)
+ **/
+void dumpTranscriptFingerprints(
+    const std::vector<uint64_t> &fingerprints,
+    const std::string &fname);
+
+/**
+ *  \brief Map the fingerprints written by dumpTranscriptFingerprints
+ **/
+MappedArray<uint64_t> readTranscriptFingerprints(const std::string &fname);
 
 
 void writeTranscriptInfo (TranscriptInfo *ti, std::ofstream &ostream);
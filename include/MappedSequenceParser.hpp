@@ -0,0 +1,87 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __MAPPED_READ_PARSER__
+#define __MAPPED_READ_PARSER__
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "StreamingSequenceParser.hpp"
+
+/**
+ * A parser for (uncompressed) FASTA / FASTQ files that memory-maps the file
+ * rather than reading it through a single parsing thread.  The mapping is
+ * divided into chunks whose boundaries are moved forward to the start of the
+ * next record, so that each chunk contains only whole records.  Consumers
+ * (through ReadProducer<MappedReadParser>) claim chunks directly and parse
+ * the records in them in place.
+ *
+ * A chunk boundary is found by assuming that every FASTQ record is exactly
+ * four lines long (header, sequence, '+', quality), so only such files can
+ * be parsed this way; isChunkable() tells whether a file is FASTA, or FASTQ
+ * whose first records have this layout, and other files should be read with
+ * the StreamingReadParser.
+ */
+class MappedReadParser {
+public:
+    MappedReadParser(const boost::filesystem::path& file, size_t chunkSize=(1 << 22));
+    ~MappedReadParser();
+
+    /**
+     * Whether file can be divided into chunks: it is FASTA, or the records
+     * in its first block are 4-line FASTQ.
+     */
+    static bool isChunkable(const boost::filesystem::path& file);
+
+    /**
+     * Claim the next unprocessed chunk of the file.
+     *
+     * @param begin the first record of the chunk
+     * @param end one past the last byte of the last record of the chunk
+     * @return false if there were no more chunks to claim
+     */
+    bool nextChunk(const char*& begin, const char*& end);
+
+    bool isFastq() const { return fastq_; }
+    const std::string& fileName() const { return fileName_; }
+
+private:
+    // The offset of the first record that begins at, or after, offset
+    size_t recordStart_(size_t offset) const;
+    bool isRecordStart_(size_t lineStart) const;
+    size_t nextLine_(size_t offset) const;
+
+    std::string fileName_;
+    int fd_;
+    const char* data_;
+    size_t size_;
+    size_t chunkSize_;
+    size_t numChunks_;
+    std::atomic<size_t> nextChunk_;
+    bool fastq_;
+};
+
+#endif // __MAPPED_READ_PARSER__
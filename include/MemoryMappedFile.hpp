@@ -0,0 +1,237 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __MEMORY_MAPPED_FILE_HPP__
+#define __MEMORY_MAPPED_FILE_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * The index files (.sfi, .sfc, .klut and kmerEquivClasses.bin) share a
+ * single layout, so that they can be mapped into memory and used in place:
+ * a header page, followed by a number of sections (flat arrays), each of
+ * which begins on a page boundary.  Since the mappings are backed by the
+ * page cache, concurrent processes using the same index share one copy.
+ */
+enum class MappedFileKind : uint32_t {
+  PERFECT_HASH_INDEX = 1,
+  COUNTS = 2,
+  KMER_LUT = 3,
+  KMER_EQUIV_CLASSES = 4,
+  TRANSCRIPT_FINGERPRINTS = 5
+};
+
+struct MappedSection {
+  uint64_t offset; // in bytes, from the start of the file
+  uint64_t count;  // in elements
+};
+
+struct MappedFileHeader {
+  static constexpr size_t MaxSections = 8;
+  static constexpr size_t MaxValues = 8;
+
+  char magic[8];
+  MappedFileKind kind;
+  uint32_t version;
+  uint64_t numSections;
+  MappedSection sections[MaxSections];
+  // Scalar fields (e.g. the k-mer length), whose meaning depends on the kind
+  uint64_t values[MaxValues];
+};
+
+// Sections are aligned to this boundary (regardless of the page size of the
+// host that wrote the file)
+constexpr size_t MappedFileAlignment = 4096;
+
+/**
+ * A file mapped, in its entirety, into memory.
+ */
+class MemoryMappedFile {
+public:
+  /**
+   * @param fname the file to map
+   * @param copyOnWrite if true, the mapping is writable, but any page that
+   *        is written becomes a private copy of this process (the file is
+   *        never modified)
+   */
+  MemoryMappedFile(const std::string& fname, bool copyOnWrite=false);
+  ~MemoryMappedFile();
+
+  /**
+   * Map an index file that may be shared by many processes.  If a shared
+   * directory has been set (and the file has the mapped layout), the file
+   * is first published to that directory --- unless an earlier process
+   * has already done so --- and the published copy is mapped instead.
+   */
+  static std::shared_ptr<MemoryMappedFile> openShared(const std::string& fname);
+
+  /**
+   * The directory into which openShared publishes index files; e.g.
+   * /dev/shm (where POSIX shared memory resides) or a hugetlbfs mount.  An
+   * empty string (the default) disables publishing.
+   */
+  static void setSharedDirectory(const std::string& dir);
+
+  /**
+   * If set, openShared keeps every file it maps for the rest of the life of
+   * the process, and hands out the same mapping whenever that file is opened
+   * again (e.g. for each sample of a batch, or by a counting process forked
+   * from this one).
+   */
+  static void setRetainMappings(bool retain);
+
+  MemoryMappedFile(const MemoryMappedFile&) = delete;
+  MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+  inline char* data() { return data_; }
+  inline const char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+  inline const std::string& fileName() const { return fileName_; }
+
+  /**
+   * The header of this file, if it has the mapped layout and is of the
+   * given kind; nullptr otherwise (e.g. for files in a legacy format).
+   */
+  const MappedFileHeader* header(MappedFileKind kind) const;
+
+  // True if the file has the mapped layout (of any kind)
+  bool hasMappedLayout() const;
+
+  /**
+   * The given section of the file; throws if it lies beyond the end of the
+   * file or is not aligned for T.
+   */
+  template <typename T>
+  T* section(const MappedSection& s) {
+    checkSection_(s, sizeof(T), alignof(T));
+    return reinterpret_cast<T*>(data_ + s.offset);
+  }
+
+  // Ask the kernel to begin reading the whole file in the background
+  void willNeed();
+
+private:
+  // openShared, without the retained files
+  static std::shared_ptr<MemoryMappedFile> mapShared_(const std::string& fname);
+  void checkSection_(const MappedSection& s, size_t elemSize, size_t align) const;
+
+  std::string fileName_;
+  char* data_;
+  size_t size_;
+};
+
+/**
+ * A fixed-size array that either owns its storage, or views a section of a
+ * MemoryMappedFile (which it keeps alive).  Structures loaded from an index
+ * hold MappedArrays, so that they can be used in place, while those that are
+ * built in memory simply wrap a vector.
+ */
+template <typename T>
+class MappedArray {
+public:
+  MappedArray() : data_(nullptr), size_(0) {}
+
+  explicit MappedArray(std::vector<T>&& v) :
+    owned_(std::move(v)), data_(owned_.data()), size_(owned_.size()) {}
+
+  MappedArray(const std::shared_ptr<MemoryMappedFile>& file, const MappedSection& s) :
+    file_(file), data_(file->section<T>(s)), size_(s.count) {}
+
+  MappedArray(MappedArray&& o) :
+    owned_(std::move(o.owned_)), file_(std::move(o.file_)), data_(o.data_), size_(o.size_) {
+    o.data_ = nullptr; o.size_ = 0;
+  }
+
+  MappedArray& operator=(MappedArray&& o) {
+    owned_ = std::move(o.owned_);
+    file_ = std::move(o.file_);
+    data_ = o.data_; size_ = o.size_;
+    o.data_ = nullptr; o.size_ = 0;
+    return *this;
+  }
+
+  MappedArray(const MappedArray&) = delete;
+  MappedArray& operator=(const MappedArray&) = delete;
+
+  inline T& operator[](size_t i) { return data_[i]; }
+  inline const T& operator[](size_t i) const { return data_[i]; }
+  inline T* data() { return data_; }
+  inline const T* data() const { return data_; }
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  inline T* begin() { return data_; }
+  inline T* end() { return data_ + size_; }
+  inline const T* begin() const { return data_; }
+  inline const T* end() const { return data_ + size_; }
+
+  // True if the elements live in a mapped file rather than on the heap
+  inline bool isMapped() const { return file_ != nullptr; }
+
+private:
+  std::vector<T> owned_;
+  std::shared_ptr<MemoryMappedFile> file_;
+  T* data_;
+  size_t size_;
+};
+
+/**
+ * Writes a file in the mapped layout.  Sections are appended in order, and
+ * the header is written when the file is closed.  The file is written under
+ * a temporary name (fname.part), which replaces fname only once close() has
+ * succeeded; so a failed (or abandoned) write never leaves a partial file
+ * under the real name.
+ */
+class MappedFileWriter {
+public:
+  MappedFileWriter(const std::string& fname, MappedFileKind kind, uint32_t version);
+  ~MappedFileWriter();
+
+  template <typename T>
+  void addSection(const T* data, size_t count) {
+    addSection_(reinterpret_cast<const char*>(data), sizeof(T) * count, count);
+  }
+
+  inline void setValue(size_t i, uint64_t value) { header_.values[i] = value; }
+
+  // Write the header, close the file and move it into place; returns false
+  // (having removed the partial file) on any I/O error
+  bool close();
+
+private:
+  void pad_();
+  void addSection_(const char* data, size_t numBytes, size_t count);
+
+  std::string fname_;
+  std::string partName_;
+  std::ofstream out_;
+  MappedFileHeader header_;
+  uint64_t offset_;
+  bool closed_;
+};
+
+#endif // __MEMORY_MAPPED_FILE_HPP__
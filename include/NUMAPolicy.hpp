@@ -0,0 +1,93 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __NUMA_POLICY_HPP__
+#define __NUMA_POLICY_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "tbb/task_scheduler_observer.h"
+
+/**
+ * Placement of threads and memory on the NUMA nodes of the machine, read
+ * from /sys/devices/system/node (so that libnuma is not required).  On a
+ * machine with a single node --- or if the topology can't be read --- every
+ * operation is a no-op.
+ *
+ * Two policies are used:
+ *  - an array whose elements are each touched by a single worker (e.g. the
+ *    equivalence classes, which are partitioned among the workers) is
+ *    placed by first touch: its pages are released, and the worker that
+ *    first writes a page gets it on its own node;
+ *  - an array that every worker reads or writes at random (e.g. the k-mer
+ *    counts, or the per-transcript masses) is interleaved over the nodes,
+ *    so that no one node's memory controller becomes the bottleneck.
+ */
+class NUMAPolicy {
+public:
+  struct Node {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  // The nodes that have CPUs, in order of their ids
+  static const std::vector<Node>& nodes();
+  static inline size_t numNodes() { return nodes().size(); }
+  static inline bool available() { return numNodes() > 1; }
+
+  // Restrict the calling thread to the CPUs of node (i mod numNodes())
+  static bool pinThread(size_t i);
+
+  // Interleave the pages wholly within [addr, addr+len) over the nodes
+  // (moving any that have already been placed)
+  static bool interleave(void* addr, size_t len);
+
+  // Release the pages wholly within [addr, addr+len), which must hold only
+  // zeros; each is re-allocated, zeroed, on the node of the thread that
+  // next touches it
+  static bool resetFirstTouch(void* addr, size_t len);
+};
+
+/**
+ * Pins each worker thread that joins the TBB scheduler, while this observer
+ * exists, to a node, round-robin.  The pinning is permanent: a worker stays on
+ * its node for the rest of its life (so for the rest of the run, as TBB keeps
+ * its workers), even after the observer is destroyed.  TBB (as of 4.1) has no
+ * arenas bound to nodes, so this, together with an affinity_partitioner that
+ * replays the assignment of ranges to threads, is what keeps each range of a
+ * parallel loop on the node where it was first touched.  The main thread is
+ * left unpinned, since it goes on to run everything after the loops (and
+ * nothing would undo its pinning).
+ */
+class NUMAThreadPinner : public tbb::task_scheduler_observer {
+public:
+  NUMAThreadPinner();
+  ~NUMAThreadPinner();
+  void on_scheduler_entry(bool isWorker) override;
+
+private:
+  std::atomic<size_t> nextThread_;
+};
+
+#endif // __NUMA_POLICY_HPP__
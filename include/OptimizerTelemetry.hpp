@@ -0,0 +1,86 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __OPTIMIZER_TELEMETRY_HPP__
+#define __OPTIMIZER_TELEMETRY_HPP__
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Progress and timing of the phases of the optimizer (e.g. initialization,
+ * and each iteration of SQUAREM), recorded only between steps --- never from
+ * within a parallel loop.  Each iteration is summarized on a single status
+ * line on stderr and, if a file has been opened, written to it as a line of
+ * JSON, e.g.
+ *
+ *   {"phase": "squarem", "iteration": 3, "seconds": 0.41, "neg_log_likelihood": ...}
+ */
+class OptimizerTelemetry {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  OptimizerTelemetry();
+
+  // Also write the records to this file; returns false if it can't be opened
+  bool open(const std::string& fname);
+
+  // Begin iteration i of the given phase; its time is measured from here
+  void beginIteration(const std::string& phase, size_t i);
+  // Set a field of the current iteration's record (or, outside of an
+  // iteration, of the next phase recorded by phase())
+  void set(const std::string& field, double value);
+  // Add to a field of the current iteration's record
+  void add(const std::string& field, double value);
+  // Finish the current iteration, and report it
+  void endIteration();
+
+  // Finish the phase whose iterations have been reported (ending the status
+  // line), and record its total time
+  void endPhase(const std::string& phase);
+
+  // Record a phase that has no iterations, with the fields set since the
+  // last record
+  void phase(const std::string& phase, double seconds);
+
+  // The seconds since t
+  static inline double since(Clock::time_point t) {
+    return std::chrono::duration<double>(Clock::now() - t).count();
+  }
+
+private:
+  void write_(const std::string& phase, long iteration, double seconds);
+
+  std::ofstream out_;
+  std::string phase_;
+  size_t iteration_;
+  size_t numIterations_;
+  double phaseSeconds_;
+  Clock::time_point start_;
+  std::vector<std::pair<std::string, double>> fields_;
+};
+
+#endif // __OPTIMIZER_TELEMETRY_HPP__
@@ -29,11 +29,15 @@
 #include <cstdio>
 #include <memory>
 #include <functional>
+#include <stdexcept>
+#include <string>
 
 #include <sys/mman.h>
 
 #include "boost/timer/timer.hpp"
 #include "cmph.h"
+#include "KmerMPHF.hpp"
+#include "MemoryMappedFile.hpp"
 
 //template <typename Deleter>
 class PerfectHashIndex {
@@ -47,10 +51,44 @@ class PerfectHashIndex {
    // We'll return this invalid id if a kmer is not found in our DB
    size_t INVALID = std::numeric_limits<size_t>::max();
 
+   // The versions of the mapped index layout written by dumpToFile; an
+   // index with overflow k-mers (see setOverflow) has 3 more sections
+   static constexpr uint32_t IndexVersion = 2;
+   static constexpr uint32_t OverflowIndexVersion = 3;
+
+   /**
+    * An index whose hash is a (legacy) CMPH BDZ function
+    */
    PerfectHashIndex( std::vector<Kmer>& kmers, std::unique_ptr<cmph_t, Deleter>& hash, 
                      uint32_t merSize, bool canonical ) : kmers_(std::move(kmers)), 
                                                           hash_(std::move(hash)), 
                                                           hashRaw_(hash_.get()),
+                                                          numPrimary_(kmers_.size()),
+                                                          nativeHash_(false),
+                                                          merSize_(merSize),
+                                                          canonical_(canonical) {}
+
+   /**
+    * An index whose hash is a KmerMPHF
+    */
+   PerfectHashIndex( std::vector<Kmer>& kmers, KmerMPHF&& mphf,
+                     uint32_t merSize, bool canonical ) :
+     PerfectHashIndex(MappedArray<Kmer>(std::move(kmers)), std::move(mphf), merSize, canonical) {}
+
+   PerfectHashIndex( MappedArray<Kmer>&& kmers, KmerMPHF&& mphf,
+                     uint32_t merSize, bool canonical ) :
+     PerfectHashIndex(std::move(kmers), std::move(mphf), KmerMPHF(), merSize, canonical) {}
+
+   /**
+    * An index whose k-mers are those of mphf, followed by those of overflow
+    */
+   PerfectHashIndex( MappedArray<Kmer>&& kmers, KmerMPHF&& mphf, KmerMPHF&& overflow,
+                     uint32_t merSize, bool canonical ) : kmers_(std::move(kmers)),
+                                                          hashRaw_(nullptr),
+                                                          mphf_(std::move(mphf)),
+                                                          overflow_(std::move(overflow)),
+                                                          numPrimary_(mphf_.numKeys()),
+                                                          nativeHash_(true),
                                                           merSize_(merSize),
                                                           canonical_(canonical) {}
 
@@ -58,45 +96,95 @@ class PerfectHashIndex {
    	merSize_ = ph.merSize_;
    	hash_ = std::move(ph.hash_);
     hashRaw_ = hash_.get();
+    mphf_ = std::move(ph.mphf_);
+    overflow_ = std::move(ph.overflow_);
+    numPrimary_ = ph.numPrimary_;
+    nativeHash_ = ph.nativeHash_;
    	kmers_ = std::move(ph.kmers_);
     canonical_ = ph.canonical_;
    }
 
    void dumpToFile(const std::string& fname) {
-   	FILE* out = fopen(fname.c_str(), "w");
-
-   	// read the key set
-    fwrite( reinterpret_cast<char*>(&merSize_), sizeof(merSize_), 1, out );
-    fwrite( reinterpret_cast<char*>(&canonical_), sizeof(canonical_), 1, out);
-    size_t numCounts = kmers_.size();
-    fwrite( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, out );
-    fwrite( reinterpret_cast<char*>(&kmers_[0]), sizeof(Kmer), numCounts, out );
-
-    cmph_dump(hash_.get(), out); 
-    fclose(out);
-
+    // Indices built with CMPH keep the legacy layout, so that they remain
+    // readable by older versions
+    if (!nativeHash_) { dumpLegacy_(fname); return; }
+
+    // Likewise, an index without overflow k-mers keeps version 2
+    bool hasOverflow = (overflow_.numKeys() > 0);
+    MappedFileWriter out(fname, MappedFileKind::PERFECT_HASH_INDEX,
+                         hasOverflow ? OverflowIndexVersion : IndexVersion);
+    out.setValue(0, merSize_);
+    out.setValue(1, canonical_);
+    out.setValue(2, mphf_.seed());
+    out.setValue(3, mphf_.numKeys());
+    out.addSection(kmers_.data(), kmers_.size());
+    out.addSection(mphf_.partitions().data(), mphf_.partitions().size());
+    out.addSection(mphf_.pilots().data(), mphf_.pilots().size());
+    out.addSection(mphf_.freeSlots().data(), mphf_.freeSlots().size());
+    if (hasOverflow) {
+      out.setValue(4, overflow_.seed());
+      out.setValue(5, overflow_.numKeys());
+      out.addSection(overflow_.partitions().data(), overflow_.partitions().size());
+      out.addSection(overflow_.pilots().data(), overflow_.pilots().size());
+      out.addSection(overflow_.freeSlots().data(), overflow_.freeSlots().size());
+    }
+    if (!out.close()) {
+      throw std::runtime_error("error writing index file " + fname);
+    }
    }
 
+   /**
+    * Load an index.  An index in the mapped layout is used in place (and
+    * shares the page cache with any other process using it); a legacy CMPH
+    * index is read onto the heap.
+    */
    static PerfectHashIndex fromFile( const std::string& fname ) {
-   	FILE* in = fopen(fname.c_str(),"r");
-
-   	// read the key set
-    uint32_t merSize;
-    fread( reinterpret_cast<char*>(&merSize), sizeof(merSize), 1, in );
-    bool canonical;
-    fread( reinterpret_cast<char*>(&canonical), sizeof(canonical), 1, in );
-    size_t numCounts;
-    fread( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, in );
-    std::vector<Kmer> kmers(numCounts, Kmer(0));
-    fread( reinterpret_cast<char*>(&kmers[0]), sizeof(Kmer), numCounts, in );
-
-    // read the hash
-    std::unique_ptr<cmph_t, Deleter> hash( cmph_load(in), cmph_destroy );
-    PerfectHashIndex index(kmers, hash, merSize, canonical);
-
-    fclose(in);
+    auto file = MemoryMappedFile::openShared(fname);
+    auto header = file->header(MappedFileKind::PERFECT_HASH_INDEX);
+    if (header == nullptr) { return fromLegacyFile_(fname); }
+    if (header->version != IndexVersion and header->version != OverflowIndexVersion) {
+      throw std::runtime_error("index file " + fname + " has unsupported version " +
+                               std::to_string(header->version));
+    }
+
+    MappedArray<Kmer> kmers(file, header->sections[0]);
+    KmerMPHF mphf(header->values[2], header->values[3],
+                  MappedArray<KmerMPHF::Partition>(file, header->sections[1]),
+                  MappedArray<KmerMPHF::Pilot>(file, header->sections[2]),
+                  MappedArray<uint32_t>(file, header->sections[3]));
+    KmerMPHF overflow;
+    if (header->version == OverflowIndexVersion) {
+      overflow = KmerMPHF(header->values[4], header->values[5],
+                          MappedArray<KmerMPHF::Partition>(file, header->sections[4]),
+                          MappedArray<KmerMPHF::Pilot>(file, header->sections[5]),
+                          MappedArray<uint32_t>(file, header->sections[6]));
+    }
+    if (mphf.numKeys() + overflow.numKeys() != kmers.size()) {
+      throw std::runtime_error("index file " + fname + " is corrupt");
+    }
+    return PerfectHashIndex(std::move(kmers), std::move(mphf), std::move(overflow),
+                            header->values[0], header->values[1] != 0);
+   }
 
-    return index;
+   /**
+    * Replace the overflow k-mers of the index with overflowKmers, which must
+    * be distinct and not among the primary k-mers.  This is how k-mers are
+    * added to an existing index (see `sailfish index --update`): the primary
+    * k-mers keep their ids, and the overflow k-mers get the ids that follow
+    * them, through a second (much smaller) MPHF.
+    */
+   void setOverflow( const std::vector<Kmer>& overflowKmers ) {
+    if (!nativeHash_) {
+      throw std::logic_error("k-mers can only be added to an index with a native hash");
+    }
+    overflow_.build(overflowKmers);
+    std::vector<Kmer> kmers(numPrimary_ + overflowKmers.size());
+    std::copy(kmers_.begin(), kmers_.begin() + numPrimary_, kmers.begin());
+    tbb::parallel_for(size_t(0), overflowKmers.size(),
+      [this, &kmers, &overflowKmers](size_t i) -> void {
+        kmers[numPrimary_ + overflow_.lookup(overflowKmers[i])] = overflowKmers[i];
+      });
+    kmers_ = MappedArray<Kmer>(std::move(kmers));
    }
 
    inline size_t getKmerIndex( uint64_t kmer ) {
@@ -104,12 +192,51 @@ class PerfectHashIndex {
    }
 
    inline size_t index( uint64_t kmer ) {
-   	char *key = reinterpret_cast<char*>(&kmer);
-    unsigned int id{cmph_search(hashRaw_, key, sizeof(uint64_t))};
-    return (kmers_[id] == kmer) ? id : INVALID;
+    size_t id;
+    if (nativeHash_) {
+      id = mphf_.lookup(kmer);
+    } else {
+      char *key = reinterpret_cast<char*>(&kmer);
+      id = cmph_search(hashRaw_, key, sizeof(uint64_t));
+    }
+    return (id < numPrimary_ and kmers_[id] == kmer) ? id : overflowIndex_(kmer);
+   }
+
+   /**
+    * Batched version of index().  The hash of every key in the block is
+    * evaluated first, and the slot of kmers_ against which each key will be
+    * verified is prefetched; only then are the keys compared.  This keeps the
+    * cache misses for the whole block in flight at once rather than paying
+    * for them one k-mer at a time.
+    *
+    * @param keys the k-mers to look up
+    * @param n the number of k-mers in keys
+    * @param ids on return, ids[i] holds index(keys[i]) (or INVALID)
+    *
+    * Only the keys missing from the primary k-mers are looked up among the
+    * overflow k-mers (if there are any).
+    */
+   inline void indexBatch( const Kmer* keys, size_t n, size_t* ids ) {
+    if (nativeHash_) {
+     mphf_.lookupBatch(keys, n, ids);
+     for (size_t i = 0; i < n; ++i) { if (ids[i] < numPrimary_) { __builtin_prefetch(&kmers_[ids[i]]); } }
+    } else {
+     for (size_t i = 0; i < n; ++i) {
+      Kmer kmer = keys[i];
+      char *key = reinterpret_cast<char*>(&kmer);
+      ids[i] = cmph_search(hashRaw_, key, sizeof(Kmer));
+      __builtin_prefetch(&kmers_[ids[i]]);
+     }
+    }
+    for (size_t i = 0; i < n; ++i) {
+     ids[i] = (ids[i] < numPrimary_ and kmers_[ids[i]] == keys[i]) ? ids[i] : overflowIndex_(keys[i]);
+    }
    }
 
    inline size_t numKeys() { return kmers_.size(); }
+   // The k-mers [0, numPrimaryKeys()) are hashed by the primary MPHF; any
+   // others are overflow k-mers
+   inline size_t numPrimaryKeys() { return numPrimary_; }
 
    bool verify() {
    	auto start = std::chrono::steady_clock::now();
@@ -127,7 +254,7 @@ class PerfectHashIndex {
      size_t numPages{0};
      
      auto entriesPerPage = pageSize / sizeof(char);
-     auto size = cmph_size(hashRaw_);
+     size_t size = (nativeHash_) ? 0 : cmph_size(hashRaw_);
      numPages = (sizeof(char) * size) / entriesPerPage;
      // number of pages that each thread should touch
      auto numPagesPerThread = numPages / numThreads;
@@ -153,20 +280,71 @@ class PerfectHashIndex {
      start = entriesPerPage * threadIdx;
      // the last page this thread touches
      end = start + entriesPerThread;
+     // (only read the k-mers, since they may be a read-only mapping)
+     volatile Kmer touched{0};
      for (size_t i = start; i < size; i += numThreads*entriesPerPage) {
       //std::cerr << "thread " << threadIdx << " is touching page " << i / entriesPerPage << "\n";
-      kmers_[i] = kmers_[i];
+      touched = kmers_[i];
      }
+     (void)touched;
    }
 
    inline bool canonical() { return canonical_; }
    inline uint32_t kmerLength() { return merSize_; }
-   const std::vector<Kmer>& kmers() { return kmers_; }
+   // True if the hash is a KmerMPHF rather than a (legacy) CMPH function
+   inline bool nativeHash() { return nativeHash_; }
+   const MappedArray<Kmer>& kmers() { return kmers_; }
 
    private:
-   	std::vector<Kmer> kmers_;
+   inline size_t overflowIndex_( Kmer kmer ) {
+    if (overflow_.numKeys() == 0) { return INVALID; }
+    size_t id = numPrimary_ + overflow_.lookup(kmer);
+    return (kmers_[id] == kmer) ? id : INVALID;
+   }
+
+   void dumpLegacy_(const std::string& fname) {
+   	FILE* out = fopen(fname.c_str(), "w");
+
+   	// read the key set
+    fwrite( reinterpret_cast<char*>(&merSize_), sizeof(merSize_), 1, out );
+    fwrite( reinterpret_cast<char*>(&canonical_), sizeof(canonical_), 1, out);
+    size_t numCounts = kmers_.size();
+    fwrite( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, out );
+    fwrite( reinterpret_cast<char*>(kmers_.data()), sizeof(Kmer), numCounts, out );
+
+    cmph_dump(hash_.get(), out); 
+    fclose(out);
+   }
+
+   static PerfectHashIndex fromLegacyFile_( const std::string& fname ) {
+   	FILE* in = fopen(fname.c_str(),"r");
+
+   	// read the key set
+    uint32_t merSize;
+    fread( reinterpret_cast<char*>(&merSize), sizeof(merSize), 1, in );
+    bool canonical;
+    fread( reinterpret_cast<char*>(&canonical), sizeof(canonical), 1, in );
+    size_t numCounts;
+    fread( reinterpret_cast<char*>(&numCounts), sizeof(size_t), 1, in );
+    std::vector<Kmer> kmers(numCounts, Kmer(0));
+    fread( reinterpret_cast<char*>(&kmers[0]), sizeof(Kmer), numCounts, in );
+
+    // read the hash
+    std::unique_ptr<cmph_t, Deleter> hash( cmph_load(in), cmph_destroy );
+    PerfectHashIndex index(kmers, hash, merSize, canonical);
+
+    fclose(in);
+
+    return index;
+   }
+
+   	MappedArray<Kmer> kmers_;
    	std::unique_ptr<cmph_t, Deleter> hash_;
     cmph_t* hashRaw_;
+    KmerMPHF mphf_;
+    KmerMPHF overflow_;
+    size_t numPrimary_;
+    bool nativeHash_;
    	uint32_t merSize_;
     bool canonical_;
 };
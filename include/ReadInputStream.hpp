@@ -0,0 +1,71 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __READ_INPUT_STREAM_HPP__
+#define __READ_INPUT_STREAM_HPP__
+
+#include <cstdint>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * The byte stream from which a StreamingReadParser reads.  Depending on
+ * the input, this is either the raw file (or named pipe), or the output of
+ * a decompressor running on its own thread(s).
+ */
+class ReadInputStream {
+public:
+    virtual ~ReadInputStream() {}
+    /**
+     * Read up to n bytes into buf.
+     *
+     * @return the number of bytes read (0 at the end of the stream, and
+     *         negative on error)
+     */
+    virtual int read(void* buf, int n) = 0;
+    /**
+     * Whether the stream ended early because of an error (e.g. a corrupt
+     * compressed block); the parser, which sees only the end of the stream,
+     * checks this once it is done.
+     */
+    virtual bool failed() const { return false; }
+};
+
+enum class InputCompression : uint8_t { NONE, GZIP, BGZF };
+
+/**
+ * Determine the compression of a regular file from its header.  Named pipes
+ * can not be inspected without consuming them, so they are always reported
+ * as uncompressed.
+ */
+InputCompression detectCompression(const boost::filesystem::path& file);
+
+/**
+ * Open the input stream for the given file.  BGZF files are inflated, block
+ * by block, in parallel by numInflaters threads; other gzip files are
+ * inflated by a single thread that runs ahead of the parser.
+ */
+std::unique_ptr<ReadInputStream> openReadInputStream(const boost::filesystem::path& file,
+                                                     uint32_t numInflaters);
+
+#endif // __READ_INPUT_STREAM_HPP__
@@ -23,6 +23,9 @@
 #ifndef __READPRODUCER_HPP__
 #define __READPRODUCER_HPP__
 
+#include <cstring>
+#include <string>
+
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
 #include "jellyfish/parse_read.hpp"
@@ -32,6 +35,7 @@
 #include "jellyfish/mer_counting.hpp"
 #include "jellyfish/misc.hpp"
 #include "StreamingSequenceParser.hpp"
+#include "MappedSequenceParser.hpp"
 
 template <typename Parser>
 class ReadProducer {
@@ -89,4 +93,111 @@ private:
   StreamingReadParser& parser_;
 };
 
+/**
+ * Hands out the records of the chunks claimed from a MappedReadParser.  The
+ * ReadSeq points directly into the mapped file, except for FASTA records
+ * whose sequence spans several lines; those are joined into a buffer owned
+ * by this producer.
+ */
+template <>
+class ReadProducer<MappedReadParser> {
+public:
+  ReadProducer(MappedReadParser& parser) : parser_(parser), cur_(nullptr), end_(nullptr) {}
+
+  bool nextRead(ReadSeq*& s) {
+    while (cur_ >= end_) {
+      if (!parser_.nextChunk(cur_, end_)) { s = nullptr; return false; }
+    }
+    if (parser_.isFastq()) { parseFastq_(); } else { parseFasta_(); }
+    s = &s_;
+    return true;
+  }
+
+  void finishedWithRead(ReadSeq*& s) { s = nullptr; }
+
+private:
+  // The end of the line beginning at p (excluding any '\r')
+  inline const char* lineEnd_(const char* p, const char*& next) {
+    auto nl = static_cast<const char*>(memchr(p, '\n', end_ - p));
+    next = (nl == nullptr) ? end_ : nl + 1;
+    const char* e = (nl == nullptr) ? end_ : nl;
+    return (e > p and *(e - 1) == '\r') ? e - 1 : e;
+  }
+
+  inline void parseName_(const char* p, const char* e) {
+    // The name of the read is the header up to the first whitespace
+    const char* n = p + 1;
+    const char* ne = n;
+    while (ne < e and *ne != ' ' and *ne != '\t') { ++ne; }
+    s_.name = const_cast<char*>(n);
+    s_.nlen = ne - n;
+  }
+
+  void parseFasta_() {
+    const char* next;
+    const char* e = lineEnd_(cur_, next);
+    parseName_(cur_, e);
+
+    // The (first line of the) sequence
+    const char* seq = next;
+    const char* seqEnd = (seq < end_) ? lineEnd_(seq, next) : seq;
+    if (next >= end_ or *next == '>') {
+      s_.seq = const_cast<char*>(seq);
+      s_.len = seqEnd - seq;
+      cur_ = next;
+      return;
+    }
+
+    // The sequence spans multiple lines
+    buffer_.assign(seq, seqEnd);
+    while (next < end_ and *next != '>') {
+      const char* line = next;
+      const char* le = lineEnd_(line, next);
+      buffer_.append(line, le);
+    }
+    s_.seq = const_cast<char*>(buffer_.data());
+    s_.len = buffer_.size();
+    cur_ = next;
+  }
+
+  void parseFastq_() {
+    const char* next;
+    const char* e = lineEnd_(cur_, next);
+    parseName_(cur_, e);
+
+    const char* seq = next;
+    const char* seqEnd = (seq < end_) ? lineEnd_(seq, next) : seq;
+    size_t seqLen = seqEnd - seq;
+    if (next < end_ and *next == '+') {
+      s_.seq = const_cast<char*>(seq);
+      s_.len = seqLen;
+    } else {
+      // The sequence spans multiple lines
+      buffer_.assign(seq, seqEnd);
+      while (next < end_ and *next != '+') {
+        const char* line = next;
+        const char* le = lineEnd_(line, next);
+        buffer_.append(line, le);
+      }
+      s_.seq = const_cast<char*>(buffer_.data());
+      s_.len = seqLen = buffer_.size();
+    }
+
+    // Skip the '+' line and as many quality lines as needed to cover the sequence
+    if (next < end_) { lineEnd_(next, next); }
+    size_t qualLen = 0;
+    while (next < end_ and qualLen < seqLen) {
+      const char* line = next;
+      qualLen += lineEnd_(line, next) - line;
+    }
+    cur_ = next;
+  }
+
+  MappedReadParser& parser_;
+  const char* cur_;
+  const char* end_;
+  ReadSeq s_;
+  std::string buffer_;
+};
+
 #endif // __READPRODUCER_HPP__
@@ -1,8 +1,18 @@
 #ifndef SAILFISH_MATH_HPP
 #define SAILFISH_MATH_HPP
 
+#include <algorithm>
 #include <cmath>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace sailfish {
 
@@ -37,6 +47,164 @@ namespace sailfish {
             return diff;
         }
 
+        /**
+         * Kernels for exp, log and digamma over arrays of doubles.  Unlike the
+         * libm functions, the log and digamma kernels are branch-free and
+         * inline into a loop over an array, which the compiler can then
+         * vectorize; exp is vectorized by hand (as SSE2 or AVX2).
+         */
+        namespace detail {
+            inline uint64_t asBits(double x) { uint64_t b; std::memcpy(&b, &x, sizeof(b)); return b; }
+            inline double fromBits(uint64_t b) { double x; std::memcpy(&x, &b, sizeof(x)); return x; }
+
+            constexpr double LN2_HI = 6.93147180369123816490e-01;
+            constexpr double LN2_LO = 1.90821492927058770002e-10;
+            // Adding this to a double (of magnitude < 2^51) rounds it to an
+            // integer, which is then held in the low bits of the sum
+            constexpr double ROUNDING_MAGIC = 6755399441055744.0; // 1.5 * 2^52
+
+            constexpr double LOG2_E = 1.4426950408889634074;
+            constexpr double EXP_MIN = -708.0;
+            constexpr double EXP_MAX = 709.78;
+            // The Taylor series of exp(r) (from the r^13 term down), which, for
+            // |r| <= ln(2) / 2, is exact to within an ulp
+            constexpr double EXP_POLY[14] = {
+                1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+                1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0,
+                1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0 };
+
+            // exp(x) to within 2 ulp; 0 below -708 (or for NaN) and infinity
+            // above 709.78
+            inline double expKernel(double x) {
+                if (!(x >= EXP_MIN)) { return 0.0; }
+                if (x > EXP_MAX) { return HUGE_VAL; }
+                double t = x * LOG2_E + ROUNDING_MAGIC;
+                double k = t - ROUNDING_MAGIC;
+                uint64_t ki = asBits(t) - asBits(ROUNDING_MAGIC);
+                // exp(x) = 2^k * exp(r), where |r| <= ln(2) / 2
+                double r = (x - k * LN2_HI) - k * LN2_LO;
+                double p = EXP_POLY[0];
+                for (size_t i = 1; i < 14; ++i) { p = p * r + EXP_POLY[i]; }
+                return fromBits(asBits(p) + (ki << 52));
+            }
+
+            // The same, for a vector of doubles.  The compiler will not
+            // vectorize the selects on the range of x, so this is spelled out.
+#if defined(__AVX2__)
+            constexpr size_t EXP_WIDTH = 4;
+            inline void expPacked(const double* x, double* y) {
+                __m256d xv = _mm256_loadu_pd(x);
+                __m256d xc = _mm256_min_pd(_mm256_max_pd(xv, _mm256_set1_pd(EXP_MIN)), _mm256_set1_pd(EXP_MAX));
+                __m256d magic = _mm256_set1_pd(ROUNDING_MAGIC);
+                __m256d t = _mm256_add_pd(_mm256_mul_pd(xc, _mm256_set1_pd(LOG2_E)), magic);
+                __m256d k = _mm256_sub_pd(t, magic);
+                __m256i ki = _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_castpd_si256(magic));
+                __m256d r = _mm256_sub_pd(_mm256_sub_pd(xc, _mm256_mul_pd(k, _mm256_set1_pd(LN2_HI))),
+                                          _mm256_mul_pd(k, _mm256_set1_pd(LN2_LO)));
+                __m256d p = _mm256_set1_pd(EXP_POLY[0]);
+                for (size_t i = 1; i < 14; ++i) {
+                    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(EXP_POLY[i]));
+                }
+                __m256d e = _mm256_castsi256_pd(_mm256_add_epi64(_mm256_castpd_si256(p), _mm256_slli_epi64(ki, 52)));
+                e = _mm256_and_pd(e, _mm256_cmp_pd(xv, _mm256_set1_pd(EXP_MIN), _CMP_GE_OQ));
+                e = _mm256_blendv_pd(e, _mm256_set1_pd(HUGE_VAL), _mm256_cmp_pd(xv, _mm256_set1_pd(EXP_MAX), _CMP_GT_OQ));
+                _mm256_storeu_pd(y, e);
+            }
+#elif defined(__SSE2__)
+            constexpr size_t EXP_WIDTH = 2;
+            inline void expPacked(const double* x, double* y) {
+                __m128d xv = _mm_loadu_pd(x);
+                __m128d xc = _mm_min_pd(_mm_max_pd(xv, _mm_set1_pd(EXP_MIN)), _mm_set1_pd(EXP_MAX));
+                __m128d magic = _mm_set1_pd(ROUNDING_MAGIC);
+                __m128d t = _mm_add_pd(_mm_mul_pd(xc, _mm_set1_pd(LOG2_E)), magic);
+                __m128d k = _mm_sub_pd(t, magic);
+                __m128i ki = _mm_sub_epi64(_mm_castpd_si128(t), _mm_castpd_si128(magic));
+                __m128d r = _mm_sub_pd(_mm_sub_pd(xc, _mm_mul_pd(k, _mm_set1_pd(LN2_HI))),
+                                       _mm_mul_pd(k, _mm_set1_pd(LN2_LO)));
+                __m128d p = _mm_set1_pd(EXP_POLY[0]);
+                for (size_t i = 1; i < 14; ++i) {
+                    p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(EXP_POLY[i]));
+                }
+                __m128d e = _mm_castsi128_pd(_mm_add_epi64(_mm_castpd_si128(p), _mm_slli_epi64(ki, 52)));
+                e = _mm_and_pd(e, _mm_cmpge_pd(xv, _mm_set1_pd(EXP_MIN)));
+                __m128d over = _mm_cmpgt_pd(xv, _mm_set1_pd(EXP_MAX));
+                e = _mm_or_pd(_mm_andnot_pd(over, e), _mm_and_pd(over, _mm_set1_pd(HUGE_VAL)));
+                _mm_storeu_pd(y, e);
+            }
+#else
+            constexpr size_t EXP_WIDTH = 1;
+            inline void expPacked(const double* x, double* y) { *y = expKernel(*x); }
+#endif
+
+            // log(x) for finite x > 0 (normal, not subnormal), to within 1 ulp
+            // (after fdlibm's __ieee754_log)
+            inline double logKernel(double x) {
+                uint64_t bits = asBits(x);
+                // Split x into 2^k * m, with m in [sqrt(2)/2, sqrt(2))
+                uint64_t adj = bits + (uint64_t(0x3ff0000000000000) - uint64_t(0x3fe6a09e00000000));
+                // (the exponent is converted to a double through the bits of
+                // 2^52 + e, as there is no vector int64 -> double conversion)
+                double dk = fromBits(asBits(4503599627370496.0) | (adj >> 52)) - (4503599627370496.0 + 1023.0);
+                double m = fromBits((adj & uint64_t(0x000fffffffffffff)) + uint64_t(0x3fe6a09e00000000));
+                double f = m - 1.0;
+                double s = f / (2.0 + f);
+                double z = s * s;
+                double w = z * z;
+                double t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+                double t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 +
+                                 w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+                double R = t2 + t1;
+                double hfsq = 0.5 * f * f;
+                return dk * LN2_HI - ((hfsq - (s * (hfsq + R) + dk * LN2_LO)) - f);
+            }
+
+            // digamma(x) for x > 0, to within ~1e-15 times the larger of
+            // |digamma(x)| and 1 (so its relative error grows only close to its
+            // root, at x = 1.4616...)
+            inline double digammaKernel(double x) {
+                // digamma(x) = digamma(x + 10) - sum_{i=0}^{9} 1 / (x + i), and
+                // at x + 10 >= 10 the asymptotic expansion is accurate to
+                // ~1e-17.  The reciprocals are summed smallest first, and 1 / x,
+                // which dominates for small x, is subtracted last from the
+                // well-conditioned digamma(x + 1).
+                double shift = 0.0;
+                for (int i = 9; i > 0; --i) { shift += 1.0 / (x + i); }
+                double z = x + 10.0;
+                double iz = 1.0 / z;
+                double iz2 = iz * iz;
+                double series = iz2 * (1.0 / 12.0 - iz2 * (1.0 / 120.0 - iz2 * (1.0 / 252.0 - iz2 * (1.0 / 240.0 -
+                                iz2 * (1.0 / 132.0 - iz2 * (691.0 / 32760.0 - iz2 * (1.0 / 12.0))))))) ;
+                return ((logKernel(z) - 0.5 * iz - series) - shift) - 1.0 / x;
+            }
+        }
+
+        /**
+         * y[i] = exp(x[i]), for i in [0, n); x and y may be the same array.
+         */
+        inline void expArray(const double* x, double* y, size_t n) {
+            size_t i = 0;
+            for (; i + detail::EXP_WIDTH <= n; i += detail::EXP_WIDTH) { detail::expPacked(x + i, y + i); }
+            for (; i < n; ++i) { y[i] = detail::expKernel(x[i]); }
+        }
+
+        /**
+         * y[i] = log(x[i]), for positive, normal x[i]; x and y may be the
+         * same array.
+         */
+        inline void logArray(const double* x, double* y, size_t n) {
+            for (size_t i = 0; i < n; ++i) { y[i] = detail::logKernel(x[i]); }
+        }
+
+        // digamma(x), for x > 0, consistent with digammaArray
+        inline double digamma(double x) { return detail::digammaKernel(x); }
+
+        /**
+         * y[i] = digamma(x[i]), for x[i] > 0; x and y may be the same array.
+         */
+        inline void digammaArray(const double* x, double* y, size_t n) {
+            for (size_t i = 0; i < n; ++i) { y[i] = detail::digammaKernel(x[i]); }
+        }
+
 
     }
 
@@ -115,6 +115,9 @@ TranscriptGeneMap readTranscriptToGeneMap( std::ifstream &ifile );
 
 TranscriptGeneMap transcriptToGeneMapFromFasta( const std::string& transcriptsFile );
 
+// A map in which every one of the named transcripts belongs to a single gene
+TranscriptGeneMap transcriptToGeneMapFromNames( NameVector transcriptNames );
+
 }
 }
 #endif // UTILS_HPP
@@ -40,6 +40,8 @@ extern "C" {
 #include <boost/range/irange.hpp>
 #include "tbb/concurrent_queue.h"
 
+#include "ReadInputStream.hpp"
+
 namespace bfs = boost::filesystem;
 
 struct ReadSeq {
@@ -51,19 +53,37 @@ struct ReadSeq {
 
 class StreamingReadParser {
 public:
-    StreamingReadParser( std::vector<bfs::path>& files );
+    /**
+     * @param files the files (or named pipes) from which reads are parsed
+     * @param numInflaters the number of threads used to decompress BGZF input
+     * @param queueCapacity the maximum number of parsed reads held at once
+     */
+    StreamingReadParser( std::vector<bfs::path>& files, uint32_t numInflaters=4,
+                         size_t queueCapacity=2000000 );
     ~StreamingReadParser();
     bool start();
     bool nextRead(ReadSeq*& seq);
     void finishedWithRead(ReadSeq*& s);
+    // Whether some file could not be read completely (valid once nextRead
+    // has returned false)
+    inline bool failed() const { return failed_; }
+
+    // The number of parsed reads waiting to be consumed (for statistics only)
+    inline size_t queuedReads() const {
+        auto n = readQueue_.size();
+        return (n > 0) ? static_cast<size_t>(n) : 0;
+    }
+    inline size_t queueCapacity() const { return queueCapacity_; }
 
 private:
     std::vector<bfs::path>& inputStreams_;
     bool parsing_;
+    std::atomic<bool> failed_;
     std::thread* parsingThread_;
     tbb::concurrent_bounded_queue<ReadSeq*> readQueue_, seqContainerQueue_;
     ReadSeq* readStructs_;
-    const size_t queueCapacity_ = 2000000;
+    const size_t queueCapacity_;
+    uint32_t numInflaters_;
 };
 
 //#include "Parser.cpp"
@@ -0,0 +1,80 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#ifndef __TRANSCRIPT_STORE_HPP__
+#define __TRANSCRIPT_STORE_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * The transcripts of the index, parsed once and held in memory with each
+ * nucleotide packed into 2 bits (A,C,G,T => 0,1,2,3, as Jellyfish and the
+ * KmerEncoder encode them).  The positions of any other characters (e.g.
+ * 'N') are kept separately, so that the k-mers spanning them can be skipped.
+ * Every stage of index construction (the bias features, the enumeration of
+ * the k-mers, and the look-up tables) reads the transcripts from here,
+ * rather than parsing the FASTA files again; the transcripts are independent,
+ * so a stage may process them in parallel.
+ */
+class TranscriptStore {
+public:
+  // The code of a character that is not a nucleotide (KmerEncoder::CODE_RESET)
+  static constexpr uint8_t CODE_RESET = 4;
+
+  // Parse the transcripts from the given FASTA files (in order)
+  explicit TranscriptStore(const std::vector<std::string>& files);
+
+  inline size_t size() const { return names_.size(); }
+  // The name of transcript i (its header, up to the first space)
+  inline const std::string& name(size_t i) const { return names_[i]; }
+  inline uint32_t length(size_t i) const { return static_cast<uint32_t>(offsets_[i + 1] - offsets_[i]); }
+  inline uint64_t totalLength() const { return offsets_.back(); }
+  inline const std::vector<std::string>& names() const { return names_; }
+
+  // Unpack transcript i into codes, one per base; each is < 4, or CODE_RESET
+  void codes(size_t i, std::vector<uint8_t>& out) const;
+
+  // A (non-zero) 64-bit hash of the sequence of transcript i; transcripts
+  // with equal sequences have equal fingerprints
+  uint64_t fingerprint(size_t i) const;
+
+  // The bytes held by the store
+  size_t sizeInBytes() const;
+
+private:
+  static constexpr size_t BasesPerWord = 32;
+
+  void append_(const char* name, size_t nameLen, const char* seq, size_t len);
+
+  std::vector<std::string> names_;
+  // Transcript i occupies bases [offsets_[i], offsets_[i+1]) of the store
+  std::vector<uint64_t> offsets_;
+  std::vector<uint64_t> packed_;
+  // The positions (within transcript i) of its non-nucleotides are
+  // resets_[resetOffsets_[i] ... resetOffsets_[i+1])
+  std::vector<uint64_t> resetOffsets_;
+  std::vector<uint32_t> resets_;
+};
+
+#endif // __TRANSCRIPT_STORE_HPP__
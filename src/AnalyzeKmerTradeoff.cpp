@@ -58,7 +58,7 @@ int runIterativeOptimizer(int argc, char* argv[]) {return 1;}
 */
 using TranscriptID = uint32_t;
 using TranscriptIDVector = std::vector<TranscriptID>;
-using KmerIDMap = std::vector<TranscriptIDVector>;
+using KmerIDMap = LUTTools::KmerLUT;
 
 int main(int argc, char* argv[]) {
   using std::string;
@@ -46,6 +46,7 @@
 #include "tbb/concurrent_vector.h"
 #include "tbb/concurrent_unordered_set.h"
 #include "tbb/concurrent_queue.h"
+#include "tbb/enumerable_thread_specific.h"
 #include "tbb/parallel_for_each.h"
 #include "tbb/task_scheduler_init.h"
 
@@ -66,9 +67,10 @@
 #include "GenomicFeature.hpp"
 #include "CountDBNew.hpp"
 #include "ezETAProgressBar.hpp"
-#include "PartitionRefiner.hpp"
-#include "StreamingSequenceParser.hpp"
-#include "ReadProducer.hpp"
+#include "EquivClassBuilder.hpp"
+#include "KmerLUTBuilder.hpp"
+#include "KmerEncoder.hpp"
+#include "TranscriptStore.hpp"
 
 using TranscriptID = uint32_t;
 using KmerID = uint64_t;
@@ -76,23 +78,25 @@ using ReadLength = int64_t;
 using Length = uint32_t;
 using TranscriptList = std::vector<TranscriptID>;
 
-struct ContainingTranscript{
-  KmerID kmerID;
-  TranscriptID transcriptID;
-};
-
 /**
  * This function builds both a kmer => transcript and transcript => kmer
  * lookup table.
+ *
+ * Neither phase holds the k-mers of every transcript: the first encodes
+ * each transcript only to add it to the k-mer classes, and the second
+ * encodes it again (from the store) to write its record of the transcript
+ * table, and to pass its classes to a KmerLUTBuilder, which holds at most
+ * lutMemory bytes of the k-mer table before it spills to disk.
  */
 int buildLUTs(
-  const std::vector<std::string>& transcriptFiles, //!< File from which transcripts are read
+  const TranscriptStore& transcriptStore,          //!< The transcripts
   PerfectHashIndex& transcriptIndex,               //!< Index of transcript kmers
   CountDBNew& transcriptHash,                      //!< Count of kmers in transcripts
   TranscriptGeneMap& tgmap,                        //!< Transcript => Gene map
   const std::string& tlutfname,                    //!< Transcript lookup table filename
   const std::string& klutfname,                    //!< Kmer lookup table filename
-  uint32_t numThreads                              //!< Number of threads to use in parallel
+  uint32_t numThreads,                             //!< Number of threads to use in parallel
+  size_t lutMemory                                 //!< Bytes of the k-mer table to hold in memory
   ) {
 
   using LUTTools::TranscriptInfo;
@@ -102,42 +106,42 @@ int buildLUTs(
 
   using tbb::blocked_range;
 
-  /*
-  char** fnames = new char*[transcriptFiles.size()];
-  size_t z{0};
-  size_t numFnames{0};
-  for ( auto& s : transcriptFiles ){
-    // Ugly, yes?  But this is not as ugly as the alternatives.
-    // The char*'s contained in fname are owned by the transcriptFiles
-    // vector and need not be manually freed.
-    fnames[numFnames] = const_cast<char*>(s.c_str());
-    ++numFnames;
-  }
-  // Create a jellyfish parser
-  jellyfish::parse_read parser( fnames, fnames+numFnames, 1000);
-  */
-
-  vector<bfs::path> paths{transcriptFiles[0]};
-  StreamingReadParser parser(paths);
-  parser.start();
-
   vector<std::thread> threads;
-  vector<TranscriptList> transcriptsForKmer;
 
-  size_t numTranscripts = tgmap.numTranscripts();
-  vector<TranscriptInfo*> transcripts;
-  transcripts.resize(numTranscripts, nullptr);
+  size_t numTranscripts = transcriptStore.size();
 
   auto merLen = transcriptHash.kmerLength();
-  bool done {false};
   atomic<size_t> numRes {0};
-  atomic<size_t> nworking{(numThreads > 1) ? (numThreads - 1) : 1};
+
+  // The ids of the k-mers of transcript storeIndex (skipping Ns, and any
+  // k-mer missing from the index), and the number of k-mers skipped
+  auto encodeTranscript = [&transcriptStore, &transcriptHash, &transcriptIndex, merLen](
+      size_t storeIndex, KmerEncoder& encoder, std::vector<uint8_t>& codes,
+      std::vector<KmerID>& kmerIDs) -> size_t {
+    auto INVALID = transcriptHash.INVALID;
+    bool useCanonical{transcriptIndex.canonical()};
+    size_t readLen = transcriptStore.length(storeIndex);
+    size_t numKmers {(readLen >= merLen) ? static_cast<size_t>(readLen) - merLen + 1 : 0};
+
+    // Windows containing Ns (or other non-nucleotides) yield no k-mer
+    transcriptStore.codes(storeIndex, codes);
+    size_t numEncodedKmers = encoder.encodeCodes(codes.data(), readLen);
+    const KmerID* fwdMers = encoder.fwdMers();
+    const KmerID* revMers = encoder.revMers();
+    kmerIDs.clear();
+    for (size_t i = 0; i < numEncodedKmers; ++i) {
+      auto binMer = (useCanonical) ? std::min(fwdMers[i], revMers[i]) : fwdMers[i];
+      auto binMerId = transcriptHash.id(binMer);
+      if (binMerId != INVALID) { kmerIDs.push_back(binMerId); }
+    }
+    return numKmers - kmerIDs.size();
+  };
 
   // Start the thread that will print the progress bar
   std::cerr << "Number of kmers : " << transcriptHash.size() << "\n";
   std::cerr << "Parsing transcripts and building k-mer equivalence classes\n";
 
-  threads.push_back( std::thread( [&numRes, &nworking, numTranscripts] () {
+  threads.push_back( std::thread( [&numRes, numTranscripts] () {
     size_t lastCount = numRes;
     ez::ezETAProgressBar show_progress(numTranscripts);
     show_progress.start();
@@ -154,104 +158,46 @@ int buildLUTs(
   }) );
 
 
-  PartitionRefiner refiner(transcriptHash.size());
-  std::mutex refinerMutex;
+  EquivClassBuilder equivClasses(transcriptHash.size());
 
   std::atomic<size_t> numInvalidKmers{0};
-  // Start the desired number of threads to parse the transcripts
+  // The next transcript of the store to be claimed by a worker
+  std::atomic<size_t> nextTranscript{0};
+  // Start the desired number of threads to encode the transcripts
   // and build our data structure.
   size_t numWorkers = (numThreads > 1) ? numThreads -1 : 1;
   for (size_t i = 0; i < numWorkers; ++i) {
 
     threads.push_back( std::thread(
-      [&numRes, &tgmap, &parser, &transcriptHash, &nworking, &transcripts,
-       &transcriptIndex, &transcriptsForKmer, &refiner, &refinerMutex, &numInvalidKmers, merLen]() -> void {
+      [&numRes, &tgmap, &transcriptStore, &nextTranscript, &equivClasses, &numInvalidKmers,
+       &encodeTranscript, merLen]() -> void {
 
-        // Each thread gets it's own stream
-        //jellyfish::parse_read::thread stream = parser.new_thread();
-        //jellyfish::parse_read::read_t* read;
-        ReadProducer<StreamingReadParser> producer(parser);
-        ReadSeq* s;
-
-        auto INVALID = transcriptHash.INVALID;
-        bool useCanonical{transcriptIndex.canonical()};
+        KmerEncoder encoder(merLen);
+        std::vector<uint8_t> codes;
+        std::vector<KmerID> kmerIDs;
 
         // while there are transcripts left to process
-        while (producer.nextRead(s)) {
-          // The transcript name
-          std::string fullHeader(s->name, s->nlen);
-          std::string header = fullHeader.substr(0, fullHeader.find(' '));
-
-          // The transcript sequence; strip the newlines from the
-          // sequence and put it into a string (newSeq)
-          //std::string seq(s->seq_s, std::distance(read->seq_s, read->seq_e) - 1);
-          //auto newEnd  = std::remove( seq.begin(), seq.end(), '\n' );
-          //auto readLen = std::distance( seq.begin(), newEnd );
-          auto readLen = s->len;
-          std::string newSeq(s->seq, s->len);//seq.begin(), seq.begin() + readLen);
-
+        size_t storeIndex;
+        while ((storeIndex = nextTranscript++) < transcriptStore.size()) {
           // Lookup the ID of this transcript in our transcript -> gene map
-          auto transcriptIndex = tgmap.findTranscriptID(header);
+          auto transcriptIndex = tgmap.findTranscriptID(transcriptStore.name(storeIndex));
           bool valid = (transcriptIndex != tgmap.INVALID);
-          auto geneIndex = tgmap.gene(transcriptIndex);
 
-          if ( not valid ) { ++numRes; continue; }
           ++numRes;
+          if ( not valid ) { continue; }
 
-          size_t numKmers {(readLen >= merLen) ? static_cast<size_t>(readLen) - merLen + 1 : 0};
-
-          TranscriptInfo* tinfo = new TranscriptInfo;
-          tinfo->name = header;
-          tinfo->transcriptID = transcriptIndex;
-          tinfo->geneID = geneIndex;
-          tinfo->length = readLen;
-          tinfo->kmers.resize(numKmers, INVALID);
-
-          // Iterate over the kmers
-          ReadLength effectiveLength(0);
-          size_t nextKmerID{0};
-          size_t locallyInvalidKmers{0};
-          for ( auto offset : boost::irange( size_t(0), numKmers) ) {
-            // the kmer and it's uint64_t representation
-            auto mer = newSeq.substr(offset, merLen);
-            auto binMer = jellyfish::parse_dna::mer_string_to_binary(mer.c_str(), merLen);
-
-            if (useCanonical) {
-              auto rcMer = jellyfish::parse_dna::reverse_complement(binMer, merLen);
-              binMer = std::min(binMer, rcMer);
-            }
-
-            auto binMerId = transcriptHash.id(binMer);
-            // For now, we "handle" k-mers with Ns by skipping them
-            if (binMerId != INVALID) {
-                tinfo->kmers[nextKmerID++] = binMerId;
-            } else {
-                ++locallyInvalidKmers;
-            }
-
-         }
-         // Discount k-mers containing Ns
-         tinfo->kmers.resize(nextKmerID);
-         if (locallyInvalidKmers > 0) {
-             numInvalidKmers += locallyInvalidKmers;
+          size_t locallyInvalidKmers = encodeTranscript(storeIndex, encoder, codes, kmerIDs);
+          // Discount k-mers containing Ns
+          if (locallyInvalidKmers > 0) {
+              numInvalidKmers += locallyInvalidKmers;
 #if HAVE_LOGGER
-             LOG(WARNING) << "Transcript [" << tinfo->name << "] contains " << locallyInvalidKmers << " unhashable k-mers";
+              LOG(WARNING) << "Transcript [" << transcriptStore.name(storeIndex) << "] contains " << locallyInvalidKmers << " unhashable k-mers";
 #endif
-         }
-
-         // Partition refinement is not threadsafe.  Thus,
-         // we have to use a mutex here to assure that multiple
-         // threads don't try to refine the partitions at the
-         // same time (there may be a more efficient approach).
-         refinerMutex.lock();
-         refiner.splitWith(tinfo->kmers);
-         refinerMutex.unlock();
-
-         transcripts[transcriptIndex] = tinfo;
-         producer.finishedWithRead(s);
-       }
+          }
 
-       --nworking;
+          // The k-mers' class signatures are updated concurrently
+          equivClasses.addTranscript(transcriptIndex, kmerIDs);
+        }
      }) );
 
   }
@@ -271,12 +217,9 @@ int buildLUTs(
 #endif
   }
 
-  // For simplicity and speed, the partition refiner is allowed to use many
-  // more labels than there are partitions (each newly created partition gets
-  // a new label, even when the label for one of the existing partitions could
-  // be used).  Here, we "compact" the labels, assuring they are [0,#part-1].
-  refiner.relabel();
-  const auto& membership = refiner.partitionMembership();
+  // Label the classes [0,#part-1], in order of their first k-mer
+  equivClasses.relabel();
+  const auto& membership = equivClasses.partitionMembership();
 
   boost::filesystem::path p(tlutfname);
   p = p.parent_path();
@@ -317,29 +260,20 @@ int buildLUTs(
    *  For each equivalence class, we keep a list of the transcripts in which it occurs.
    *  For each transcript, we keep a list of the equivalence classes it contains.
    **/
-  size_t numEquivClasses = (*max_element(membership.cbegin(), membership.cend())) + 1;
-  vector<TranscriptList> transcriptsForKmerClass(numEquivClasses);
-  tbb::concurrent_queue<ContainingTranscript> q;
-  tbb::concurrent_queue<TranscriptInfo*> tq;
-
-  // Spawn off a thread to build the kmer look up table
-  threads.push_back(std::thread(
-                                [&q, &transcriptsForKmerClass, &numTranscriptsRemaining]() {
-                                  ContainingTranscript ct;
-                                  while (numTranscriptsRemaining > 0 or not q.empty()) {
-                                    while (q.try_pop(ct)) {
-                                      transcriptsForKmerClass[ct.kmerID].push_back(ct.transcriptID);
-                                    }
-                                  }
-                                })
-                    );
-
-
+  size_t numEquivClasses = (membership.empty()) ? 0 :
+                           (*max_element(membership.cbegin(), membership.cend())) + 1;
+  KmerLUTBuilder klutBuilder(numEquivClasses, lutMemory, numThreads,
+                             boost::filesystem::path(klutfname).parent_path().string());
 
+  // The records wait here to be written (the workers block if the writer
+  // falls behind, rather than queueing up every transcript)
+  tbb::concurrent_bounded_queue<TranscriptInfo*> tq;
+  tq.set_capacity(4 * numThreads);
 
   // spawn off a thread to dump the transcript lookup table to file
+  bool wroteTlut{false};
   threads.push_back(std::thread(
-                                [&tq, &numTranscriptsRemaining, tlutfname]() -> void {
+                                [&tq, &numTranscriptsRemaining, &wroteTlut, tlutfname]() -> void {
                                   std::ofstream tlutstream(tlutfname, std::ios::binary);
                                   size_t numRec = 0;
                                   tlutstream.write(reinterpret_cast<const char*>(&numRec), sizeof(numRec));
@@ -358,44 +292,48 @@ int buildLUTs(
                                   tlutstream.seekp(0);
                                   tlutstream.write(reinterpret_cast<const char*>(&numRec), sizeof(numRec));
                                   tlutstream.close();
+                                  wroteTlut = !tlutstream.fail();
                                 })
                     );
 
-  tbb::parallel_for(blocked_range<size_t>(0, transcripts.size()),
-                    [&] (blocked_range<size_t>& trange) -> void {
+  struct Worker {
+    explicit Worker(uint32_t merLen) : encoder(merLen) {}
+    KmerEncoder encoder;
+    std::vector<uint8_t> codes;
+    std::vector<KmerID> kmerIDs;
+  };
+  tbb::enumerable_thread_specific<Worker> workers(Worker{merLen});
 
+  tbb::parallel_for(blocked_range<size_t>(0, numTranscripts),
+                    [&] (blocked_range<size_t>& trange) -> void {
 
-                      auto INVALID = transcriptHash.INVALID;
+                      auto& w = workers.local();
                       // For every transcript in this thread's range
-                      for (auto tidx = trange.begin(); tidx != trange.end(); ++tidx) {
-                        auto t = transcripts[tidx];
+                      for (auto storeIndex = trange.begin(); storeIndex != trange.end(); ++storeIndex) {
+                        auto transcriptID = tgmap.findTranscriptID(transcriptStore.name(storeIndex));
+                        if (transcriptID == tgmap.INVALID) {
+                          --numTranscriptsRemaining;
+                          ++numRes;
+                          continue;
+                        }
+
+                        TranscriptInfo* t = new TranscriptInfo;
+                        t->name = transcriptStore.name(storeIndex);
+                        t->transcriptID = transcriptID;
+                        t->geneID = tgmap.gene(transcriptID);
+                        t->length = transcriptStore.length(storeIndex);
 
                         // We'll transform the list of k-mers to the list of k-mer
                         // equivalence classes
-                        size_t numKmers = t->kmers.size();
-                        vector<KmerID> kmerEquivClasses(numKmers, INVALID);
-                        auto& kmers = t->kmers;
-
-                        // Populate the equivalence class list, and pass each transcript
-                        // off to the
-                        for (size_t i = 0; i < numKmers; ++i) {
+                        encodeTranscript(storeIndex, w.encoder, w.codes, w.kmerIDs);
+                        t->kmers.resize(w.kmerIDs.size());
+                        for (size_t i = 0; i < w.kmerIDs.size(); ++i) {
                           // k-mer => k-mer class
+                          t->kmers[i] = membership[w.kmerIDs[i]];
+                        }
 
-                          size_t kmerClass = membership[kmers[i]];
-                          kmerEquivClasses[i] = kmerClass;
-
-                          // populate k-mer class => transcript index
-                          if ( kmerClass != INVALID ) {
-                              ContainingTranscript c{kmerClass, static_cast<TranscriptID>(t->transcriptID)};
-                              q.push(c);
-                          } else {
-                            std::cerr << "When building the lookup table, I thought " << kmerClass << " was an invalid k-mer class\n";
-                          }
-
-                        } // end for
-
-                        // Now the transcript holds a vector of equivalence classes
-                        std::swap(t->kmers, kmerEquivClasses);
+                        // populate k-mer class => transcript index
+                        klutBuilder.addTranscript(t->transcriptID, t->kmers);
 
                         tq.push(t);
                         --numTranscriptsRemaining;
@@ -406,10 +344,16 @@ int buildLUTs(
                    );
 
   for (auto& t : threads) { t.join(); }
+  // The k-mer table, written last, marks the index as complete; so it is
+  // not written if the transcript table could not be
+  if (!wroteTlut) { throw std::runtime_error("error writing " + tlutfname); }
 
+  if (klutBuilder.numSpilled() > 0) {
+    std::cerr << "(spilled " << klutBuilder.numSpilled() << " of the k-mer table's entries to disk)\n";
+  }
   std::cerr << "writing k-mer equiv class lookup table . . . ";
-  std::cerr << "table size = " << transcriptsForKmerClass.size() << " . . . ";
-  LUTTools::dumpKmerLUT(transcriptsForKmerClass, klutfname);
+  std::cerr << "table size = " << numEquivClasses << " . . . ";
+  LUTTools::dumpKmerLUT(klutBuilder.build(), klutfname);
   std::cerr << "done\n";
 
   return 0;
@@ -447,6 +391,8 @@ int mainBuildLUT(int argc, char* argv[] ) {
       ("tgmap,m", po::value<string>(), "file that maps transcripts to genes")
       ("lutfile,l", po::value<string>(), "Lookup table prefix")
       ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
+      ("lut_memory", po::value<uint32_t>()->default_value(4096), "The memory (in MB) the k-mer lookup table may use "
+                                                                 "while it is built; beyond this, it spills to disk")
       ;
 
     po::options_description programOptions("combined");
@@ -470,6 +416,7 @@ int mainBuildLUT(int argc, char* argv[] ) {
     po::notify(vm);
 
     uint32_t numThreads = vm["threads"].as<uint32_t>();
+    size_t lutMemory = size_t(vm["lut_memory"].as<uint32_t>()) << 20;
     tbb::task_scheduler_init init(numThreads);
 
     vector<string> genesFile = vm["genes"].as<vector<string>>();
@@ -480,6 +427,9 @@ int mainBuildLUT(int argc, char* argv[] ) {
     auto tlutfname = lutprefix + ".tlut";
     auto klutfname = lutprefix + ".klut";
 
+    // The transcripts are parsed only once
+    TranscriptStore transcriptStore(genesFile);
+
     TranscriptGeneMap tgmap;
 
     // If the user procided a GTF file, then use that to enumerate the
@@ -493,10 +443,9 @@ int mainBuildLUT(int argc, char* argv[] ) {
       std::cerr << "done\n";
     } else {
     // Otherwise, build the transcript <-> gene map directly from the
-    // provided fasta file of transcripts
-      std::cerr << "building transcript to gene map using transcript fasta file [" <<
-                   genesFile[0] << "] . . .\n";
-      tgmap = sailfish::utils::transcriptToGeneMapFromFasta(genesFile[0]);
+    // names of the provided transcripts
+      std::cerr << "building transcript to gene map using the transcript names . . .\n";
+      tgmap = sailfish::utils::transcriptToGeneMapFromNames(transcriptStore.names());
       std::cerr << "done\n";
     }
 
@@ -523,11 +472,15 @@ int mainBuildLUT(int argc, char* argv[] ) {
     auto transcriptHash = CountDBNew::fromFile(sfTrascriptCountFile, sfIndexPtr);
     std::cerr << "done\n";
 
-    buildLUTs(genesFile, sfIndex, transcriptHash, tgmap, tlutfname, klutfname, numThreads);
+    buildLUTs(transcriptStore, sfIndex, transcriptHash, tgmap, tlutfname, klutfname, numThreads, lutMemory);
 
   } catch (po::error &e){
     std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
     std::exit(1);
+  } catch (std::exception& e) {
+    std::cerr << "ERROR: [" << e.what() << "]. Exiting.\n";
+    std::exit(1);
   }
 
+  return 0;
 }
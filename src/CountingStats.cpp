@@ -0,0 +1,235 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "CountingStats.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "unistd.h"
+
+namespace {
+  // Writes s as a JSON string (file names are the only strings written)
+  void writeJSONString(std::ostream& out, const std::string& s) {
+      out << '"';
+      for (char c : s) {
+          switch (c) {
+              case '"': out << "\\\""; break;
+              case '\\': out << "\\\\"; break;
+              case '\n': out << "\\n"; break;
+              case '\t': out << "\\t"; break;
+              default: out << c; break;
+          }
+      }
+      out << '"';
+  }
+
+  int openPerfCounter(uint32_t type, uint64_t config) {
+      struct perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      // Count the threads this process creates, and only in user space
+      // (which is permitted under the default perf_event_paranoid)
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+QueueOccupancySampler::QueueOccupancySampler(std::chrono::milliseconds interval) :
+    interval_(interval), running_(false) {}
+
+QueueOccupancySampler::~QueueOccupancySampler() { stop(); }
+
+void QueueOccupancySampler::addQueue(const std::string& file, size_t capacity,
+                                     std::function<size_t()> size) {
+    Queue q;
+    q.file = file;
+    q.capacity = capacity;
+    q.size = size;
+    queues_.push_back(q);
+}
+
+void QueueOccupancySampler::start() {
+    if (queues_.empty() or running_) { return; }
+    running_ = true;
+    thread_ = std::thread([this]() -> void {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_) {
+            sample_();
+            stopped_.wait_for(lock, interval_);
+        }
+    });
+}
+
+void QueueOccupancySampler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_) { return; }
+        running_ = false;
+    }
+    stopped_.notify_all();
+    thread_.join();
+}
+
+void QueueOccupancySampler::sample_() {
+    for (auto& q : queues_) {
+        size_t n = q.size();
+        ++q.samples;
+        q.emptySamples += (n == 0);
+        q.fullSamples += (n >= q.capacity);
+        q.sumSize += n;
+        q.maxSize = std::max(q.maxSize, n);
+    }
+}
+
+PerfCounters::PerfCounters() {
+    const std::vector<std::pair<std::string, std::pair<uint32_t, uint64_t>>> events = {
+        {"cycles", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}},
+        {"instructions", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}},
+        {"cache_references", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES}},
+        {"cache_misses", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}},
+        {"branch_misses", {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}},
+        {"dtlb_read_misses", {PERF_TYPE_HW_CACHE,
+                              PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}}
+    };
+    for (auto& e : events) {
+        int fd = openPerfCounter(e.second.first, e.second.second);
+        if (fd >= 0) { counters_.emplace_back(e.first, fd); }
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (auto& c : counters_) { close(c.second); }
+}
+
+void PerfCounters::start() {
+    for (auto& c : counters_) {
+        ioctl(c.second, PERF_EVENT_IOC_RESET, 0);
+        ioctl(c.second, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void PerfCounters::stop() {
+    for (auto& c : counters_) { ioctl(c.second, PERF_EVENT_IOC_DISABLE, 0); }
+}
+
+std::vector<std::pair<std::string, uint64_t>> PerfCounters::read() const {
+    std::vector<std::pair<std::string, uint64_t>> values;
+    for (auto& c : counters_) {
+        uint64_t v{0};
+        if (::read(c.second, &v, sizeof(v)) == sizeof(v)) { values.emplace_back(c.first, v); }
+    }
+    return values;
+}
+
+double CountingStats::parseSeconds() const {
+    double s{0.0};
+    for (auto& t : threads) { s += t.extrapolate(t.parseNs); }
+    return s;
+}
+
+double CountingStats::encodeSeconds() const {
+    double s{0.0};
+    for (auto& t : threads) { s += t.extrapolate(t.encodeNs); }
+    return s;
+}
+
+double CountingStats::hashSeconds() const {
+    double s{0.0};
+    for (auto& t : threads) { s += t.extrapolate(t.hashNs); }
+    return s;
+}
+
+double CountingStats::incrementSeconds() const {
+    double s{0.0};
+    for (auto& t : threads) { s += t.extrapolate(t.incrementNs); }
+    return s;
+}
+
+double CountingStats::readImbalance() const {
+    if (threads.empty()) { return 1.0; }
+    uint64_t total{0}, most{0};
+    for (auto& t : threads) { total += t.reads; most = std::max(most, t.reads); }
+    double mean = static_cast<double>(total) / threads.size();
+    return (mean > 0.0) ? most / mean : 1.0;
+}
+
+void CountingStats::writeJSON(std::ostream& out) const {
+    out << "{\n";
+    out << "  \"wall_seconds\": " << wallSeconds << ",\n";
+    out << "  \"stage_seconds\": {\"parse\": " << parseSeconds()
+        << ", \"encode\": " << encodeSeconds()
+        << ", \"hash\": " << hashSeconds()
+        << ", \"increment\": " << incrementSeconds() << "},\n";
+    out << "  \"read_imbalance\": " << readImbalance() << ",\n";
+
+    out << "  \"threads\": [";
+    for (size_t i = 0; i < threads.size(); ++i) {
+        auto& t = threads[i];
+        out << ((i == 0) ? "\n" : ",\n");
+        out << "    {\"reads\": " << t.reads << ", \"kmers\": " << t.kmers
+            << ", \"wall_seconds\": " << t.wallSeconds
+            << ", \"parse_seconds\": " << t.extrapolate(t.parseNs)
+            << ", \"encode_seconds\": " << t.extrapolate(t.encodeNs)
+            << ", \"hash_seconds\": " << t.extrapolate(t.hashNs)
+            << ", \"increment_seconds\": " << t.extrapolate(t.incrementNs) << "}";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"queues\": [";
+    for (size_t i = 0; i < queues.size(); ++i) {
+        auto& q = queues[i];
+        double n = std::max(q.samples, uint64_t(1));
+        out << ((i == 0) ? "\n" : ",\n");
+        out << "    {\"file\": ";
+        writeJSONString(out, q.file);
+        out << ", \"capacity\": " << q.capacity << ", \"samples\": " << q.samples
+            << ", \"mean_occupancy\": " << (q.sumSize / n) / std::max(q.capacity, size_t(1))
+            << ", \"max_size\": " << q.maxSize
+            << ", \"empty_fraction\": " << q.emptySamples / n
+            << ", \"full_fraction\": " << q.fullSamples / n << "}";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"perf\": {";
+    uint64_t cycles{0}, instructions{0};
+    for (size_t i = 0; i < perf.size(); ++i) {
+        out << ((i == 0) ? "" : ", ") << "\"" << perf[i].first << "\": " << perf[i].second;
+        if (perf[i].first == "cycles") { cycles = perf[i].second; }
+        if (perf[i].first == "instructions") { instructions = perf[i].second; }
+    }
+    if (cycles > 0 and instructions > 0) {
+        out << ", \"ipc\": " << static_cast<double>(instructions) / cycles;
+    }
+    out << "}\n";
+    out << "}\n";
+}
@@ -0,0 +1,95 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "EquivClassBuilder.hpp"
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+
+namespace {
+  struct Signature {
+    uint64_t lo;
+    uint64_t hi;
+    bool operator==(const Signature& o) const { return lo == o.lo and hi == o.hi; }
+  };
+
+  struct SignatureHasher {
+    size_t operator()(const Signature& s) const { return s.lo ^ (s.hi * 0x9e3779b97f4a7c15ULL); }
+  };
+
+  // The splitmix64 finalizer; a bijection that scatters nearby keys
+  inline uint64_t mix(uint64_t x) {
+      x += 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return x ^ (x >> 31);
+  }
+}
+
+EquivClassBuilder::EquivClassBuilder(LUTTools::KmerID numKmers) :
+    numKmers_(numKmers), signatures_(new std::atomic<uint64_t>[2 * numKmers]) {
+    for (LUTTools::KmerID i = 0; i < 2 * numKmers_; ++i) { signatures_[i].store(0, std::memory_order_relaxed); }
+}
+
+void EquivClassBuilder::addTranscript(LUTTools::TranscriptID transcriptID,
+                                      const std::vector<LUTTools::KmerID>& kmers) {
+  if (kmers.empty()) { return; }
+
+  // Count the occurrences of each k-mer
+  std::vector<LUTTools::KmerID> sorted(kmers);
+  std::sort(sorted.begin(), sorted.end());
+
+  size_t i{0};
+  size_t len = sorted.size();
+  while (i < len) {
+      auto kmer = sorted[i];
+      size_t j = i + 1;
+      while (j < len and sorted[j] == kmer) { ++j; }
+      uint64_t key = (static_cast<uint64_t>(transcriptID) << 32) | static_cast<uint32_t>(j - i);
+      // Two independent 64-bit hashes of (transcript, # occurrences); the
+      // additions wrap, so the sum is the same in any order
+      signatures_[2 * kmer].fetch_add(mix(key), std::memory_order_relaxed);
+      signatures_[2 * kmer + 1].fetch_add(mix(key ^ 0x5851f42d4c957f2dULL), std::memory_order_relaxed);
+      i = j;
+  }
+}
+
+void EquivClassBuilder::relabel() {
+  std::unordered_map<Signature, LUTTools::KmerID, SignatureHasher> labels;
+  membership_.resize(numKmers_);
+
+  for (LUTTools::KmerID i = 0; i < numKmers_; ++i) {
+    Signature s{signatures_[2 * i].load(std::memory_order_relaxed),
+                signatures_[2 * i + 1].load(std::memory_order_relaxed)};
+    auto it = labels.find(s);
+    if (it == labels.end()) {
+        LUTTools::KmerID newIdx = labels.size();
+        it = labels.emplace(s, newIdx).first;
+    }
+    membership_[i] = it->second;
+  }
+  // The signatures are no longer needed
+  signatures_.reset();
+
+  std::cerr << "after relabling, there are " << labels.size() << " eq classes\n";
+}
@@ -0,0 +1,620 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+
+#include "CountDBNew.hpp"
+#include "EquivClassBuilder.hpp"
+#include "KmerEncoder.hpp"
+#include "LookUpTableUtils.hpp"
+#include "PerfectHashIndex.hpp"
+#include "TranscriptGeneMap.hpp"
+#include "TranscriptStore.hpp"
+
+namespace {
+  using LUTTools::KmerID;
+  using LUTTools::TranscriptID;
+  using Kmer = uint64_t;
+
+  constexpr TranscriptID InvalidTranscript = std::numeric_limits<TranscriptID>::max();
+  // Marks (the membership of) a k-mer whose class is being recomputed
+  constexpr KmerID TouchedBit = KmerID(1) << 63;
+
+  struct Worker {
+    explicit Worker(uint32_t merLen) : encoder(merLen) {}
+    KmerEncoder encoder;
+    std::vector<uint8_t> codes;
+    std::vector<Kmer> kmers;
+    std::vector<Kmer> novelKmers;
+    std::vector<KmerID> touchedClasses;
+    std::vector<KmerID> touchedKmers;
+  };
+
+  // The k-mers of transcript i of the store, in order; windows containing Ns
+  // (or other non-nucleotides) yield no k-mer
+  void transcriptKmers(const TranscriptStore& transcripts, size_t i, bool canonical, Worker& w) {
+      transcripts.codes(i, w.codes);
+      size_t numKmers = w.encoder.encodeCodes(w.codes.data(), w.codes.size());
+      const Kmer* fwdMers = w.encoder.fwdMers();
+      const Kmer* revMers = w.encoder.revMers();
+      w.kmers.resize(numKmers);
+      for (size_t j = 0; j < numKmers; ++j) {
+          w.kmers[j] = (canonical) ? std::min(fwdMers[j], revMers[j]) : fwdMers[j];
+      }
+  }
+
+  // The id of the transcript named name, or tgmap.INVALID if there is none
+  // (findTranscriptID returns where the name would be)
+  size_t findTranscript(TranscriptGeneMap& tgmap, const std::string& name) {
+      auto id = tgmap.findTranscriptID(name);
+      return (id != tgmap.INVALID and tgmap.transcriptName(id) == name) ? id : tgmap.INVALID;
+  }
+
+  // Write through a temporary file, which replaces the original only once
+  // every file of the index has been written
+  boost::filesystem::path tmpPath(const boost::filesystem::path& p) {
+      boost::filesystem::path tmp(p);
+      tmp += ".tmp";
+      return tmp;
+  }
+
+  // Exists while the temporary files of an update replace the originals
+  boost::filesystem::path updateMarkerPath(const boost::filesystem::path& indexPath) {
+      return indexPath / "transcriptome.updating";
+  }
+
+  // Removes whichever temporary files of an update are left when it ends, so
+  // that an update that fails leaves only the index it started from
+  class TmpFiles {
+  public:
+      explicit TmpFiles(std::vector<boost::filesystem::path> paths) : paths_(std::move(paths)) {}
+      ~TmpFiles() {
+          for (auto& p : paths_) {
+              boost::system::error_code removeError;
+              boost::filesystem::remove(tmpPath(p), removeError);
+          }
+      }
+
+  private:
+      std::vector<boost::filesystem::path> paths_;
+  };
+
+  // Run write (which throws if it fails); false, with the error reported, if
+  // it failed
+  template <typename Write>
+  bool written(Write write) {
+      try {
+          write();
+      } catch (std::exception& e) {
+          std::cerr << "ERROR: " << e.what() << "\n";
+          return false;
+      }
+      return true;
+  }
+}
+
+/**
+ * The fingerprint of the sequence of every transcript in tgmap (0 for those
+ * that are not in the store); an index records these so that it may later be
+ * updated.
+ */
+std::vector<uint64_t> transcriptFingerprints(const TranscriptStore& transcripts,
+                                             TranscriptGeneMap& tgmap) {
+    std::vector<uint64_t> fingerprints(tgmap.numTranscripts(), 0);
+    tbb::parallel_for(size_t(0), transcripts.size(),
+        [&transcripts, &tgmap, &fingerprints](size_t i) -> void {
+            auto id = findTranscript(tgmap, transcripts.name(i));
+            if (id != tgmap.INVALID) { fingerprints[id] = transcripts.fingerprint(i); }
+        });
+    return fingerprints;
+}
+
+/**
+ * Whether an update of the index in indexPath was interrupted while its
+ * files were being replaced, leaving some of them new and the rest old.
+ */
+bool indexUpdateInterrupted(const boost::filesystem::path& indexPath) {
+    return boost::filesystem::exists(updateMarkerPath(indexPath));
+}
+
+/**
+ * Record that every file of the index in indexPath is consistent (e.g. once
+ * it has been rebuilt after an interrupted update).
+ */
+void clearIndexUpdateMarker(const boost::filesystem::path& indexPath) {
+    boost::filesystem::remove(updateMarkerPath(indexPath));
+}
+
+/**
+ * Update the index in indexPath, built from an earlier version of the
+ * transcripts, to the given transcripts.  A transcript whose name and
+ * sequence are unchanged is kept; any other is removed or added (a changed
+ * transcript is both).
+ *
+ * The primary k-mers of the index, and their MPHF, are kept as they are; the
+ * k-mers of the added transcripts that aren't in the index become overflow
+ * k-mers (see PerfectHashIndex::setOverflow).  The k-mer classes that occur
+ * in a removed or an added transcript are "touched": only their k-mers are
+ * partitioned anew, and only the transcripts that contain them are encoded
+ * again.  Every other class keeps its transcripts (and its place, among the
+ * untouched classes), and every other transcript its record of the .tlut.
+ *
+ * K-mers are never removed; those that occur only in removed transcripts
+ * are left in a class of their own, that occurs in no transcript.  So an
+ * index that has been updated many times may be somewhat larger (and its
+ * classes somewhat finer) than one built from scratch.
+ *
+ * The updated files are written alongside the originals, and replace them
+ * only once every one of them has been written; if any can't be, they are
+ * removed and the index is left as it was.
+ *
+ * @return 0 on success, and non-zero if the updated index could not be written
+ */
+int updateIndex(const TranscriptStore& transcriptStore,
+                TranscriptGeneMap& tgmap,
+                const boost::filesystem::path& indexPath,
+                uint32_t merLen) {
+
+    namespace bfs = boost::filesystem;
+    using LUTTools::KmerLUT;
+    using LUTTools::Offset;
+    using LUTTools::TranscriptInfo;
+    using LUTTools::TranscriptList;
+
+    boost::timer::auto_cpu_timer timer(std::cerr);
+
+    bfs::path sfiPath = indexPath / "transcriptome.sfi";
+    bfs::path sfcPath = indexPath / "transcriptome.sfc";
+    bfs::path tlutPath = indexPath / "transcriptome.tlut";
+    bfs::path klutPath = indexPath / "transcriptome.klut";
+    bfs::path tgmPath = indexPath / "transcriptome.tgm";
+    bfs::path tfpPath = indexPath / "transcriptome.tfp";
+    bfs::path membershipPath = indexPath / "kmerEquivClasses.bin";
+
+    if (indexUpdateInterrupted(indexPath)) {
+        throw std::runtime_error("an earlier update of the index in " + indexPath.string() +
+                                 " was interrupted, leaving it inconsistent; rebuild it with --force");
+    }
+    for (auto& p : {sfiPath, sfcPath, tlutPath, klutPath, tgmPath, membershipPath}) {
+        if (!bfs::exists(p)) {
+            throw std::runtime_error("there is no complete index to update in " + indexPath.string() +
+                                     " (" + p.filename().string() + " is missing)");
+        }
+    }
+    if (!bfs::exists(tfpPath)) {
+        throw std::runtime_error("the index in " + indexPath.string() + " predates incremental updates; "
+                                 "rebuild it once with --force");
+    }
+
+    auto oldIndex = PerfectHashIndex::fromFile(sfiPath.string());
+    if (!oldIndex.nativeHash()) {
+        throw std::runtime_error("the index in " + indexPath.string() + " uses a CMPH hash; "
+                                 "rebuild it once with --force");
+    }
+    if (oldIndex.kmerLength() != merLen) {
+        throw std::runtime_error("the index in " + indexPath.string() + " was built with k = " +
+                                 std::to_string(oldIndex.kmerLength()) + ", not " + std::to_string(merLen));
+    }
+    bool canonical = oldIndex.canonical();
+
+    TranscriptGeneMap oldTgmap;
+    {
+        std::ifstream ifs(tgmPath.string(), std::ios::binary);
+        boost::archive::binary_iarchive ia(ifs);
+        ia >> oldTgmap;
+    }
+    auto oldFingerprints = LUTTools::readTranscriptFingerprints(tfpPath.string());
+    if (oldFingerprints.size() != oldTgmap.numTranscripts()) {
+        throw std::runtime_error(tfpPath.string() + " does not match " + tgmPath.string());
+    }
+
+    /**
+     * Compare the transcripts with those of the index
+     */
+    size_t numTranscripts = tgmap.numTranscripts();
+    auto fingerprints = transcriptFingerprints(transcriptStore, tgmap);
+    std::vector<size_t> storeIndex(numTranscripts, std::numeric_limits<size_t>::max());
+    for (size_t i = 0; i < transcriptStore.size(); ++i) {
+        auto id = findTranscript(tgmap, transcriptStore.name(i));
+        if (id != tgmap.INVALID) { storeIndex[id] = i; }
+    }
+
+    // An unchanged transcript's id in the updated index
+    std::vector<TranscriptID> oldToNew(oldTgmap.numTranscripts(), InvalidTranscript);
+    // The transcripts whose records must be recomputed; at first, the added ones
+    std::vector<uint8_t> rebuilt(numTranscripts, 0);
+    std::vector<uint8_t> unchanged(numTranscripts, 0);
+    size_t numRemoved{0}, numAdded{0};
+    for (TranscriptID t = 0; t < oldTgmap.numTranscripts(); ++t) {
+        if (oldFingerprints[t] == 0) { continue; }
+        auto id = findTranscript(tgmap, oldTgmap.transcriptName(t));
+        if (id != tgmap.INVALID and fingerprints[id] == oldFingerprints[t]) {
+            oldToNew[t] = id;
+            unchanged[id] = 1;
+        } else {
+            ++numRemoved;
+        }
+    }
+    std::vector<TranscriptID> added;
+    for (TranscriptID t = 0; t < numTranscripts; ++t) {
+        if (fingerprints[t] != 0 and !unchanged[t]) { rebuilt[t] = 1; added.push_back(t); }
+    }
+    numAdded = added.size();
+
+    std::cerr << numRemoved << " transcripts of the index were removed or changed, and " <<
+                 numAdded << " were added or changed\n";
+    if (numRemoved == 0 and numAdded == 0 and numTranscripts == oldTgmap.numTranscripts()) {
+        std::cerr << "The index is up-to-date.\n";
+        return 0;
+    }
+
+    auto membership = LUTTools::readKmerEquivClasses(membershipPath.string());
+    KmerLUT oldKlut;
+    LUTTools::readKmerLUT(klutPath.string(), oldKlut);
+    size_t numOldKmers = oldIndex.numKeys();
+    size_t numOldClasses = oldKlut.size();
+    if (membership.size() != numOldKmers) {
+        throw std::runtime_error(membershipPath.string() + " does not match the index");
+    }
+
+    /**
+     * Find the touched classes: those that occur in a removed transcript, or
+     * that contain a k-mer of an added one.  The k-mers of the added
+     * transcripts that aren't in the index are collected along the way.
+     */
+    std::vector<uint8_t> touchedClass(numOldClasses, 0);
+    tbb::parallel_for(size_t(0), numOldClasses,
+        [&oldKlut, &oldToNew, &touchedClass](size_t c) -> void {
+            for (auto t : oldKlut[c]) {
+                if (oldToNew[t] == InvalidTranscript) { touchedClass[c] = 1; break; }
+            }
+        });
+
+    tbb::enumerable_thread_specific<Worker> workers(Worker{merLen});
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, added.size()),
+        [&](const tbb::blocked_range<size_t>& range) -> void {
+            auto& w = workers.local();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                transcriptKmers(transcriptStore, storeIndex[added[i]], canonical, w);
+                for (auto k : w.kmers) {
+                    auto id = oldIndex.index(k);
+                    if (id == oldIndex.INVALID) {
+                        w.novelKmers.push_back(k);
+                    } else {
+                        w.touchedClasses.push_back(membership[id]);
+                    }
+                }
+            }
+        });
+
+    std::vector<Kmer> novelKmers;
+    for (auto& w : workers) {
+        for (auto c : w.touchedClasses) { touchedClass[c] = 1; }
+        novelKmers.insert(novelKmers.end(), w.novelKmers.begin(), w.novelKmers.end());
+        std::vector<KmerID>().swap(w.touchedClasses);
+        std::vector<Kmer>().swap(w.novelKmers);
+    }
+    std::sort(novelKmers.begin(), novelKmers.end());
+    novelKmers.erase(std::unique(novelKmers.begin(), novelKmers.end()), novelKmers.end());
+
+    // The untouched classes keep their order; the touched ones are labeled
+    // after them, once they have been partitioned anew
+    std::vector<KmerID> classLabel(numOldClasses, TouchedBit);
+    std::vector<KmerID> keptClasses;
+    for (KmerID c = 0; c < numOldClasses; ++c) {
+        if (!touchedClass[c]) {
+            classLabel[c] = keptClasses.size();
+            keptClasses.push_back(c);
+        }
+    }
+    size_t numKeptClasses = keptClasses.size();
+
+    /**
+     * Add the new k-mers to the overflow k-mers of the index
+     */
+    auto index = PerfectHashIndex::fromFile(sfiPath.string());
+    size_t numPrimary = index.numPrimaryKeys();
+    const auto& oldKmers = oldIndex.kmers();
+    std::vector<Kmer> overflowKmers(oldKmers.begin() + numPrimary, oldKmers.end());
+    size_t numOldOverflow = overflowKmers.size();
+    overflowKmers.insert(overflowKmers.end(), novelKmers.begin(), novelKmers.end());
+    std::cerr << "adding " << novelKmers.size() << " k-mers to the index (which will have " <<
+                 overflowKmers.size() << " overflow k-mers)\n";
+    index.setOverflow(overflowKmers);
+    size_t numKmers = index.numKeys();
+
+    // The primary k-mers keep their ids, but the overflow k-mers may not
+    std::vector<KmerID> overflowIDs(numOldOverflow);
+    tbb::parallel_for(size_t(0), numOldOverflow,
+        [&index, &overflowKmers, &overflowIDs](size_t j) -> void {
+            overflowIDs[j] = index.index(overflowKmers[j]);
+        });
+    auto newKmerID = [numPrimary, &overflowIDs](KmerID oldID) -> KmerID {
+        return (oldID < numPrimary) ? oldID : overflowIDs[oldID - numPrimary];
+    };
+    std::vector<Kmer>().swap(overflowKmers);
+
+    // Each touched k-mer (including the new ones) is numbered, in order of
+    // its id, with the touched bit set
+    std::vector<KmerID> newMembership(numKmers, TouchedBit);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numOldKmers),
+        [&](const tbb::blocked_range<size_t>& range) -> void {
+            for (auto j = range.begin(); j != range.end(); ++j) {
+                newMembership[newKmerID(j)] = classLabel[membership[j]];
+            }
+        });
+    size_t numTouchedKmers{0};
+    for (auto& m : newMembership) {
+        if (m & TouchedBit) { m = TouchedBit | numTouchedKmers++; }
+    }
+
+    // Every transcript containing a touched k-mer must be encoded again
+    for (KmerID c = 0; c < numOldClasses; ++c) {
+        if (!touchedClass[c]) { continue; }
+        for (auto t : oldKlut[c]) {
+            if (oldToNew[t] != InvalidTranscript) { rebuilt[oldToNew[t]] = 1; }
+        }
+    }
+    std::vector<TranscriptID> rebuiltTranscripts;
+    for (TranscriptID t = 0; t < numTranscripts; ++t) {
+        if (rebuilt[t]) { rebuiltTranscripts.push_back(t); }
+    }
+    std::cerr << "recomputing the classes of " << numTouchedKmers << " of " << numKmers <<
+                 " k-mers, which occur in " << rebuiltTranscripts.size() << " transcripts\n";
+
+    /**
+     * Encode the transcripts containing touched k-mers, and partition the
+     * touched k-mers anew
+     */
+    EquivClassBuilder touchedClasses(numTouchedKmers);
+    std::vector<std::atomic<uint32_t>> touchedCounts(numTouchedKmers);
+    std::vector<std::unique_ptr<TranscriptInfo>> rebuiltInfo(rebuiltTranscripts.size());
+    std::atomic<size_t> numInvalidKmers{0};
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, rebuiltTranscripts.size()),
+        [&](const tbb::blocked_range<size_t>& range) -> void {
+            auto& w = workers.local();
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                auto t = rebuiltTranscripts[i];
+                size_t s = storeIndex[t];
+                transcriptKmers(transcriptStore, s, canonical, w);
+
+                std::unique_ptr<TranscriptInfo> ti(new TranscriptInfo);
+                ti->name = transcriptStore.name(s);
+                ti->transcriptID = t;
+                ti->geneID = tgmap.gene(t);
+                ti->length = transcriptStore.length(s);
+                ti->kmers.reserve(w.kmers.size());
+                w.touchedKmers.clear();
+                for (auto k : w.kmers) {
+                    auto id = index.index(k);
+                    if (id == index.INVALID) { ++numInvalidKmers; continue; }
+                    ti->kmers.push_back(id);
+                    if (newMembership[id] & TouchedBit) {
+                        auto local = newMembership[id] & ~TouchedBit;
+                        w.touchedKmers.push_back(local);
+                        ++touchedCounts[local];
+                    }
+                }
+                touchedClasses.addTranscript(t, w.touchedKmers);
+                rebuiltInfo[i] = std::move(ti);
+            }
+        });
+    if (numInvalidKmers > 0) {
+        std::cerr << "warning: " << numInvalidKmers << " k-mers of the transcripts are missing from the index\n";
+    }
+
+    size_t numNewClasses{0};
+    if (numTouchedKmers > 0) {
+        touchedClasses.relabel();
+        const auto& touchedMembership = touchedClasses.partitionMembership();
+        numNewClasses = *std::max_element(touchedMembership.begin(), touchedMembership.end()) + 1;
+    }
+    size_t numClasses = numKeptClasses + numNewClasses;
+    std::cerr << "kept " << numKeptClasses << " of " << numOldClasses << " k-mer classes, and built " <<
+                 numNewClasses << " new ones\n";
+
+    /**
+     * The counts: those of the untouched k-mers are kept, and those of the
+     * touched k-mers are the number of times they occur in the (re-)encoded
+     * transcripts, which are all of the transcripts in which they occur
+     */
+    TmpFiles tmpFiles({sfiPath, sfcPath, membershipPath, tlutPath, tgmPath, tfpPath, klutPath});
+    auto del = [](PerfectHashIndex* h) -> void { /*do nothing*/; };
+    auto oldIndexPtr = std::shared_ptr<PerfectHashIndex>(&oldIndex, del);
+    auto indexPtr = std::shared_ptr<PerfectHashIndex>(&index, del);
+    {
+        auto oldCounts = CountDBNew::fromFile(sfcPath.string(), oldIndexPtr);
+        CountDBNew counts(indexPtr);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numOldKmers),
+            [&](const tbb::blocked_range<size_t>& range) -> void {
+                for (auto j = range.begin(); j != range.end(); ++j) {
+                    auto id = newKmerID(j);
+                    if (!(newMembership[id] & TouchedBit)) { counts.incAtIndex(id, oldCounts.atIndex(j)); }
+                }
+            });
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numKmers),
+            [&](const tbb::blocked_range<size_t>& range) -> void {
+                for (auto id = range.begin(); id != range.end(); ++id) {
+                    if (newMembership[id] & TouchedBit) {
+                        counts.incAtIndex(id, touchedCounts[newMembership[id] & ~TouchedBit]);
+                    }
+                }
+            });
+        if (!counts.dumpCountsToFile(tmpPath(sfcPath).string())) {
+            std::cerr << "ERROR: error writing " << tmpPath(sfcPath).string() << "\n";
+            return 1;
+        }
+    }
+    if (!written([&]() -> void { index.dumpToFile(tmpPath(sfiPath).string()); })) { return 1; }
+
+    // Label the touched k-mers with their new classes
+    if (numTouchedKmers > 0) {
+        const auto& touchedMembership = touchedClasses.partitionMembership();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numKmers),
+            [&](const tbb::blocked_range<size_t>& range) -> void {
+                for (auto id = range.begin(); id != range.end(); ++id) {
+                    auto& m = newMembership[id];
+                    if (m & TouchedBit) { m = numKeptClasses + touchedMembership[m & ~TouchedBit]; }
+                }
+            });
+    }
+    if (!written([&]() -> void { LUTTools::dumpKmerEquivClasses(newMembership, tmpPath(membershipPath).string()); })) {
+        return 1;
+    }
+
+    /**
+     * The k-mer look-up table: the untouched classes keep their (renumbered)
+     * transcripts, and the new classes get those of the encoded transcripts
+     */
+    std::vector<TranscriptList> newLists(numNewClasses);
+    tbb::parallel_for(size_t(0), rebuiltInfo.size(),
+        [&rebuiltInfo, &newMembership](size_t i) -> void {
+            for (auto& k : rebuiltInfo[i]->kmers) { k = newMembership[k]; }
+        });
+    for (auto& ti : rebuiltInfo) {
+        for (auto c : ti->kmers) {
+            if (c >= numKeptClasses) { newLists[c - numKeptClasses].push_back(ti->transcriptID); }
+        }
+    }
+    tbb::parallel_for(size_t(0), numNewClasses,
+        [&newLists](size_t c) -> void { std::sort(newLists[c].begin(), newLists[c].end()); });
+    auto newKlut = KmerLUT::fromLists(newLists);
+    std::vector<TranscriptList>().swap(newLists);
+
+    std::vector<Offset> offsets(numClasses + 1, 0);
+    for (size_t c = 0; c < numKeptClasses; ++c) {
+        offsets[c + 1] = offsets[c] + oldKlut[keptClasses[c]].size();
+    }
+    for (size_t c = 0; c < numNewClasses; ++c) {
+        offsets[numKeptClasses + c + 1] = offsets[numKeptClasses + c] + newKlut[c].size();
+    }
+    std::vector<TranscriptID> klutTranscripts(offsets.back());
+    std::vector<uint32_t> klutMultiplicities(offsets.back());
+    tbb::parallel_for(size_t(0), numClasses, [&](size_t c) -> void {
+        auto out = offsets[c];
+        if (c < numKeptClasses) {
+            // (the renumbering needn't preserve the order of the transcripts)
+            auto transcripts = oldKlut[keptClasses[c]];
+            auto multiplicities = oldKlut.multiplicities(keptClasses[c]);
+            std::vector<std::pair<TranscriptID, uint32_t>> entries(transcripts.size());
+            for (size_t i = 0; i < transcripts.size(); ++i) {
+                entries[i] = {oldToNew[transcripts[i]], multiplicities[i]};
+            }
+            std::sort(entries.begin(), entries.end());
+            for (auto& e : entries) {
+                klutTranscripts[out] = e.first;
+                klutMultiplicities[out++] = e.second;
+            }
+        } else {
+            auto transcripts = newKlut[c - numKeptClasses];
+            auto multiplicities = newKlut.multiplicities(c - numKeptClasses);
+            std::copy(transcripts.begin(), transcripts.end(), klutTranscripts.begin() + out);
+            std::copy(multiplicities, multiplicities + transcripts.size(), klutMultiplicities.begin() + out);
+        }
+    });
+    KmerLUT klut(MappedArray<Offset>(std::move(offsets)),
+                 MappedArray<TranscriptID>(std::move(klutTranscripts)),
+                 MappedArray<uint32_t>(std::move(klutMultiplicities)));
+    if (!written([&]() -> void { LUTTools::dumpKmerLUT(klut, tmpPath(klutPath).string()); })) { return 1; }
+
+    /**
+     * The transcript look-up table: the records of the transcripts that
+     * weren't encoded again are copied (with their classes renumbered)
+     */
+    {
+        std::ifstream oldTlut(tlutPath.string(), std::ios::binary);
+        size_t numOldRecords{0};
+        oldTlut.read(reinterpret_cast<char*>(&numOldRecords), sizeof(numOldRecords));
+
+        std::ofstream tlut(tmpPath(tlutPath).string(), std::ios::binary);
+        size_t numRec{0};
+        tlut.write(reinterpret_cast<const char*>(&numRec), sizeof(numRec));
+        for (size_t r = 0; r < numOldRecords; ++r) {
+            auto ti = LUTTools::readTranscriptInfo(oldTlut);
+            auto t = oldToNew[ti->transcriptID];
+            if (t == InvalidTranscript or rebuilt[t]) { continue; }
+            ti->transcriptID = t;
+            ti->geneID = tgmap.gene(t);
+            ti->name = tgmap.transcriptName(t);
+            for (auto& c : ti->kmers) { c = classLabel[c]; }
+            LUTTools::writeTranscriptInfo(ti.get(), tlut);
+            ++numRec;
+        }
+        for (auto& ti : rebuiltInfo) {
+            LUTTools::writeTranscriptInfo(ti.get(), tlut);
+            ++numRec;
+        }
+        tlut.seekp(0);
+        tlut.write(reinterpret_cast<const char*>(&numRec), sizeof(numRec));
+        tlut.close();
+        if (!tlut) {
+            std::cerr << "ERROR: error writing " << tmpPath(tlutPath).string() << "\n";
+            return 1;
+        }
+    }
+
+    bool tgmWritten = written([&]() -> void {
+        std::ofstream ofs(tmpPath(tgmPath).string(), std::ios::binary);
+        {
+            boost::archive::binary_oarchive oa(ofs);
+            oa << tgmap;
+        }
+        ofs.close();
+        if (!ofs) { throw std::runtime_error("error writing " + tmpPath(tgmPath).string()); }
+    });
+    if (!tgmWritten) { return 1; }
+    if (!written([&]() -> void { LUTTools::dumpTranscriptFingerprints(fingerprints, tmpPath(tfpPath).string()); })) {
+        return 1;
+    }
+
+    // The files are replaced one at a time, so the marker tells any later
+    // reader of the index (until it is removed) that they may not agree
+    {
+        std::ofstream marker(updateMarkerPath(indexPath).string());
+        if (!marker) { throw std::runtime_error("error writing " + updateMarkerPath(indexPath).string()); }
+    }
+    for (auto& p : {sfiPath, sfcPath, membershipPath, tlutPath, tgmPath, tfpPath, klutPath}) {
+        bfs::rename(tmpPath(p), p);
+    }
+    clearIndexUpdateMarker(indexPath);
+    std::cerr << "updated the index in " << indexPath << "\n";
+    return 0;
+}
@@ -51,6 +51,9 @@
 
 #include "ReadProducer.hpp"
 #include "ReadLibrary.hpp"
+#include "KmerEncoder.hpp"
+#include "CountingStats.hpp"
+#include "NUMAPolicy.hpp"
 
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
@@ -66,14 +69,55 @@
 
 #include "PerfectHashIndex.hpp"
 #include "StreamingSequenceParser.hpp"
+#include "MappedSequenceParser.hpp"
 #include "LibraryFormat.hpp"
 
 enum class MerDirection : std::int8_t { FORWARD = 1, REVERSE = 2, BOTH = 3 };
 
+/**
+ * A per-thread handle on the ReadProducer for one input file.  This erases
+ * the type of the underlying parser, so that a single pool of counting
+ * threads can draw reads from files parsed by different parser types.
+ */
+class ReadSource {
+public:
+  virtual ~ReadSource() {}
+  virtual bool nextRead(ReadSeq*& s) = 0;
+  virtual void finishedWithRead(ReadSeq*& s) = 0;
+};
+
 template <typename ParserT>
-bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_t merLen,
-                bool discardPolyA, ReadStrandedness direction, std::atomic<uint64_t>& numReadsProcessed,
-                std::atomic<uint64_t>&unmappedKmers, std::atomic<uint64_t>& readNum, size_t numThreads) {
+class ParserReadSource : public ReadSource {
+public:
+  ParserReadSource(ParserT& parser) : producer_(parser) {}
+  bool nextRead(ReadSeq*& s) override { return producer_.nextRead(s); }
+  void finishedWithRead(ReadSeq*& s) override { producer_.finishedWithRead(s); }
+private:
+  ReadProducer<ParserT> producer_;
+};
+
+/**
+ * One input file to be counted, along with the direction in which its
+ * reads should be counted.
+ */
+struct CountJob {
+  std::string file;
+  ReadStrandedness orientation;
+  // Create a new (per-thread) source of reads from this file
+  std::function<ReadSource*()> newSource;
+};
+
+/**
+ * Count the k-mers of all of the given files with a single pool of threads.
+ * Each thread starts on a different file and, once the file it is reading
+ * is exhausted, moves on to the next file that still has reads; so all of
+ * the threads remain busy until the last file is finished.  What each
+ * thread did is recorded in threadStats.
+ */
+void countKmers(std::vector<CountJob>& jobs, PerfectHashIndex& phi, CountDBNew& rhash, size_t merLen,
+                bool discardPolyA, std::atomic<uint64_t>& numReadsProcessed,
+                std::atomic<uint64_t>&unmappedKmers, std::atomic<uint64_t>& readNum, size_t numThreads,
+                bool shardCounts, bool numa, std::vector<CountingThreadStats>& threadStats) {
 
   using std::string;
   using std::cerr;
@@ -81,13 +125,17 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
   using std::thread;
   using std::atomic;
 
+  threadStats.assign(numThreads, CountingThreadStats());
+  if (jobs.empty()) { return; }
+
   boost::timer::auto_cpu_timer t(cerr);
   auto start = std::chrono::steady_clock::now();
   bool canonical = phi.canonical();
 
   atomic<size_t> fileReadNum{0};
   vector<thread> threads;
-  atomic<bool> notDone{true};
+  std::unique_ptr<atomic<bool>[]> exhausted(new atomic<bool>[jobs.size()]);
+  for (size_t i = 0; i < jobs.size(); ++i) { exhausted[i] = false; }
   // Start the desired number of threads to parse the reads
   // and build our data structure.
   for (size_t k = 0; k < numThreads; ++k) {
@@ -95,18 +143,33 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
 
 
     threads.emplace_back(thread(
-            [&parser, &readNum, &fileReadNum, &rhash, &start, &phi, &unmappedKmers, &k, discardPolyA, threadIdx, direction, merLen]() mutable -> void {
+            [&jobs, &exhausted, &readNum, &fileReadNum, &rhash, &start, &phi, &unmappedKmers, &threadStats, discardPolyA, threadIdx, merLen, shardCounts, numa]() mutable -> void {
+                    // Pinned before anything is allocated, so that the thread's
+                    // buffers (and its shard) are placed on its own node
+                    if (numa) { NUMAPolicy::pinThread(threadIdx); }
                     using BinMer = uint64_t;
-                    vector<BinMer> fwdMers;
-                    vector<BinMer> revMers;
-
-                    BinMer lshift{2 * (merLen - 1)};
-                    BinMer masq{(1UL << (2 * merLen)) - 1};
-                    BinMer cmlen, kmer, rkmer;
+                    using Clock = std::chrono::steady_clock;
+                    auto elapsedNs = [](Clock::time_point from, Clock::time_point to) -> uint64_t {
+                        return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+                    };
+                    // Encodes each read into its forward and reverse-complement k-mers
+                    KmerEncoder encoder(merLen);
+
+                    // The indices to which the k-mers of the current read resolve
+                    // (in both orientations), and whether each was a polyA k-mer.
+                    vector<size_t> fwdIds;
+                    vector<size_t> revIds;
+                    vector<uint8_t> isPolyA;
+
+                    // The indices that have mapped but have not yet been counted
+                    // while the direction of the read is undetermined.
+                    vector<size_t> fwdMers;
+                    vector<size_t> revMers;
 
                     size_t numKmers = 0;
                     size_t numRemaining = 0;
                     size_t fCount = 0; size_t rCount = 0;
+                    auto direction = ReadStrandedness::U;
                     auto dir = direction;
 
                     auto INVALID = phi.INVALID;
@@ -118,12 +181,34 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
                     uint64_t localUnmappedKmers{0};
                     uint64_t locallyProcessedReads{0};
 
-                    ReadProducer<ParserT> producer(parser);
+                    // Accumulated locally, and stored in threadStats when done
+                    CountingThreadStats stats;
+                    auto threadStart = Clock::now();
+                    Clock::time_point tParse, tRead, tEncoded, tHashed;
+                    bool timed = true;
+
+                    // In sharded mode, increments are accumulated in a thread-local
+                    // table and only reach the shared counts when evicted from it
+                    // or when this thread finishes.
+                    std::unique_ptr<CountShard> shard(shardCounts ? new CountShard(rhash) : nullptr);
+                    auto countAt = [&shard, &rhash](size_t idx) -> void {
+                        if (shard) { shard->incAtIndex(idx); } else { rhash.incAtIndex(idx); }
+                    };
 
                     ReadSeq* s;
 
-                    while (producer.nextRead(s)) {
+                    size_t jobIdx = threadIdx % jobs.size();
+                    for (size_t nj = 0; nj < jobs.size(); ++nj, jobIdx = (jobIdx + 1) % jobs.size()) {
+                    // Some other thread has already finished this file
+                    if (exhausted[jobIdx]) { continue; }
+
+                    std::unique_ptr<ReadSource> producer(jobs[jobIdx].newSource());
+                    direction = jobs[jobIdx].orientation;
+
+                    if (timed) { tParse = Clock::now(); }
+                    while (producer->nextRead(s)) {
                         ++readNum; ++locallyProcessedReads; ++fileReadNum;
+                        if (timed) { tRead = Clock::now(); }
                         if (readNum % 250000 == 0) {
                             auto end = std::chrono::steady_clock::now();
                             auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
@@ -132,13 +217,10 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
                             cerr << "processed " << readNum << " reads (" << rate << ") reads/s\r\r";
                         }
 
-                        const char* start     = s->seq;
                         uint32_t readLen      = s->len;
-                        const char* const end = s->seq + readLen;
 
                         // reset all of the counts
                         fCount = rCount = numKmers = 0;
-                        cmlen = kmer = rkmer = 0;
                         dir = direction;
 
                         // the maximum number of kmers we'd have to store
@@ -149,116 +231,108 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
                         rhash.appendLength(readLen);
 
                         // the read must be at least the kmer length
-                        if ( maxNumKmers == 0 ) { continue; }
+                        if ( maxNumKmers == 0 ) {
+                            producer->finishedWithRead(s);
+                            // a short read is not timed; the next one is instead
+                            ++stats.reads;
+                            if (timed) { tParse = Clock::now(); }
+                            continue;
+                        }
 
                         if ( maxNumKmers > fwdMers.size()) {
+                            fwdIds.resize(maxNumKmers); revIds.resize(maxNumKmers);
+                            isPolyA.resize(maxNumKmers);
                             fwdMers.resize(maxNumKmers);
                             revMers.resize(maxNumKmers);
                         }
 
-                        size_t binMerId{0};
-                        size_t rMerId{0};
-                        // iterate over the read base-by-base
-                        while(start < end) {
-                            uint_t     c = jellyfish::dna_codes[static_cast<uint_t>(*start++)];
-
-                            // ***** Potentially consider quality values in the future **** /
-                            // const char q = *start++;
-                            // if(q < q_thresh)
-                            //   c = CODE_RESET;
-
-                            switch(c) {
-                                case jellyfish::CODE_IGNORE: break;
-                                case jellyfish::CODE_COMMENT:
-                                    std::cerr << "ERROR: unexpected character " << c << " in read!\n";
-
-                                // Fall through
-                                case jellyfish::CODE_RESET:
-                                  cmlen = kmer = rkmer = 0;
+                        // Stage 1: encode the read, collecting every valid k-mer
+                        // (and its reverse complement).
+                        numKmers = encoder.encode(s->seq, readLen);
+                        const BinMer* fwdKeys = encoder.fwdMers();
+                        const BinMer* revKeys = encoder.revMers();
+                        for (size_t i = 0; i < numKmers; ++i) {
+                            isPolyA[i] = discardPolyA and (fwdKeys[i] == polyA or revKeys[i] == polyA);
+                        }
+                        if (timed) { tEncoded = Clock::now(); }
+
+                        // Stage 2: resolve the k-mers of the read as a single batch, in
+                        // the direction(s) we may need, and prefetch the counts that
+                        // they will increment.
+                        if (direction != ReadStrandedness::A) {
+                            phi.indexBatch(fwdKeys, numKmers, &fwdIds[0]);
+                            for (size_t i = 0; i < numKmers; ++i) {
+                                if (!shard and fwdIds[i] != INVALID) { rhash.prefetchAtIndex(fwdIds[i]); }
+                            }
+                        }
+                        if (direction != ReadStrandedness::S) {
+                            phi.indexBatch(revKeys, numKmers, &revIds[0]);
+                            for (size_t i = 0; i < numKmers; ++i) {
+                                if (!shard and revIds[i] != INVALID) { rhash.prefetchAtIndex(revIds[i]); }
+                            }
+                        }
+                        if (timed) { tHashed = Clock::now(); }
+
+                        // Stage 3: count the resolved k-mers according to the
+                        // direction of the read.
+                        for (size_t i = 0; i < numKmers; ++i) {
+                            --numRemaining;
+                            if (isPolyA[i]) { continue; }
+
+                            auto binMerId = fwdIds[i];
+                            auto rMerId = revIds[i];
+
+                            // dispatch on the direction
+                            switch (dir) {
+                               // We're certain that more kmers map in the forward direction
+                               // so we only consider the rest of the read in this direction.
+                               case ReadStrandedness::S:
+                                if (binMerId != INVALID) {
+                                  countAt(binMerId);
+                                  ++fCount;
+                                }
+                                break;
+                               // end case FORWARD
+
+                               // We're certain that more kmers map in the reverse direction
+                               // so we only consider the rest of the read in this direction.
+                               case ReadStrandedness::A:
+                                  if (rMerId != INVALID) {
+                                    countAt(rMerId);
+                                    ++rCount;
+                                  }
                                   break;
+                               // end case REVERSE
 
-                                default:
+                               case ReadStrandedness::U:
+                                  // Determine whether or not to count the forward kmer.
+                                  fwdMers[fCount] = binMerId;
+                                  fCount += (binMerId != INVALID);
 
-                                  kmer = ((kmer << 2) & masq) | c;
-                                  rkmer = (rkmer >> 2) | ((0x3 - c) << lshift);
+                                  // Determine whether or not to count the reverse kmer.
+                                  revMers[rCount] = rMerId;
+                                  rCount += (rMerId != INVALID);
 
-                                  // count if the kmer is valid in the forward and
-                                  // reverse directions
-                                  if(++cmlen >= merLen) {
-                                    cmlen = merLen;
+                                  // Determine if we need to continue looking at both directions
+                                  dir = (fCount > (rCount + numRemaining)) ? ReadStrandedness::S :
+                                        (rCount > (fCount + numRemaining)) ? ReadStrandedness::A : ReadStrandedness::U;
 
-                                    if (discardPolyA and (kmer == polyA or rkmer == polyA)) {
-                                      ++numKmers; --numRemaining;
+                                  switch (dir) {
+                                    case ReadStrandedness::S:
+                                      for (auto j : boost::irange(size_t(0), fCount)) { countAt(fwdMers[j]);
+                                      }
+                                      break;
+                                    case ReadStrandedness::A:
+                                      for (auto j : boost::irange(size_t(0), rCount)) { countAt(revMers[j]);
+                                      }
                                       break;
-                                    }
-
-                                    // dispatch on the direction
-                                    switch (dir) {
-                                       // We're certain that more kmers map in the forward direction
-                                       // so we only consider the rest of the read in this direction.
-                                       case ReadStrandedness::S:
-                                        // get the index of the forward kmer
-                                        binMerId = phi.index(kmer);
-                                        if (binMerId != INVALID) {
-                                          rhash.incAtIndex(binMerId);
-                                          ++fCount;
-                                        }
-                                        ++numKmers; --numRemaining;
-                                        break;
-                                       // end case FORWARD
-
-                                       // We're certain that more kmers map in the reverse direction
-                                       // so we only consider the rest of the read in this direction.
-                                       case ReadStrandedness::A:
-                                          // get the index of the forward kmer
-                                          rMerId = phi.index(rkmer);
-                                          if (rMerId != INVALID) {
-                                            rhash.incAtIndex(rMerId);
-                                            ++rCount;
-                                          }
-                                          ++numKmers; --numRemaining;
-                                          break;
-                                       // end case REVERSE
-
-                                       case ReadStrandedness::U:
-                                          // form the new kmer and it's reverse complement
-
-                                          // Find the index of the forward kmer and determine
-                                          // whether or not to count it.
-                                          binMerId = phi.index(kmer);
-                                          fwdMers[fCount] = binMerId;
-                                          fCount += (binMerId != INVALID);
-
-                                          // Find the index of the reverse kmer and determine
-                                          // whether or not to count it.
-                                          rMerId = phi.index(rkmer);
-                                          revMers[rCount] = rMerId;
-                                          rCount += (rMerId != INVALID);
-
-                                          ++numKmers; --numRemaining;
-
-                                          // Determine if we need to continue looking at both directions
-                                          dir = (fCount > (rCount + numRemaining)) ? ReadStrandedness::S :
-                                                (rCount > (fCount + numRemaining)) ? ReadStrandedness::A : ReadStrandedness::U;
-
-                                          switch (dir) {
-                                            case ReadStrandedness::S:
-                                              for (auto i : boost::irange(size_t(0), fCount)) { rhash.incAtIndex(fwdMers[i]);
-                                              }
-                                              break;
-                                            case ReadStrandedness::A:
-                                              for (auto i : boost::irange(size_t(0), rCount)) { rhash.incAtIndex(revMers[i]);
-                                              }
-                                              break;
-                                            default:
-                                              break;
-                                          }
-                                      // end case BOTH
-
-                                    } // end dirction switch
-                                  } // end if
-                            } // end switch
-                        } // end read
+                                    default:
+                                      break;
+                                  }
+                              // end case BOTH
+
+                            } // end dirction switch
+                        } // end kmers
 
                         uint64_t count{0};
                         switch (dir) {
@@ -268,7 +342,7 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
                           // actually incremented counts yet, so we do that here.
                           case ReadStrandedness::U:
                             if (dir == ReadStrandedness::U) {
-                              for (auto i : boost::irange(size_t(0), fCount)) { rhash.incAtIndex(fwdMers[i]);
+                              for (auto i : boost::irange(size_t(0), fCount)) { countAt(fwdMers[i]);
                               }
                             }
                             count = fCount;
@@ -287,10 +361,29 @@ bool countKmers(ParserT& parser, PerfectHashIndex& phi, CountDBNew& rhash, size_
                         // minus the number that mapped.
                         localUnmappedKmers += (numKmers - count);
 
-                        producer.finishedWithRead(s);
+                        producer->finishedWithRead(s);
 
-                } // end parse all reads
+                        stats.kmers += numKmers;
+                        if (timed) {
+                            auto tCounted = Clock::now();
+                            stats.parseNs += elapsedNs(tParse, tRead);
+                            stats.encodeNs += elapsedNs(tRead, tEncoded);
+                            stats.hashNs += elapsedNs(tEncoded, tHashed);
+                            stats.incrementNs += elapsedNs(tHashed, tCounted);
+                            ++stats.timedReads;
+                        }
+                        ++stats.reads;
+                        timed = (stats.reads % CountingThreadStats::TimingStride == 0);
+                        if (timed) { tParse = Clock::now(); }
+
+                    } // end parse all reads of this file
+                    exhausted[jobIdx] = true;
+                } // end files
+                // merge this thread's pending counts (concurrently with the other threads)
+                shard.reset();
                 unmappedKmers += localUnmappedKmers;
+                stats.wallSeconds = std::chrono::duration<double>(Clock::now() - threadStart).count();
+                threadStats[threadIdx] = stats;
                 delete [] as;
             }));
 
@@ -307,7 +400,10 @@ int mainCount( uint32_t numThreads,
                const std::string& sfIndexBase,
                const std::vector<ReadLibrary>& readLibraries,
                const std::string& countsFile,
-               bool discardPolyA) {
+               bool discardPolyA,
+               bool shardCounts,
+               bool perfCounters,
+               bool numa) {
 
 
     using std::vector;
@@ -391,6 +487,11 @@ same index, and the counts will be written to the file [counts].
         auto phiPtr = std::shared_ptr<PerfectHashIndex>(&phi, del);
 
         CountDBNew rhash( phiPtr );
+        // Every thread increments counts all over the table, so its pages
+        // are spread over the nodes rather than left on the main thread's
+        if (numa and rhash.interleave()) {
+            cerr << "interleaved the counts over " << NUMAPolicy::numNodes() << " NUMA nodes\n";
+        }
 
         std::atomic<uint64_t> readNum{0};
         std::atomic<uint64_t> processedReads{0};
@@ -399,6 +500,16 @@ same index, and the counts will be written to the file [counts].
 
         { // create a scope --- the timer will be destructed at the end
 
+          // Opened before any of the parsing or counting threads are created,
+          // so that the counters include them
+          std::unique_ptr<PerfCounters> perf(perfCounters ? new PerfCounters() : nullptr);
+          if (perf and !perf->available()) {
+              std::cerr << "could not open any hardware performance counters "
+                           "(see /proc/sys/kernel/perf_event_paranoid)\n";
+          }
+          if (perf) { perf->start(); }
+          QueueOccupancySampler sampler;
+
           boost::timer::auto_cpu_timer t(std::cerr);
           auto start = std::chrono::steady_clock::now();
           std::vector<std::tuple<const std::string&, ReadStrandedness, CountDBNew*>> filesToProcess;
@@ -452,49 +563,80 @@ same index, and the counts will be written to the file [counts].
               }
           }
 
+          // Regular (uncompressed) files are mapped into memory and parsed in
+          // place; named pipes, compressed files and multi-line FASTQ files go
+          // through the kseq-based parser.  All of the parsers are created (and started) up front,
+          // since their files are all read at the same time.
+          std::vector<bool> isMapped;
+          size_t numStreaming{0};
           for (auto& countJob : filesToProcess) {
-              auto& readFile = std::get<0>(countJob);
-              auto orientation = std::get<1>(countJob);
-              auto& countHash = *std::get<2>(countJob);
+              bfs::path filePath(std::get<0>(countJob));
+              bool mapped = bfs::is_regular_file(filePath) and
+                            detectCompression(filePath) == InputCompression::NONE and
+                            MappedReadParser::isChunkable(filePath);
+              isMapped.push_back(mapped);
+              numStreaming += (mapped) ? 0 : 1;
+          }
+          // Split the memory (and decompression threads) usually given to a
+          // single streaming parser among all of them
+          size_t queueCapacity = std::max(size_t(2000000) / std::max(numStreaming, size_t(1)), size_t(250000));
+          size_t numInflaters = std::max(numActors / (4 * std::max(numStreaming, size_t(1))), size_t(1));
+
+          vector<std::unique_ptr<MappedReadParser>> mappedParsers;
+          vector<std::unique_ptr<vector<bfs::path>>> streamingPaths;
+          vector<std::unique_ptr<StreamingReadParser>> streamingParsers;
+          vector<CountJob> jobs;
+
+          for (size_t i = 0; i < filesToProcess.size(); ++i) {
+              auto& readFile = std::get<0>(filesToProcess[i]);
+              auto orientation = std::get<1>(filesToProcess[i]);
               cerr << "file " << readFile << ": \n";
 
-              namespace bfs = boost::filesystem;
-              bfs::path filePath(readFile);
-
-              // If this is a regular file, then use the Jellyfish parser
-              if (bfs::is_regular_file(filePath)) {
-
-                  char** fnames = new char*[1];// fnames[1];
-                  fnames[0] = const_cast<char*>(readFile.c_str());
-
-                  jellyfish::parse_read parser(fnames, fnames+1, 5000);
-
-                  countKmers<jellyfish::parse_read>(
-                                                    parser, phi, countHash, merLen, discardPolyA,
-                                                    orientation , numReadsProcessed,
-                                                    unmappedKmers, readNum, numActors);
-
-              } else { // If this is a named pipe, then use the kseq-based parser
-                  vector<bfs::path> paths{readFile};
-                  StreamingReadParser parser(paths);
-                  parser.start();
-
-                  countKmers<StreamingReadParser>(
-                                                  parser, phi, countHash, merLen, discardPolyA,
-                                                  orientation, numReadsProcessed,
-                                                  unmappedKmers, readNum, numActors);
+              if (isMapped[i]) {
+                  mappedParsers.emplace_back(new MappedReadParser(bfs::path(readFile)));
+                  auto parser = mappedParsers.back().get();
+                  jobs.push_back(CountJob{readFile, orientation, [parser]() -> ReadSource* {
+                      return new ParserReadSource<MappedReadParser>(*parser);
+                  }});
+              } else {
+                  streamingPaths.emplace_back(new vector<bfs::path>{readFile});
+                  streamingParsers.emplace_back(
+                      new StreamingReadParser(*streamingPaths.back(), numInflaters, queueCapacity));
+                  auto parser = streamingParsers.back().get();
+                  parser->start();
+                  sampler.addQueue(readFile, parser->queueCapacity(),
+                                   [parser]() -> size_t { return parser->queuedReads(); });
+                  jobs.push_back(CountJob{readFile, orientation, [parser]() -> ReadSource* {
+                      return new ParserReadSource<StreamingReadParser>(*parser);
+                  }});
               }
+          }
 
-              cerr << "\n";
+          CountingStats stats;
+          sampler.start();
+          countKmers(jobs, phi, rhash, merLen, discardPolyA, numReadsProcessed,
+                     unmappedKmers, readNum, numActors, shardCounts, numa, stats.threads);
+          sampler.stop();
+          for (size_t i = 0; i < streamingParsers.size(); ++i) {
+              if (streamingParsers[i]->failed()) {
+                  throw std::runtime_error("could not read all of the reads in " +
+                                           streamingPaths[i]->front().string());
+              }
           }
+          if (perf) { perf->stop(); stats.perf = perf->read(); }
+          stats.queues = sampler.queues();
+          cerr << "\n";
 
           auto end = std::chrono::steady_clock::now();
           auto sec = std::chrono::duration_cast<std::chrono::seconds>(end-start);
           auto nsec = sec.count();
           auto rate = (nsec > 0) ? readNum / sec.count() : 0;
+          stats.wallSeconds = std::chrono::duration<double>(end - start).count();
           std::cerr << "\nOverall rate: " << rate << " reads / s\n";
           std::cerr << "\n" << std::endl;
-          rhash.dumpCountsToFile(countsFile);
+          if (!rhash.dumpCountsToFile(countsFile)) {
+              throw std::runtime_error("error writing " + countsFile);
+          }
 
           // Total kmers
           size_t mappedKmers= 0;
@@ -512,8 +654,23 @@ same index, and the counts will be written to the file [counts].
           countInfoFile << "unmapped\t" << unmappedKmers << "\n";
           countInfoFile << "mapped_ratio\t" <<
                            (mappedKmers / static_cast<double>(totalCount)) << "\n";
+          // Thread-seconds spent in each stage, and how evenly the reads were
+          // spread over the threads (the most handled by any thread / the mean)
+          countInfoFile << "parse_seconds\t" << stats.parseSeconds() << "\n";
+          countInfoFile << "encode_seconds\t" << stats.encodeSeconds() << "\n";
+          countInfoFile << "hash_seconds\t" << stats.hashSeconds() << "\n";
+          countInfoFile << "increment_seconds\t" << stats.incrementSeconds() << "\n";
+          countInfoFile << "read_imbalance\t" << stats.readImbalance() << "\n";
           countInfoFile.close();
 
+          // The complete record (per thread, per queue and the hardware
+          // counters) goes alongside, as JSON
+          bfs::path countStatsFilename(countsFile);
+          countStatsFilename.replace_extension(".count_stats.json");
+          std::ofstream countStatsFile(countStatsFilename.string());
+          stats.writeJSON(countStatsFile);
+          countStatsFile.close();
+
           std::cerr << "There were " << totalCount << ", kmers; " << unmappedKmers << " could not be mapped\n";
           std::cerr << "Mapped " <<
                        (mappedKmers / static_cast<double>(totalCount)) * 100.0 << "% of the kmers\n";
@@ -529,6 +686,7 @@ same index, and the counts will be written to the file [counts].
         std::cerr << "Program Options Error : [" << e.what() << "]. Exiting.\n";
         std::exit(1);
     } catch (std::exception &e) {
+        std::cerr << "ERROR: [" << e.what() << "]\n";
         std::cerr << "ERROR: sailfish count (subordinate command) invoked improperly.\n";
         std::exit(1);
     }
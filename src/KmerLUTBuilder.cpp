@@ -0,0 +1,161 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "KmerLUTBuilder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#include "unistd.h"
+
+#include <boost/filesystem.hpp>
+
+#include "tbb/parallel_for.h"
+
+namespace {
+  // A few buckets per thread, so that building them balances well; but no
+  // bucket may span more classes than its 32-bit offsets can address
+  size_t numBucketsFor(size_t numClasses, size_t numThreads) {
+      constexpr size_t MaxClassesPerBucket = std::numeric_limits<uint32_t>::max();
+      size_t numBuckets = std::min(numClasses, 16 * std::max(numThreads, size_t(1)));
+      numBuckets = std::max(numBuckets, (numClasses + MaxClassesPerBucket - 1) / MaxClassesPerBucket);
+      return std::max(numBuckets, size_t(1));
+  }
+}
+
+KmerLUTBuilder::KmerLUTBuilder(size_t numClasses, size_t memoryBudget, size_t numThreads,
+                               const std::string& spillDir) :
+    numClasses_(numClasses),
+    numBuckets_(numBucketsFor(numClasses, numThreads)),
+    spillDir_(spillDir),
+    locals_(Local(numBuckets_)),
+    spilledSizes_(numBuckets_, 0),
+    spillMutexes_(new std::mutex[numBuckets_]),
+    numSpilled_(0) {
+    classesPerBucket_ = std::max((numClasses_ + numBuckets_ - 1) / numBuckets_, size_t(1));
+    localCapacity_ = std::max(memoryBudget / (std::max(numThreads, size_t(1)) * sizeof(Entry)), size_t(1));
+}
+
+KmerLUTBuilder::~KmerLUTBuilder() {
+    for (size_t b = 0; b < numBuckets_; ++b) {
+        if (spilledSizes_[b] > 0) { std::remove(spillFile_(b).c_str()); }
+    }
+}
+
+std::string KmerLUTBuilder::spillFile_(size_t bucket) const {
+    boost::filesystem::path p(spillDir_);
+    p /= "klut." + std::to_string(getpid()) + "." + std::to_string(bucket) + ".spill";
+    return p.string();
+}
+
+void KmerLUTBuilder::addTranscript(LUTTools::TranscriptID transcriptID,
+                                   const std::vector<LUTTools::KmerID>& classes) {
+    auto& local = locals_.local();
+    auto& sorted = local.classes;
+    sorted.assign(classes.begin(), classes.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    // One entry per distinct class
+    for (size_t i = 0; i < sorted.size(); ) {
+        size_t j = i + 1;
+        while (j < sorted.size() and sorted[j] == sorted[i]) { ++j; }
+        size_t b = sorted[i] / classesPerBucket_;
+        local.buckets[b].push_back({static_cast<uint32_t>(sorted[i] - b * classesPerBucket_),
+                                    transcriptID, static_cast<uint32_t>(j - i)});
+        ++local.numEntries;
+        i = j;
+    }
+    if (local.numEntries >= localCapacity_) { spill_(local); }
+}
+
+void KmerLUTBuilder::spill_(Local& local) {
+    for (size_t b = 0; b < numBuckets_; ++b) {
+        auto& entries = local.buckets[b];
+        if (entries.empty()) { continue; }
+        {
+            std::lock_guard<std::mutex> lock(spillMutexes_[b]);
+            std::ofstream out(spillFile_(b), std::ios::binary | std::ios::app);
+            out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+            if (!out) { throw std::runtime_error("could not write to " + spillFile_(b)); }
+            spilledSizes_[b] += entries.size();
+        }
+        numSpilled_ += entries.size();
+        // (release the memory, rather than just the entries)
+        std::vector<Entry>().swap(entries);
+    }
+    local.numEntries = 0;
+}
+
+LUTTools::KmerLUT KmerLUTBuilder::build() {
+    using LUTTools::Offset;
+    using LUTTools::TranscriptID;
+
+    // The entries of each bucket are a contiguous slice of the table; each
+    // (class, transcript) pair occurs once, so the slices' sizes are known
+    std::vector<size_t> bucketOffsets(numBuckets_ + 1, 0);
+    for (size_t b = 0; b < numBuckets_; ++b) {
+        size_t size = spilledSizes_[b];
+        for (auto& local : locals_) { size += local.buckets[b].size(); }
+        bucketOffsets[b + 1] = bucketOffsets[b] + size;
+    }
+
+    std::vector<Offset> offsets(numClasses_ + 1, 0);
+    std::vector<TranscriptID> transcripts(bucketOffsets[numBuckets_]);
+    std::vector<uint32_t> multiplicities(bucketOffsets[numBuckets_]);
+    tbb::parallel_for(size_t(0), numBuckets_, [&](size_t b) -> void {
+        std::vector<Entry> entries;
+        entries.reserve(bucketOffsets[b + 1] - bucketOffsets[b]);
+        if (spilledSizes_[b] > 0) {
+            entries.resize(spilledSizes_[b]);
+            std::ifstream in(spillFile_(b), std::ios::binary);
+            in.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(Entry));
+            if (!in) { throw std::runtime_error("could not read back " + spillFile_(b)); }
+        }
+        for (auto& local : locals_) {
+            entries.insert(entries.end(), local.buckets[b].begin(), local.buckets[b].end());
+            std::vector<Entry>().swap(local.buckets[b]);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& x, const Entry& y) -> bool {
+            return (x.classOffset != y.classOffset) ? x.classOffset < y.classOffset :
+                                                      x.transcriptID < y.transcriptID;
+        });
+
+        // The classes of a bucket are a contiguous range, so no two buckets
+        // count into the same offsets
+        size_t firstClass = b * classesPerBucket_;
+        size_t out = bucketOffsets[b];
+        for (auto& e : entries) {
+            transcripts[out] = e.transcriptID;
+            multiplicities[out++] = e.multiplicity;
+            ++offsets[firstClass + e.classOffset + 1];
+        }
+    });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    return LUTTools::KmerLUT(MappedArray<Offset>(std::move(offsets)),
+                             MappedArray<TranscriptID>(std::move(transcripts)),
+                             MappedArray<uint32_t>(std::move(multiplicities)));
+}
@@ -35,6 +35,8 @@
 #include <thread>
 #include <chrono>
 #include <iomanip>
+#include <limits>
+#include <stdexcept>
 
 #include "tbb/parallel_for.h"
 #include "tbb/parallel_for_each.h"
@@ -46,6 +48,36 @@
 
 namespace LUTTools {
 
+KmerLUT KmerLUT::fromLists(const std::vector<TranscriptList>& lists) {
+  auto numDistinct = [](const TranscriptList& l) -> size_t {
+    size_t n{0};
+    for (size_t j = 0; j < l.size(); ++j) { n += (j == 0 or l[j] != l[j - 1]) ? 1 : 0; }
+    return n;
+  };
+
+  std::vector<Offset> offsets(lists.size() + 1, 0);
+  for (size_t i = 0; i < lists.size(); ++i) {
+    offsets[i + 1] = offsets[i] + numDistinct(lists[i]);
+  }
+  std::vector<TranscriptID> transcripts(offsets.back());
+  std::vector<uint32_t> multiplicities(offsets.back(), 0);
+  tbb::parallel_for(size_t(0), lists.size(),
+    [&lists, &offsets, &transcripts, &multiplicities](size_t i) -> void {
+      size_t k = offsets[i];
+      for (size_t j = 0; j < lists[i].size(); ++j) {
+        if (j > 0 and lists[i][j] == lists[i][j - 1]) {
+          ++multiplicities[k - 1];
+        } else {
+          transcripts[k] = lists[i][j];
+          multiplicities[k++] = 1;
+        }
+      }
+    });
+  return KmerLUT(MappedArray<Offset>(std::move(offsets)),
+                 MappedArray<TranscriptID>(std::move(transcripts)),
+                 MappedArray<uint32_t>(std::move(multiplicities)));
+}
+
 /**
  *  \brief Dump the k-mer memberships vector to the file fname
  **/
@@ -53,21 +85,25 @@ void dumpKmerEquivClasses(
                           const std::vector<KmerID>& memberships,
                           const std::string& fname) {
 
-  std::ofstream ofile(fname, std::ios::binary);
-
-  // Write the length of the vector to the file
-  size_t vecLen{memberships.size()};
-  ofile.write(reinterpret_cast<const char*>(&vecLen), sizeof(vecLen));
-
-  // Write the actual vector to the file
-  ofile.write(reinterpret_cast<const char*>(&memberships.front()), sizeof(memberships.front()) * vecLen);
-
-  // Close the file
-  ofile.close();
+  MappedFileWriter out(fname, MappedFileKind::KMER_EQUIV_CLASSES, KmerEquivClassesVersion);
+  out.addSection(memberships.data(), memberships.size());
+  if (!out.close()) {
+    throw std::runtime_error("error writing " + fname);
+  }
 }
 
 
-std::vector<KmerID> readKmerEquivClasses(const std::string& fname) {
+MappedArray<KmerID> readKmerEquivClasses(const std::string& fname) {
+  auto file = MemoryMappedFile::openShared(fname);
+  auto header = file->header(MappedFileKind::KMER_EQUIV_CLASSES);
+  if (header != nullptr) {
+    if (header->version != KmerEquivClassesVersion) {
+      throw std::runtime_error(fname + " has unsupported version " + std::to_string(header->version));
+    }
+    return MappedArray<KmerID>(file, header->sections[0]);
+  }
+
+  // Legacy layout: the length of the vector, followed by its elements
   std::ifstream ifile(fname, std::ios::binary);
   size_t vecLen{0};
   ifile.read(reinterpret_cast<char*>(&vecLen), sizeof(vecLen));
@@ -76,7 +112,7 @@ std::vector<KmerID> readKmerEquivClasses(const std::string& fname) {
   ifile.read(reinterpret_cast<char*>(&memberships.front()), sizeof(memberships.front()) * vecLen);
 
   ifile.close();
-  return memberships;
+  return MappedArray<KmerID>(std::move(memberships));
 }
 
 void dumpKmerLUT(
@@ -88,33 +124,51 @@ void dumpKmerLUT(
         std::sort(t.begin(), t.end());
     });
 
-    std::ofstream ofile(fname, std::ios::binary);
-    // number of kmers
-    auto numk = transcriptsForKmerClass.size();
-    ofile.write(reinterpret_cast<const char *>(&numk), sizeof(numk));
-    for (auto i : boost::irange(size_t(0), numk)) {
-        // write the vector's size
-        auto s = transcriptsForKmerClass[i].size();
-        ofile.write(reinterpret_cast<const char *>(&s), sizeof(s));
-        // write the vector's contents
-        if ( s > 0 ) {
-            ofile.write(reinterpret_cast<const char *>(&transcriptsForKmerClass[i][0]), s * sizeof(transcriptsForKmerClass[i][0]));
-        }
+    dumpKmerLUT(KmerLUT::fromLists(transcriptsForKmerClass), fname);
+}
+
+void dumpKmerLUT(
+    const KmerLUT &lut,
+    const std::string &fname) {
+
+    MappedFileWriter out(fname, MappedFileKind::KMER_LUT, KmerLUTVersion);
+    out.addSection(lut.offsets().data(), lut.offsets().size());
+    out.addSection(lut.transcripts().data(), lut.transcripts().size());
+    out.addSection(lut.multiplicities().data(), lut.multiplicities().size());
+    if (!out.close()) {
+      throw std::runtime_error("error writing " + fname);
     }
-    // close the output file
-    ofile.close();
 }
 
 void readKmerLUT(
     const std::string &fname,
-    std::vector<TranscriptList> &transcriptsForKmer) {
+    KmerLUT &transcriptsForKmer) {
+
+    auto file = MemoryMappedFile::openShared(fname);
+    auto header = file->header(MappedFileKind::KMER_LUT);
+    if (header != nullptr) {
+      if (header->version != KmerLUTVersion) {
+        throw std::runtime_error(fname + " has unsupported version " + std::to_string(header->version));
+      }
+      transcriptsForKmer = KmerLUT(MappedArray<Offset>(file, header->sections[0]),
+                                   MappedArray<TranscriptID>(file, header->sections[1]),
+                                   MappedArray<uint32_t>(file, header->sections[2]));
+      auto numEntries = transcriptsForKmer.transcripts().size();
+      if (transcriptsForKmer.multiplicities().size() != numEntries or
+          (transcriptsForKmer.size() > 0 and
+           transcriptsForKmer.offsets()[transcriptsForKmer.size()] != numEntries)) {
+        throw std::runtime_error(fname + " is corrupt");
+      }
+      return;
+    }
 
+    // Legacy layout: the number of classes, followed by the length and
+    // contents of each list
     std::ifstream ifile(fname, std::ios::binary);
     // get the size of the vector from file
     size_t numk = 0;
     ifile.read(reinterpret_cast<char *>(&numk), sizeof(numk));
-    // resize the vector now
-    transcriptsForKmer.resize(numk);
+    std::vector<TranscriptList> lists(numk);
 
     for (auto i : boost::irange(size_t(0), numk)) {
         // read the vector's size
@@ -122,12 +176,34 @@ void readKmerLUT(
         ifile.read(reinterpret_cast<char *>(&numTran), sizeof(numTran));
         // read the vector's contents
         if ( numTran > 0 ) {
-            transcriptsForKmer[i].resize(numTran);
-            ifile.read(reinterpret_cast<char *>(&transcriptsForKmer[i][0]), numTran * sizeof(TranscriptID));
+            lists[i].resize(numTran);
+            ifile.read(reinterpret_cast<char *>(&lists[i][0]), numTran * sizeof(TranscriptID));
         }
     }
 
     ifile.close();
+    transcriptsForKmer = KmerLUT::fromLists(lists);
+}
+
+void dumpTranscriptFingerprints(
+    const std::vector<uint64_t> &fingerprints,
+    const std::string &fname) {
+
+    MappedFileWriter out(fname, MappedFileKind::TRANSCRIPT_FINGERPRINTS, TranscriptFingerprintsVersion);
+    out.addSection(fingerprints.data(), fingerprints.size());
+    if (!out.close()) {
+      throw std::runtime_error("error writing " + fname);
+    }
+}
+
+MappedArray<uint64_t> readTranscriptFingerprints(const std::string &fname) {
+    auto file = std::make_shared<MemoryMappedFile>(fname);
+    auto header = file->header(MappedFileKind::TRANSCRIPT_FINGERPRINTS);
+    if (header == nullptr or header->version != TranscriptFingerprintsVersion) {
+      throw std::runtime_error(fname + " is not a transcript fingerprint file of version " +
+                               std::to_string(TranscriptFingerprintsVersion));
+    }
+    return MappedArray<uint64_t>(file, header->sections[0]);
 }
 
 
@@ -0,0 +1,140 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "MappedSequenceParser.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "unistd.h"
+#include "fcntl.h"
+
+MappedReadParser::MappedReadParser(const boost::filesystem::path& file, size_t chunkSize) :
+    fileName_(file.string()), fd_(-1), data_(nullptr), size_(0),
+    chunkSize_(chunkSize), numChunks_(0), nextChunk_(0), fastq_(false) {
+
+    fd_ = open(fileName_.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("could not open " + fileName_ + " for reading");
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        close(fd_);
+        throw std::runtime_error("could not stat " + fileName_);
+    }
+    size_ = st.st_size;
+    if (size_ == 0) { return; }
+
+    void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error("could not memory-map " + fileName_);
+    }
+    data_ = static_cast<const char*>(addr);
+    madvise(addr, size_, MADV_SEQUENTIAL);
+
+    switch (data_[0]) {
+        case '>': fastq_ = false; break;
+        case '@': fastq_ = true; break;
+        default:
+            munmap(addr, size_);
+            close(fd_);
+            throw std::runtime_error(fileName_ + " does not appear to be a FASTA or FASTQ file");
+    }
+    numChunks_ = (size_ + chunkSize_ - 1) / chunkSize_;
+}
+
+bool MappedReadParser::isChunkable(const boost::filesystem::path& file) {
+    // The records of the first 64KiB of the file (or fewer, if it is
+    // shorter) are checked
+    std::ifstream in(file.string(), std::ios::binary);
+    std::vector<char> block(1 << 16);
+    in.read(block.data(), block.size());
+    block.resize(in.gcount());
+    if (block.empty() or block[0] != '@') { return true; }
+
+    std::vector<std::string> lines;
+    std::stringstream ss(std::string(block.begin(), block.end()));
+    std::string line;
+    while (std::getline(ss, line)) {
+        if (!line.empty() and line.back() == '\r') { line.pop_back(); }
+        lines.push_back(line);
+    }
+    // The last line may have been cut off by the end of the block
+    if (block.back() != '\n' and !lines.empty()) { lines.pop_back(); }
+
+    for (size_t i = 0; i + 3 < lines.size(); i += 4) {
+        if (lines[i].empty() or lines[i][0] != '@' or
+            lines[i + 2].empty() or lines[i + 2][0] != '+' or
+            lines[i + 1].size() != lines[i + 3].size()) { return false; }
+    }
+    return true;
+}
+
+MappedReadParser::~MappedReadParser() {
+    if (data_ != nullptr) { munmap(const_cast<char*>(data_), size_); }
+    if (fd_ >= 0) { close(fd_); }
+}
+
+bool MappedReadParser::nextChunk(const char*& begin, const char*& end) {
+    size_t chunk = nextChunk_++;
+    if (chunk >= numChunks_) { return false; }
+
+    // Both boundaries of the chunk are moved to the start of the following
+    // record; since the adjacent chunk computes its boundary the same way,
+    // every record belongs to exactly one chunk.
+    size_t b = recordStart_(chunk * chunkSize_);
+    size_t e = recordStart_(std::min(size_, (chunk + 1) * chunkSize_));
+    begin = data_ + b;
+    end = data_ + e;
+    return true;
+}
+
+size_t MappedReadParser::nextLine_(size_t offset) const {
+    auto nl = static_cast<const char*>(memchr(data_ + offset, '\n', size_ - offset));
+    return (nl == nullptr) ? size_ : (nl - data_) + 1;
+}
+
+bool MappedReadParser::isRecordStart_(size_t lineStart) const {
+    if (!fastq_) { return data_[lineStart] == '>'; }
+
+    // A quality string may also begin with '@'.  However, when a line
+    // beginning with '@' is a header, the line after next is the '+'
+    // separator, while if it is a quality string, the line after next
+    // holds a sequence (which can not begin with '+').
+    if (data_[lineStart] != '@') { return false; }
+    size_t l2 = nextLine_(nextLine_(lineStart));
+    return (l2 < size_ and data_[l2] == '+');
+}
+
+size_t MappedReadParser::recordStart_(size_t offset) const {
+    if (offset == 0 or offset >= size_) { return std::min(offset, size_); }
+    size_t line = (data_[offset - 1] == '\n') ? offset : nextLine_(offset);
+    while (line < size_ and !isRecordStart_(line)) { line = nextLine_(line); }
+    return line;
+}
@@ -0,0 +1,302 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "MemoryMappedFile.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "unistd.h"
+#include "fcntl.h"
+
+#include <boost/filesystem.hpp>
+
+namespace {
+  const char MappedFileMagic[8] = {'S', 'A', 'I', 'L', 'F', 'I', 'S', 'H'};
+  // The f_type of a hugetlbfs file system
+  constexpr long HugetlbfsMagic = 0x958458f6;
+
+  std::mutex sharedDirMutex;
+  std::string sharedDir;
+  // The files retained by openShared (if retainMappings is set), by path
+  bool retainMappings{false};
+  std::map<std::string, std::shared_ptr<MemoryMappedFile>> retainedFiles;
+
+  /**
+   * Copy src to the (new) file dest, through a shared mapping of dest, so
+   * that this also works on hugetlbfs (which does not support write()).
+   * The size of dest is rounded up to the block size of its file system.
+   */
+  bool copyToSegment(const MemoryMappedFile& src, const std::string& dest) {
+      int fd = open(dest.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (fd < 0) { return false; }
+
+      size_t size = src.size();
+      struct statfs fs;
+      if (fstatfs(fd, &fs) == 0 and fs.f_type == HugetlbfsMagic and fs.f_bsize > 0) {
+          size = ((size + fs.f_bsize - 1) / fs.f_bsize) * fs.f_bsize;
+      }
+
+      bool ok = (ftruncate(fd, size) == 0);
+      if (ok and size > 0) {
+          void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          ok = (addr != MAP_FAILED);
+          if (ok) {
+              std::memcpy(addr, src.data(), src.size());
+              munmap(addr, size);
+          }
+      }
+      close(fd);
+      if (!ok) { unlink(dest.c_str()); }
+      return ok;
+  }
+}
+
+void MemoryMappedFile::setSharedDirectory(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(sharedDirMutex);
+    sharedDir = dir;
+}
+
+void MemoryMappedFile::setRetainMappings(bool retain) {
+    std::lock_guard<std::mutex> lock(sharedDirMutex);
+    retainMappings = retain;
+    if (!retain) { retainedFiles.clear(); }
+}
+
+std::shared_ptr<MemoryMappedFile> MemoryMappedFile::openShared(const std::string& fname) {
+    std::string key;
+    bool retain{false};
+    {
+        std::lock_guard<std::mutex> lock(sharedDirMutex);
+        retain = retainMappings;
+        if (retain) {
+            key = boost::filesystem::absolute(fname).string();
+            auto it = retainedFiles.find(key);
+            if (it != retainedFiles.end()) { return it->second; }
+        }
+    }
+    // (mapShared_ takes the lock itself)
+    auto file = mapShared_(fname);
+    if (!retain) { return file; }
+    std::lock_guard<std::mutex> lock(sharedDirMutex);
+    // If another thread mapped the file meanwhile, its mapping is kept
+    return retainedFiles.emplace(key, file).first->second;
+}
+
+std::shared_ptr<MemoryMappedFile> MemoryMappedFile::mapShared_(const std::string& fname) {
+    namespace bfs = boost::filesystem;
+
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(sharedDirMutex);
+        dir = sharedDir;
+    }
+    auto file = std::make_shared<MemoryMappedFile>(fname);
+    // Legacy files are read onto the heap anyway, so there is no point in
+    // publishing them
+    if (dir.empty() or !file->hasMappedLayout()) { return file; }
+
+    // The segment is named for the file's location and its modification
+    // time and size; so re-building the index yields a new segment.  (The
+    // file may have been replaced, or removed, since it was mapped; if so,
+    // the mapping already made is used.)
+    boost::system::error_code ec;
+    bfs::path source = bfs::canonical(fname, ec);
+    std::time_t modified = ec ? 0 : bfs::last_write_time(source, ec);
+    if (ec) {
+        std::cerr << "could not publish " << fname << " [" << ec.message() << "]; using the file directly\n";
+        return file;
+    }
+    std::hash<std::string> hasher;
+    std::stringstream prefix, stamp;
+    prefix << "sailfish-" << std::hex << hasher(source.string()) << "-";
+    stamp << std::hex << hasher(std::to_string(modified) + ":" + std::to_string(file->size()));
+    std::string suffix = "-" + source.filename().string();
+    bfs::path segment = bfs::path(dir) / (prefix.str() + stamp.str() + suffix);
+
+    if (!bfs::exists(segment, ec)) {
+        // Publish under a temporary name, and rename it into place; if
+        // several processes race to publish, one of them wins and the
+        // others' copies are simply replaced.
+        bfs::path tmp = segment; tmp += ".tmp." + std::to_string(getpid());
+        if (!copyToSegment(*file, tmp.string())) {
+            std::cerr << "could not publish " << fname << " to " << dir << " ["
+                      << std::strerror(errno) << "]; using the file directly\n";
+            return file;
+        }
+        bfs::rename(tmp, segment, ec);
+        if (ec) {
+            std::cerr << "could not publish " << fname << " as " << segment << " ["
+                      << ec.message() << "]; using the file directly\n";
+            bfs::remove(tmp, ec);
+            return file;
+        }
+        std::cerr << "published " << fname << " as " << segment << "\n";
+
+        // Remove the segments of earlier versions of this file
+        for (bfs::directory_iterator it(dir, ec), end; !ec and it != end; it.increment(ec)) {
+            auto name = it->path().filename().string();
+            if (it->path() != segment and name.compare(0, prefix.str().size(), prefix.str()) == 0 and
+                name.size() > suffix.size() and
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                bfs::remove(it->path(), ec);
+            }
+        }
+    }
+
+    try {
+        return std::make_shared<MemoryMappedFile>(segment.string());
+    } catch (std::exception& e) {
+        std::cerr << "could not attach " << segment << " [" << e.what() << "]; using "
+                  << fname << " directly\n";
+        return file;
+    }
+}
+
+MemoryMappedFile::MemoryMappedFile(const std::string& fname, bool copyOnWrite) :
+    fileName_(fname), data_(nullptr), size_(0) {
+
+    int fd = open(fileName_.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("could not open " + fileName_ + " for reading");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("could not stat " + fileName_);
+    }
+    size_ = st.st_size;
+    if (size_ == 0) { close(fd); return; }
+
+    // A read-only mapping is shared; a private one would (on hugetlbfs)
+    // reserve huge pages for copies that will never be made
+    int prot = (copyOnWrite) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    int flags = (copyOnWrite) ? MAP_PRIVATE : MAP_SHARED;
+    void* addr = mmap(nullptr, size_, prot, flags, fd, 0);
+    // The mapping remains valid once the descriptor is closed
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("could not memory-map " + fileName_);
+    }
+    data_ = static_cast<char*>(addr);
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (data_ != nullptr) { munmap(data_, size_); }
+}
+
+bool MemoryMappedFile::hasMappedLayout() const {
+    return size_ >= sizeof(MappedFileHeader) and
+           std::memcmp(data_, MappedFileMagic, sizeof(MappedFileMagic)) == 0;
+}
+
+const MappedFileHeader* MemoryMappedFile::header(MappedFileKind kind) const {
+    if (!hasMappedLayout()) { return nullptr; }
+    auto h = reinterpret_cast<const MappedFileHeader*>(data_);
+    return (h->kind == kind) ? h : nullptr;
+}
+
+void MemoryMappedFile::checkSection_(const MappedSection& s, size_t elemSize, size_t align) const {
+    if (s.offset % align != 0 or s.offset > size_ or s.count > (size_ - s.offset) / elemSize) {
+        throw std::runtime_error(fileName_ + " is truncated or corrupt");
+    }
+}
+
+void MemoryMappedFile::willNeed() {
+    if (data_ != nullptr) { madvise(data_, size_, MADV_WILLNEED); }
+}
+
+MappedFileWriter::MappedFileWriter(const std::string& fname, MappedFileKind kind, uint32_t version) :
+    fname_(fname), partName_(fname + ".part"),
+    out_(partName_, std::ios::out | std::ios::binary), offset_(0), closed_(false) {
+    if (!out_.good()) {
+        throw std::runtime_error("could not open " + partName_ + " for writing");
+    }
+    std::memset(&header_, 0, sizeof(header_));
+    std::memcpy(header_.magic, MappedFileMagic, sizeof(MappedFileMagic));
+    header_.kind = kind;
+    header_.version = version;
+
+    // Reserve the header page; the header itself is written on close()
+    out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    offset_ = sizeof(header_);
+}
+
+MappedFileWriter::~MappedFileWriter() {
+    // A writer that was never closed (e.g. because of an exception) is
+    // abandoned, rather than installed half-written
+    if (!closed_) {
+        out_.close();
+        std::remove(partName_.c_str());
+    }
+}
+
+void MappedFileWriter::pad_() {
+    static const char zeros[MappedFileAlignment] = {0};
+    size_t rem = offset_ % MappedFileAlignment;
+    if (rem != 0) {
+        out_.write(zeros, MappedFileAlignment - rem);
+        offset_ += MappedFileAlignment - rem;
+    }
+}
+
+void MappedFileWriter::addSection_(const char* data, size_t numBytes, size_t count) {
+    if (header_.numSections >= MappedFileHeader::MaxSections) {
+        throw std::logic_error("too many sections in a mapped file");
+    }
+    pad_();
+    header_.sections[header_.numSections++] = MappedSection{offset_, count};
+    if (numBytes > 0) { out_.write(data, numBytes); }
+    offset_ += numBytes;
+}
+
+bool MappedFileWriter::close() {
+    closed_ = true;
+    // Pad the last section, so that it may be mapped in whole pages
+    pad_();
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    out_.flush();
+    bool ok = out_.good();
+    out_.close();
+    ok = ok and !out_.fail();
+
+    boost::system::error_code ec;
+    if (ok) { boost::filesystem::rename(partName_, fname_, ec); }
+    if (!ok or ec) {
+        std::remove(partName_.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,142 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "NUMAPolicy.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "unistd.h"
+
+#include <boost/filesystem.hpp>
+
+namespace {
+  // From <linux/mempolicy.h>, which not every distribution installs
+  constexpr int MpolInterleave = 3;
+  constexpr unsigned MpolMfMove = (1 << 1);
+
+  // Parse a cpulist such as "0-7,16-23"
+  std::vector<int> parseCPUList(const std::string& list) {
+      std::vector<int> cpus;
+      std::stringstream ss(list);
+      std::string range;
+      while (std::getline(ss, range, ',')) {
+          if (range.empty()) { continue; }
+          auto dash = range.find('-');
+          int first = std::stoi(range.substr(0, dash));
+          int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+          for (int c = first; c <= last; ++c) { cpus.push_back(c); }
+      }
+      return cpus;
+  }
+
+  std::vector<NUMAPolicy::Node> readNodes() {
+      namespace bfs = boost::filesystem;
+      std::vector<NUMAPolicy::Node> nodes;
+      boost::system::error_code ec;
+      bfs::path root("/sys/devices/system/node");
+      for (bfs::directory_iterator it(root, ec), end; !ec and it != end; it.increment(ec)) {
+          auto name = it->path().filename().string();
+          if (name.compare(0, 4, "node") != 0 or name.size() == 4 or
+              !std::all_of(name.begin() + 4, name.end(), ::isdigit)) { continue; }
+
+          std::ifstream in((it->path() / "cpulist").string());
+          std::string list;
+          if (!std::getline(in, list)) { continue; }
+          try {
+              auto cpus = parseCPUList(list);
+              // Memory-only nodes get no threads
+              if (!cpus.empty()) { nodes.push_back({std::stoi(name.substr(4)), cpus}); }
+          } catch (std::exception&) {
+              continue;
+          }
+      }
+      std::sort(nodes.begin(), nodes.end(),
+                [](const NUMAPolicy::Node& a, const NUMAPolicy::Node& b) { return a.id < b.id; });
+      return nodes;
+  }
+
+  // The pages wholly within [addr, addr+len), or false if there are none
+  bool wholePages(void* addr, size_t len, char*& begin, size_t& numBytes) {
+      uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+      uintptr_t first = (reinterpret_cast<uintptr_t>(addr) + pageSize - 1) & ~(pageSize - 1);
+      uintptr_t last = (reinterpret_cast<uintptr_t>(addr) + len) & ~(pageSize - 1);
+      if (addr == nullptr or last <= first) { return false; }
+      begin = reinterpret_cast<char*>(first);
+      numBytes = last - first;
+      return true;
+  }
+}
+
+const std::vector<NUMAPolicy::Node>& NUMAPolicy::nodes() {
+    static const std::vector<Node> nodes = readNodes();
+    return nodes;
+}
+
+bool NUMAPolicy::pinThread(size_t i) {
+    if (!available()) { return false; }
+    auto& node = nodes()[i % numNodes()];
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : node.cpus) { if (c < CPU_SETSIZE) { CPU_SET(c, &mask); } }
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
+
+bool NUMAPolicy::interleave(void* addr, size_t len) {
+    char* begin{nullptr};
+    size_t numBytes{0};
+    if (!available() or !wholePages(addr, len, begin, numBytes)) { return false; }
+
+    int maxNode = nodes().back().id;
+    std::vector<unsigned long> mask(maxNode / (8 * sizeof(unsigned long)) + 1, 0);
+    for (auto& node : nodes()) {
+        mask[node.id / (8 * sizeof(unsigned long))] |= 1UL << (node.id % (8 * sizeof(unsigned long)));
+    }
+    // The kernel ignores the last bit of maxnode
+    return syscall(SYS_mbind, begin, numBytes, MpolInterleave, mask.data(),
+                   static_cast<unsigned long>(maxNode + 2), MpolMfMove) == 0;
+}
+
+bool NUMAPolicy::resetFirstTouch(void* addr, size_t len) {
+    char* begin{nullptr};
+    size_t numBytes{0};
+    if (!available() or !wholePages(addr, len, begin, numBytes)) { return false; }
+    // Private anonymous pages read back as zeros once released
+    return madvise(begin, numBytes, MADV_DONTNEED) == 0;
+}
+
+NUMAThreadPinner::NUMAThreadPinner() : nextThread_(0) {
+    if (NUMAPolicy::available()) { observe(true); }
+}
+
+NUMAThreadPinner::~NUMAThreadPinner() { observe(false); }
+
+void NUMAThreadPinner::on_scheduler_entry(bool isWorker) {
+    if (isWorker) { NUMAPolicy::pinThread(nextThread_++); }
+}
@@ -0,0 +1,115 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "OptimizerTelemetry.hpp"
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+namespace {
+  // JSON has no representation of infinity or NaN
+  void writeJSONNumber(std::ostream& out, double x) {
+      if (std::isfinite(x)) { out << x; } else { out << "null"; }
+  }
+}
+
+OptimizerTelemetry::OptimizerTelemetry() :
+    iteration_(0), numIterations_(0), phaseSeconds_(0.0), start_(Clock::now()) {}
+
+bool OptimizerTelemetry::open(const std::string& fname) {
+    out_.open(fname);
+    if (!out_.good()) {
+        std::cerr << "could not open " << fname << " for writing; optimizer records will not be kept\n";
+        return false;
+    }
+    out_ << std::setprecision(10);
+    return true;
+}
+
+void OptimizerTelemetry::beginIteration(const std::string& phase, size_t i) {
+    if (phase != phase_) { numIterations_ = 0; phaseSeconds_ = 0.0; }
+    phase_ = phase;
+    iteration_ = i;
+    fields_.clear();
+    start_ = Clock::now();
+}
+
+void OptimizerTelemetry::set(const std::string& field, double value) {
+    for (auto& f : fields_) {
+        if (f.first == field) { f.second = value; return; }
+    }
+    fields_.emplace_back(field, value);
+}
+
+void OptimizerTelemetry::add(const std::string& field, double value) {
+    for (auto& f : fields_) {
+        if (f.first == field) { f.second += value; return; }
+    }
+    fields_.emplace_back(field, value);
+}
+
+void OptimizerTelemetry::endIteration() {
+    double seconds = since(start_);
+    ++numIterations_;
+    phaseSeconds_ += seconds;
+    write_(phase_, iteration_, seconds);
+
+    // Overwrite the status line
+    std::cerr << "\r" << phase_ << " iteration " << iteration_ << " ["
+              << std::fixed << std::setprecision(2) << seconds << " s]";
+    std::cerr.unsetf(std::ios::floatfield);
+    std::cerr << std::setprecision(6);
+    for (auto& f : fields_) { std::cerr << " " << f.first << " = " << f.second; }
+    std::cerr << "        " << std::flush;
+    fields_.clear();
+}
+
+void OptimizerTelemetry::endPhase(const std::string& phase) {
+    if (phase_ == phase and numIterations_ > 0) {
+        std::cerr << "\n";
+        fields_.clear();
+        fields_.emplace_back("iterations", numIterations_);
+        write_(phase, -1, phaseSeconds_);
+    }
+    phase_.clear();
+    fields_.clear();
+}
+
+void OptimizerTelemetry::phase(const std::string& phase, double seconds) {
+    write_(phase, -1, seconds);
+    fields_.clear();
+}
+
+void OptimizerTelemetry::write_(const std::string& phase, long iteration, double seconds) {
+    if (!out_.is_open()) { return; }
+    out_ << "{\"phase\": \"" << phase << "\"";
+    if (iteration >= 0) { out_ << ", \"iteration\": " << iteration; }
+    out_ << ", \"seconds\": ";
+    writeJSONNumber(out_, seconds);
+    for (auto& f : fields_) {
+        out_ << ", \"" << f.first << "\": ";
+        writeJSONNumber(out_, f.second);
+    }
+    out_ << "}\n";
+    out_.flush();
+}
@@ -31,6 +31,7 @@
 #include <atomic>
 #include <chrono>
 #include <thread>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <cassert>
@@ -51,6 +52,8 @@
 #include "tbb/parallel_for_each.h"
 #include "tbb/parallel_for.h"
 #include "tbb/task_scheduler_init.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
 
 #include "jellyfish/parse_dna.hpp"
 #include "jellyfish/mapped_file.hpp"
@@ -68,10 +71,12 @@
 
 #include "cmph.h"
 #include "CountDBNew.hpp"
-// #include "LookUpTableUtils.hpp"
+#include "LookUpTableUtils.hpp"
 #include "SailfishUtils.hpp"
 #include "GenomicFeature.hpp"
 #include "PerfectHashIndex.hpp"
+#include "KmerEncoder.hpp"
+#include "TranscriptStore.hpp"
 
 void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vector<uint32_t>& counts,
                            size_t merLen, const boost::filesystem::path& indexBasePath) {
@@ -81,38 +86,21 @@ void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vec
 
     std::vector<uint64_t> orderedMers(nkeys, 0);
 
-    // Source of keys -- oh C, how I love thee
-    cmph_io_adapter_t *source = cmph_io_struct_vector_adapter(static_cast<void *>(&keys[0]),
-                                                              static_cast<cmph_uint32>(sizeof(uint64_t)),
-                                                              0, sizeof(uint64_t), nkeys);
-
-    std::cerr << "Building a perfect hash from the Jellyfish hash.\n";
-    cmph_t *hash = nullptr;
-    size_t i = 0;
+    std::cerr << "Building a perfect hash of the " << nkeys << " distinct transcript k-mers.\n";
+    KmerMPHF mphf;
     {
       boost::timer::auto_cpu_timer t;
-      //Create minimal perfect hash function using the brz algorithm.
-      cmph_config_t *config = cmph_config_new(source);
-      cmph_config_set_algo(config, CMPH_BDZ);
-      cmph_config_set_memory_availability(config, 1000);
-      cmph_config_set_b(config, 3);
-      cmph_config_set_keys_per_bin(config, 1);
-
-      hash = cmph_new(config);
+      mphf.build(keys);
     }
-
-    assert(hash != nullptr);
-    std::unique_ptr<cmph_t, std::function<void(cmph_t*)>> ownedHash(hash, cmph_destroy);
+    std::cerr << "perfect hash uses " << (8.0 * mphf.sizeInBytes()) / nkeys << " bits / key\n";
 
     std::cerr << "saving keys in perfect hash . . .";
     auto start = std::chrono::steady_clock::now();
     {
       boost::timer::auto_cpu_timer t;
       tbb::parallel_for_each( keys.begin(), keys.end(),
-        [&ownedHash, &orderedMers]( uint64_t k ) -> void {
-          char *key = (char*)(&k);
-          unsigned int id = cmph_search(ownedHash.get(), key, sizeof(uint64_t));
-          orderedMers[id] = k;
+        [&mphf, &orderedMers]( uint64_t k ) -> void {
+          orderedMers[mphf.lookup(k)] = k;
         });
 
     }
@@ -122,11 +110,19 @@ void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vec
     auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
     std::cerr << "took: " << static_cast<double>(ms.count()) / keys.size() << " us / key\n";
 
-    PerfectHashIndex phi(orderedMers, ownedHash, merLen, canonical);
+    PerfectHashIndex phi(orderedMers, std::move(mphf), merLen, canonical);
 
     bfs::path transcriptomeIndexPath(indexBasePath); transcriptomeIndexPath /= "transcriptome.sfi";
     std::cerr << "writing index to file " << transcriptomeIndexPath << "\n";
-    auto dthread1 = std::thread( [&phi, transcriptomeIndexPath]() -> void { phi.dumpToFile(transcriptomeIndexPath.string()); } );
+    // (an exception can't leave the thread, so it is passed on after the join)
+    std::exception_ptr indexError;
+    auto dthread1 = std::thread( [&phi, &indexError, transcriptomeIndexPath]() -> void {
+                                  try {
+                                    phi.dumpToFile(transcriptomeIndexPath.string());
+                                  } catch (...) {
+                                    indexError = std::current_exception();
+                                  }
+                                });
 
     auto del = []( PerfectHashIndex* h ) -> void { /*do nothing*/; };
     auto phiPtr = std::shared_ptr<PerfectHashIndex>(&phi, del);
@@ -141,16 +137,115 @@ void buildPerfectHashIndex(bool canonical, std::vector<uint64_t>& keys, std::vec
     bfs::path transcriptomeCountPath(indexBasePath); transcriptomeCountPath /= "transcriptome.sfc";
 
     std::cerr << "writing transcript counts to file " << transcriptomeCountPath << "\n";
-    auto dthread2 = std::thread( [&thash, transcriptomeCountPath]() -> void {
-                                  thash.dumpCountsToFile(transcriptomeCountPath.string());
+    bool wroteCounts{false};
+    auto dthread2 = std::thread( [&thash, &wroteCounts, transcriptomeCountPath]() -> void {
+                                  try {
+                                    wroteCounts = thash.dumpCountsToFile(transcriptomeCountPath.string());
+                                  } catch (std::exception& e) {
+                                    std::cerr << e.what() << "\n";
+                                  }
                                 });
 
     dthread1.join();
-    std::cerr << "done writing index\n";
     dthread2.join();
+    if (indexError) { std::rethrow_exception(indexError); }
+    std::cerr << "done writing index\n";
+    if (!wroteCounts) {
+        throw std::runtime_error("error writing " + transcriptomeCountPath.string());
+    }
     std::cerr << "done writing transcript counts\n";
 }
 
+/**
+ * Enumerate the distinct k-mers of the transcripts, and the number of times
+ * each occurs, in-process (as Jellyfish would count them).  Each thread
+ * encodes the transcripts it is given, and appends their k-mers to one of
+ * NumKmerBuckets buckets of its own, chosen by a hash of the k-mer; each
+ * bucket is then sorted and run-length encoded independently of the others.
+ * Most k-mers of a transcriptome occur only once, so there would be little
+ * to gain by de-duplicating them as they are encoded.
+ */
+void enumerateTranscriptKmers(bool canonical,
+                              uint32_t merLen,
+                              const TranscriptStore& transcripts,
+                              std::vector<uint64_t>& keys,
+                              std::vector<uint32_t>& counts) {
+    using Kmer = uint64_t;
+    constexpr size_t NumKmerBuckets = 1024;
+    constexpr size_t BucketShift = 54; // 2^(64 - 54) = NumKmerBuckets
+
+    // The bucket of a k-mer is given by the high bits of its (splitmix64) hash
+    auto bucketOf = [](Kmer k) -> size_t {
+        k += 0x9e3779b97f4a7c15ULL;
+        k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+        return (k ^ (k >> 31)) >> BucketShift;
+    };
+
+    boost::timer::auto_cpu_timer t(std::cerr);
+    struct Worker {
+        explicit Worker(uint32_t merLen) : encoder(merLen), buckets(NumKmerBuckets) {}
+        KmerEncoder encoder;
+        std::vector<uint8_t> codes;
+        std::vector<std::vector<Kmer>> buckets;
+    };
+    tbb::enumerable_thread_specific<Worker> workers(Worker{merLen});
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, transcripts.size()),
+        [&transcripts, &workers, &bucketOf, canonical](const tbb::blocked_range<size_t>& range) -> void {
+            auto& w = workers.local();
+            for (auto tid = range.begin(); tid != range.end(); ++tid) {
+                // Windows containing Ns (or other non-nucleotides) yield no k-mer
+                transcripts.codes(tid, w.codes);
+                size_t numKmers = w.encoder.encodeCodes(w.codes.data(), w.codes.size());
+                const Kmer* fwdMers = w.encoder.fwdMers();
+                const Kmer* revMers = w.encoder.revMers();
+                for (size_t i = 0; i < numKmers; ++i) {
+                    Kmer k = (canonical) ? std::min(fwdMers[i], revMers[i]) : fwdMers[i];
+                    w.buckets[bucketOf(k)].push_back(k);
+                }
+            }
+        });
+
+    // Sort and collapse each bucket (releasing the workers' copies as it goes)
+    std::vector<std::vector<Kmer>> bucketKeys(NumKmerBuckets);
+    std::vector<std::vector<uint32_t>> bucketCounts(NumKmerBuckets);
+    tbb::parallel_for(size_t{0}, NumKmerBuckets, [&](size_t b) -> void {
+        size_t total{0};
+        for (auto& w : workers) { total += w.buckets[b].size(); }
+        std::vector<Kmer> all;
+        all.reserve(total);
+        for (auto& w : workers) {
+            all.insert(all.end(), w.buckets[b].begin(), w.buckets[b].end());
+            std::vector<Kmer>().swap(w.buckets[b]);
+        }
+        std::sort(all.begin(), all.end());
+
+        auto& bk = bucketKeys[b];
+        auto& bc = bucketCounts[b];
+        for (size_t i = 0; i < all.size(); ) {
+            size_t j = i + 1;
+            while (j < all.size() and all[j] == all[i]) { ++j; }
+            bk.push_back(all[i]);
+            bc.push_back(static_cast<uint32_t>(j - i));
+            i = j;
+        }
+    });
+
+    std::vector<size_t> offsets(NumKmerBuckets + 1, 0);
+    for (size_t b = 0; b < NumKmerBuckets; ++b) { offsets[b + 1] = offsets[b] + bucketKeys[b].size(); }
+    keys.resize(offsets[NumKmerBuckets]);
+    counts.resize(offsets[NumKmerBuckets]);
+    tbb::parallel_for(size_t{0}, NumKmerBuckets, [&](size_t b) -> void {
+        std::copy(bucketKeys[b].begin(), bucketKeys[b].end(), keys.begin() + offsets[b]);
+        std::copy(bucketCounts[b].begin(), bucketCounts[b].end(), counts.begin() + offsets[b]);
+        std::vector<Kmer>().swap(bucketKeys[b]);
+        std::vector<uint32_t>().swap(bucketCounts[b]);
+    });
+
+    std::cerr << "enumerated " << keys.size() << " distinct k-mers in " << transcripts.size() << " transcripts\n";
+}
+
 //int count_main(int argc, char* argv[]);
 int jellyfish_count_main(int argc, char *argv[]);
 
@@ -226,28 +321,40 @@ int runJellyfish(bool canonical,
     */
 }
 
-void buildLUTs(
-  const std::vector<std::string>& transcriptFiles, //!< File from which transcripts are read
+int buildLUTs(
+  const TranscriptStore& transcripts,              //!< The transcripts
   PerfectHashIndex& transcriptIndex,               //!< Index of transcript kmers
   CountDBNew& transcriptHash,                      //!< Count of kmers in transcripts
   TranscriptGeneMap& tgmap,                        //!< Transcript => Gene map
   const std::string& tlutfname,                    //!< Transcript lookup table filename
   const std::string& klutfname,                    //!< Kmer lookup table filename
-  uint32_t numThreads                              //!< Number of threads to use in parallel
+  uint32_t numThreads,                             //!< Number of threads to use in parallel
+  size_t lutMemory                                 //!< Bytes of the k-mer table to hold in memory
   );
 
 int computeBiasFeatures(
-    std::vector<std::string>& transcriptFiles,
+    const TranscriptStore& transcripts,
     boost::filesystem::path outFilePath,
-    bool useStreamingParser,
     size_t numThreads);
 
+std::vector<uint64_t> transcriptFingerprints(
+    const TranscriptStore& transcripts,
+    TranscriptGeneMap& tgmap);
+
+int updateIndex(
+    const TranscriptStore& transcripts,
+    TranscriptGeneMap& tgmap,
+    const boost::filesystem::path& indexPath,
+    uint32_t merLen);
+
+bool indexUpdateInterrupted(const boost::filesystem::path& indexPath);
+void clearIndexUpdateMarker(const boost::filesystem::path& indexPath);
+
 int mainIndex( int argc, char *argv[] ) {
     using std::string;
     namespace po = boost::program_options;
 
     uint32_t maxThreads = std::thread::hardware_concurrency();
-    bool useStreamingParser = true;
 
     po::options_description generic("Command Line Options");
     generic.add_options()
@@ -268,7 +375,13 @@ int mainIndex( int argc, char *argv[] ) {
     //("thash,t", po::value<string>(), "transcript hash file [Jellyfish format]")
     //("index,i", po::value<string>(), "transcript index file [Sailfish format]")
     ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use concurrently.")
+    ("lut_memory", po::value<uint32_t>()->default_value(4096), "The memory (in MB) the k-mer lookup table may use "
+                                                               "while it is built; beyond this, it spills to disk")
     ("force,f", po::bool_switch(), "" )
+    ("update,u", po::bool_switch(), "Update the existing index [out] to the given transcripts, recomputing "
+                                    "only what the added, removed or changed transcripts affect")
+    ("jellyfish", po::bool_switch(), "Count the transcript k-mers in a separate Jellyfish process (writing "
+                                     "jf.counts_0), rather than enumerating them in-process")
     ;
 
     po::variables_map vm;
@@ -294,7 +407,14 @@ the Jellyfish database [thash] of the transcripts.
         string outputStem = vm["out"].as<string>();
         std::vector<string> transcriptFiles = vm["transcripts"].as<std::vector<string>>();
         uint32_t numThreads = vm["threads"].as<uint32_t>();
+        size_t lutMemory = size_t(vm["lut_memory"].as<uint32_t>()) << 20;
         bool force = vm["force"].as<bool>();
+        bool useJellyfish = vm["jellyfish"].as<bool>();
+        bool update = vm["update"].as<bool>();
+        if (update and force) {
+            std::cerr << "--update and --force may not be used together\n";
+            std::exit(1);
+        }
         // temporarily deprecated
         // bool canonical = vm["canonical"].as<bool>();
         bool canonical = false;
@@ -335,72 +455,114 @@ the Jellyfish database [thash] of the transcripts.
         g2::initializeLogging(&logger);
         #endif
 
+        tbb::task_scheduler_init init(numThreads);
+
+        // The transcripts are parsed only once; every later stage reads them
+        // from the (packed) store
+        std::cerr << "Reading the transcripts\n";
+        TranscriptStore transcripts(transcriptFiles);
+
         // First, compute the transcript features in case the user
         // ever wants to bias-correct his / her results
         bfs::path transcriptBiasFile(outputPath); transcriptBiasFile /= "bias_feats.txt";
-        computeBiasFeatures(transcriptFiles, transcriptBiasFile, useStreamingParser, numThreads);
+        computeBiasFeatures(transcripts, transcriptBiasFile, numThreads);
 
         bfs::path jfHashFile(outputPath); jfHashFile /= "jf.counts_0";
+        // The k-mer look-up table is the last file of the index to be written
+        bfs::path klutFile(outputPath); klutFile /= "transcriptome.klut";
 
-        mustRecompute = (force or !boost::filesystem::exists(jfHashFile));
+        auto buildTranscriptGeneMap = [&vm, &transcripts]() -> TranscriptGeneMap {
+            TranscriptGeneMap tgmap;
+            if (vm.count("tgmap") ) { // if we have a GTF file
+                string transcriptGeneMap = vm["tgmap"].as<string>();
+                std::cerr << "building transcript to gene map using gtf file [" <<
+                             transcriptGeneMap << "] . . .\n";
+                auto features = GTFParser::readGTFFile<TranscriptGeneID>(transcriptGeneMap);
+                tgmap = sailfish::utils::transcriptToGeneMapFromFeatures( features );
+                std::cerr << "done\n";
+            } else {
+                std::cerr << "building transcript to gene map using the transcript names . . .\n";
+                tgmap = sailfish::utils::transcriptToGeneMapFromNames(transcripts.names());
+                std::cerr << "there are " << tgmap.numTranscripts() << " transcripts . . . ";
+                std::cerr << "done\n";
+            }
+            return tgmap;
+        };
+
+        if (update) {
+            if (!bfs::exists(klutFile)) {
+                std::cerr << "There is no index in [" << outputStem << "] to update; build it first.\n";
+                std::exit(1);
+            }
+            // Reported here, rather than as an improper invocation below
+            try {
+                auto tgmap = buildTranscriptGeneMap();
+                if (updateIndex(transcripts, tgmap, outputPath, merLen) != 0) {
+                    throw std::runtime_error("the update did not complete");
+                }
+            } catch (std::exception& e) {
+                std::cerr << "ERROR: could not update the index in [" << outputStem << "]: " << e.what() << "\n";
+                std::exit(1);
+            }
+            return 0;
+        }
 
-        if (!mustRecompute) {
+        bool interrupted = indexUpdateInterrupted(outputPath);
+        if (interrupted and !force) {
+            std::cerr << "The index in [" << outputStem << "] was left inconsistent by an interrupted "
+                         "update; rebuilding it.\n";
+        }
+        mustRecompute = (force or interrupted or !boost::filesystem::exists(useJellyfish ? jfHashFile : klutFile));
+
+        if (!mustRecompute and useJellyfish) {
             // Check that the jellyfish has at the given location
             // was computed with the correct kmer length.
             std::cout << "Checking that jellyfish hash is up to date" << std::endl;
         }
 
         if (mustRecompute) {
-            std::cerr << "Running Jellyfish on transcripts\n";
-            runJellyfish(canonical, merLen, numThreads, outputStem, transcriptFiles);
-
-            std::cerr << "Jellyfish finished\n";
-
-            bfs::path thashFile = jfHashFile;//vm["thash"].as<string>();
-            bool recomputePerfectIndex = mustRecompute;
-
-            // Read in the Jellyfish hash of the transcripts
-            mapped_file transcriptDB(thashFile.c_str());
-            transcriptDB.random().will_need();
-            char typeTrans[8];
-            memcpy(typeTrans, transcriptDB.base(), sizeof(typeTrans));
-
-            hash_query_t transcriptHash(thashFile.c_str());
-            std::cerr << "transcriptHash size is " << transcriptHash.get_distinct() << "\n";
-            size_t nkeys = transcriptHash.get_distinct();
-            size_t merLen = transcriptHash.get_mer_len();
-
-            std::vector<uint64_t> keys(nkeys,0);
-            std::vector<uint32_t> counts(nkeys,0);
-
-            tbb::task_scheduler_init init(numThreads);
-            auto it = transcriptHash.iterator_all();
-            size_t i = 0;
-            while ( it.next() ) {
-                keys[i] = it.get_key();
-                counts[i] = it.get_val();
-                ++i;
+            std::vector<uint64_t> keys;
+            std::vector<uint32_t> counts;
+
+            if (useJellyfish) {
+                std::cerr << "Running Jellyfish on transcripts\n";
+                runJellyfish(canonical, merLen, numThreads, outputStem, transcriptFiles);
+
+                std::cerr << "Jellyfish finished\n";
+
+                bfs::path thashFile = jfHashFile;//vm["thash"].as<string>();
+
+                // Read in the Jellyfish hash of the transcripts
+                mapped_file transcriptDB(thashFile.c_str());
+                transcriptDB.random().will_need();
+                char typeTrans[8];
+                memcpy(typeTrans, transcriptDB.base(), sizeof(typeTrans));
+
+                hash_query_t transcriptHash(thashFile.c_str());
+                std::cerr << "transcriptHash size is " << transcriptHash.get_distinct() << "\n";
+                size_t nkeys = transcriptHash.get_distinct();
+                merLen = transcriptHash.get_mer_len();
+
+                keys.resize(nkeys, 0);
+                counts.resize(nkeys, 0);
+
+                auto it = transcriptHash.iterator_all();
+                size_t i = 0;
+                while ( it.next() ) {
+                    keys[i] = it.get_key();
+                    counts[i] = it.get_val();
+                    ++i;
+                }
+            } else {
+                std::cerr << "Enumerating the k-mers of the transcripts\n";
+                enumerateTranscriptKmers(canonical, merLen, transcripts, keys, counts);
             }
 
             bfs::path sfIndexBase(outputPath);
             bfs::path sfIndexFile(sfIndexBase); sfIndexFile /= "transcriptome.sfi";
             buildPerfectHashIndex(canonical, keys, counts, merLen, sfIndexBase);
 
-            TranscriptGeneMap tgmap;
-            if (vm.count("tgmap") ) { // if we have a GTF file
-                string transcriptGeneMap = vm["tgmap"].as<string>();
-                std::cerr << "building transcript to gene map using gtf file [" <<
-                             transcriptGeneMap << "] . . .\n";
-                auto features = GTFParser::readGTFFile<TranscriptGeneID>(transcriptGeneMap);
-                tgmap = sailfish::utils::transcriptToGeneMapFromFeatures( features );
-                std::cerr << "done\n";
-            } else {
-                std::cerr << "building transcript to gene map using transcript fasta file [" <<
-                             transcriptFiles[0] << "] . . .\n";
-                tgmap = sailfish::utils::transcriptToGeneMapFromFasta(transcriptFiles[0]);
-                std::cerr << "there are " << tgmap.numTranscripts() << " transcripts . . . ";
-                std::cerr << "done\n";
-            }
+            TranscriptGeneMap tgmap = buildTranscriptGeneMap();
 
 
             { // save transcript <-> gene map to archive
@@ -412,6 +574,11 @@ the Jellyfish database [thash] of the transcripts.
                 oa << tgmap;
             } // archive and stream closed when destructors are called
 
+            // The fingerprints of the transcripts' sequences, against which
+            // a later index --update compares the transcripts
+            bfs::path tfpPath(outputPath); tfpPath /= "transcriptome.tfp";
+            LUTTools::dumpTranscriptFingerprints(transcriptFingerprints(transcripts, tgmap), tfpPath.string());
+
             bfs::path sfIndexPath(outputPath); sfIndexPath /= "transcriptome.sfi";
             std::cerr << "Reading transcript index from [" << sfIndexPath << "] . . .";
             auto sfIndex = PerfectHashIndex::fromFile( sfIndexPath.string() );
@@ -427,8 +594,10 @@ the Jellyfish database [thash] of the transcripts.
             bfs::path tlutPath(outputPath); tlutPath /= "transcriptome.tlut";
             bfs::path klutPath(outputPath); klutPath /= "transcriptome.klut";
 
-            buildLUTs(transcriptFiles, sfIndex, sfTranscriptCountIndex,
-                      tgmap, tlutPath.string(), klutPath.string(), numThreads);
+            buildLUTs(transcripts, sfIndex, sfTranscriptCountIndex,
+                      tgmap, tlutPath.string(), klutPath.string(), numThreads, lutMemory);
+            // Every file of the index is now from this build
+            clearIndexUpdateMarker(outputPath);
 
         } else {
             std::cerr << "All index files seem up-to-date.\n";
@@ -442,6 +611,7 @@ the Jellyfish database [thash] of the transcripts.
         std::cerr << "Exception : [" << e.what() << "]\n";
         std::cerr << argv[0] << " index was invoked improperly.\n";
         std::cerr << "For usage information, try " << argv[0] << " index --help\nExiting.\n";
+        std::exit(1);
     }
 
     return 0;
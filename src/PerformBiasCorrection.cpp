@@ -125,8 +125,8 @@ ExpressionResults parseSailfishFile(const bfs::path& expFile) {
                         ifile >> tr.approxKmerCount;
                         ifile >> tr.approxCount;
                         res.expressions[tname] = tr;
-                        // eat the newline
-                        char nline; ifile.get(nline);
+                        // eat the rest of the line (e.g. confidence intervals)
+                        std::string rest; std::getline(ifile, rest);
                 }
 
                 if (ifile.peek() == EOF) { break; }
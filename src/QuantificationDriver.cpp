@@ -26,6 +26,9 @@
 #include <fstream>
 #include <vector>
 #include <thread>
+#include <functional>
+#include <memory>
+#include <stdexcept>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -39,6 +42,7 @@
 
 #include "LibraryFormat.hpp"
 #include "ReadLibrary.hpp"
+#include "MemoryMappedFile.hpp"
 
 using std::string;
 
@@ -50,8 +54,12 @@ int mainCount(uint32_t numThreads, const std::string& indexBase,
               */
               const std::vector<ReadLibrary>& readLibraries,
               const std::string& countFileOut,
-              bool discardPolyA); 
+              bool discardPolyA,
+              bool shardCounts,
+              bool perfCounters,
+              bool numa);
 int runIterativeOptimizer(int argc, char* argv[]);
+bool indexUpdateInterrupted(const boost::filesystem::path& indexPath);
 
 int runKmerCounter(const std::string& sfCommand,
                    uint32_t numThreads,
@@ -63,7 +71,10 @@ int runKmerCounter(const std::string& sfCommand,
                    const std::vector<string>& revReadFiles,
                    */
                    const std::string& countFileOut,
-                   bool discardPolyA) {
+                   bool discardPolyA,
+                   bool shardCounts,
+                   bool perfCounters,
+                   bool numa) {
 
     /*
     std::stringstream argStream;
@@ -137,7 +148,8 @@ int runKmerCounter(const std::string& sfCommand,
                             fwdReadFiles, revReadFiles, countFileOut, discardPolyA); 
  
         */
-       int ret = mainCount(numThreads, indexBase, readLibraries, countFileOut, discardPolyA); 
+       int ret = mainCount(numThreads, indexBase, readLibraries, countFileOut, discardPolyA, shardCounts,
+                           perfCounters, numa);
         std::exit(ret);
 
     } else if (pid < 0) { // fork failed!
@@ -155,6 +167,76 @@ int runKmerCounter(const std::string& sfCommand,
     return 0;
 }
 
+/**
+ * Counts the reads of the samples of a batch, in the background, each in a
+ * process of its own.  These processes are forked from a server process
+ * that is itself forked before the first estimation begins: once TBB has
+ * started its worker threads in this process, it can no longer be safely
+ * forked.
+ */
+class BatchCounter {
+public:
+  // count(i) counts the reads of sample i (and returns an exit status)
+  explicit BatchCounter(std::function<int(size_t)> count) : pid_(-1), jobs_(-1), results_(-1) {
+      int jobPipe[2], resultPipe[2];
+      if (pipe(jobPipe) != 0 or pipe(resultPipe) != 0) {
+          throw std::runtime_error("could not create the pipes to the counting process");
+      }
+      pid_ = fork();
+      if (pid_ == 0) { // the server
+          close(jobPipe[1]);
+          close(resultPipe[0]);
+          uint64_t sample;
+          while (read(jobPipe[0], &sample, sizeof(sample)) == sizeof(sample)) {
+              int status = -1;
+              auto pid = fork();
+              if (pid == 0) {
+                  std::exit(count(sample));
+              } else if (pid > 0) {
+                  waitpid(pid, &status, 0);
+              }
+              if (write(resultPipe[1], &status, sizeof(status)) != sizeof(status)) { break; }
+          }
+          _exit(0);
+      } else if (pid_ < 0) {
+          throw std::runtime_error("could not fork the counting process");
+      }
+      close(jobPipe[0]);
+      close(resultPipe[1]);
+      jobs_ = jobPipe[1];
+      results_ = resultPipe[0];
+  }
+
+  ~BatchCounter() {
+      // The server exits once there are no more jobs
+      close(jobs_);
+      close(results_);
+      int status;
+      waitpid(pid_, &status, 0);
+  }
+
+  // Begin counting the reads of the given sample
+  void start(size_t sample) {
+      uint64_t s = sample;
+      if (write(jobs_, &s, sizeof(s)) != sizeof(s)) {
+          throw std::runtime_error("lost the counting process");
+      }
+  }
+
+  // Wait for the earliest sample still being counted; returns its exit status
+  int wait() {
+      int status = -1;
+      if (read(results_, &status, sizeof(status)) != sizeof(status)) { return -1; }
+      std::cerr << "Sailfish terminated with return code " << status << "\n";
+      return status;
+  }
+
+private:
+  pid_t pid_;
+  int jobs_;
+  int results_;
+};
+
 
 int runSailfishEstimation(const std::string& sfCommand,
                           uint32_t numThreads,
@@ -166,7 +248,11 @@ int runSailfishEstimation(const std::string& sfCommand,
                           const boost::filesystem::path& outFilePath,
                           bool noBiasCorrect,
                           double minAbundance,
-                          double maxDelta) {
+                          double maxDelta,
+                          bool activeSet,
+                          const std::string& warmStart,
+                          size_t numBootstraps,
+                          bool numa) {
 
   using std::vector;
   using std::string;
@@ -186,6 +272,16 @@ int runSailfishEstimation(const std::string& sfCommand,
     argStream << "--iterations " << iterations << " ";
     argStream << "--min_abundance " << minAbundance << " ";
     argStream << "--delta " << maxDelta << " ";
+    if (activeSet) {
+        argStream << "--active_set ";
+    }
+    if (!warmStart.empty()) {
+        argStream << "--warm_start " << warmStart << " ";
+    }
+    argStream << "--num_bootstraps " << numBootstraps << " ";
+    if (numa) {
+        argStream << "--numa ";
+    }
     argStream << "--out " << outFilePath.string();
 
     std::string argString = argStream.str();
@@ -203,7 +299,7 @@ int runSailfishEstimation(const std::string& sfCommand,
             }
 
             std::cerr << "In Sailfish estimation thread. Estimating transcript abundances\n";
-            int ret = runIterativeOptimizer(argStrings.size(), args);
+            ret = runIterativeOptimizer(argStrings.size(), args);
             delete [] args;
         }
     );
@@ -297,6 +393,90 @@ LibraryFormat parseLibraryFormatString(std::string& fmt) {
     return lf;
 }
 
+/**
+ * The read libraries described by the (ordered) options; each library type
+ * given applies to the read files that follow it.
+ */
+std::vector<ReadLibrary> collectReadLibraries(boost::program_options::parsed_options& orderedOptions) {
+    std::vector<ReadLibrary> readLibraries;
+    for (auto& opt : orderedOptions.options) {
+        if (opt.string_key == "libtype") {
+            LibraryFormat libFmt = parseLibraryFormatString(opt.value[0]);
+            if (libFmt.check()) {
+                std::cerr << libFmt << "\n";
+            } else {
+                std::stringstream ss;
+                ss << libFmt << " is invalid!";
+                throw std::invalid_argument(ss.str());
+            }
+            readLibraries.emplace_back(libFmt);
+        } else if (opt.string_key == "mates1") {
+            readLibraries.back().addMates1(opt.value);
+        } else if (opt.string_key == "mates2") {
+            readLibraries.back().addMates2(opt.value);
+        } else if (opt.string_key == "unmated_reads") {
+            readLibraries.back().addUnmated(opt.value);
+        }
+    }
+
+    for (auto& rl : readLibraries) { rl.checkValid(); }
+    return readLibraries;
+}
+
+/**
+ * A sample to quantify: its reads and output directory.
+ */
+struct QuantSample {
+    std::vector<ReadLibrary> readLibraries;
+    boost::filesystem::path outputBasePath;
+    bool mustRecount{false};
+};
+
+/**
+ * Read a batch manifest; each (non-empty, non-comment) line gives the
+ * read libraries and output directory of one sample, using the same
+ * options as on the command line, e.g.
+ *
+ *   -l "T=SE:S=U" -r sample1.fq -o sample1_quant
+ */
+std::vector<QuantSample> readBatchManifest(const std::string& fname,
+                                           const boost::program_options::options_description& options) {
+    namespace po = boost::program_options;
+    std::ifstream manifest(fname);
+    if (!manifest.good()) {
+        throw std::invalid_argument("could not open the batch manifest " + fname);
+    }
+
+    std::vector<QuantSample> samples;
+    std::string line;
+    size_t lineNum{0};
+    while (std::getline(manifest, line)) {
+        ++lineNum;
+        boost::trim(line);
+        if (line.empty() or line[0] == '#') { continue; }
+
+        auto sampleOptions = po::command_line_parser(po::split_unix(line)).options(options).run();
+        for (auto& opt : sampleOptions.options) {
+            auto& k = opt.string_key;
+            if (k != "libtype" and k != "unmated_reads" and k != "mates1" and k != "mates2" and k != "out") {
+                throw std::invalid_argument(fname + ":" + std::to_string(lineNum) + ": only the reads and " +
+                                            "output directory may be given for each sample (not " + k + ")");
+            }
+        }
+        po::variables_map sampleVm;
+        po::store(sampleOptions, sampleVm);
+        if (!sampleVm.count("out")) {
+            throw std::invalid_argument(fname + ":" + std::to_string(lineNum) + ": no output directory given");
+        }
+
+        QuantSample sample;
+        sample.readLibraries = collectReadLibraries(sampleOptions);
+        sample.outputBasePath = sampleVm["out"].as<std::string>();
+        samples.push_back(sample);
+    }
+    return samples;
+}
+
 int mainQuantify( int argc, char *argv[] ) {
 
     using std::vector;
@@ -350,6 +530,26 @@ int mainQuantify( int argc, char *argv[] ) {
     ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
     ("force,f", po::bool_switch(), "Force the counting phase to rerun, even if a count databse exists." )
     ("polya,a", po::bool_switch(), "polyA/polyT k-mers should be discarded")
+    ("shard_counts", po::bool_switch(), "Accumulate k-mer counts in thread-local tables that are merged at the end "
+                                        "of counting, rather than incrementing the shared counts directly")
+    ("shared_index", po::value<string>()->implicit_value("/dev/shm"),
+                     "Publish the index to this directory (a tmpfs or hugetlbfs mount), so that "
+                     "concurrent quant runs against the same index map a single resident copy")
+    ("perf_counters", po::bool_switch(), "Record hardware performance counters (cache misses, IPC, ...) "
+                                         "while counting k-mers, in reads.count_stats.json")
+    ("active_set", po::bool_switch(), "Once the optimization is close to converging, skip the k-mer classes "
+                                      "whose transcripts have stopped changing (re-checking all of them periodically)")
+    ("warm_start", po::value<string>(), "Start the optimization from a previous solution; either the output "
+                                        "directory of an earlier quant run, or a quant.snapshot or quant.sf file")
+    ("num_bootstraps", po::value<size_t>()->default_value(0),
+                       "Compute this many bootstrap replicates of the abundances (written to bootstraps.bin), "
+                       "and report 95% confidence intervals of the TPMs")
+    ("batch", po::value<string>(), "Quantify each of the samples listed in this manifest (one per line, giving "
+                                   "its read libraries and output directory as with -l, -r, -1, -2 and -o), "
+                                   "loading the index only once")
+    ("numa", po::bool_switch(), "On a machine with several NUMA nodes, pin the counting and optimization "
+                                "threads to the nodes, and place the k-mer counts and the state of the "
+                                "optimizer on them, rather than all on the node of the main thread")
     ;
 
     po::variables_map vm;
@@ -366,28 +566,7 @@ int mainQuantify( int argc, char *argv[] ) {
 
         po::notify(vm);
 
-        vector<ReadLibrary> readLibraries;
-        for (auto& opt : orderedOptions.options) {
-            if (opt.string_key == "libtype") {
-                LibraryFormat libFmt = parseLibraryFormatString(opt.value[0]);
-                if (libFmt.check()) {
-                    std::cerr << libFmt << "\n";
-                } else {
-                    std::stringstream ss;
-                    ss << libFmt << " is invalid!";
-                    throw std::invalid_argument(ss.str());
-                }
-                readLibraries.emplace_back(libFmt);
-            } else if (opt.string_key == "mates1") {
-                readLibraries.back().addMates1(opt.value);
-            } else if (opt.string_key == "mates2") {
-                readLibraries.back().addMates2(opt.value);
-            } else if (opt.string_key == "unmated_reads") {
-                readLibraries.back().addUnmated(opt.value);
-            }
-        }
-
-        for (auto& rl : readLibraries) { rl.checkValid(); }
+        vector<ReadLibrary> readLibraries = collectReadLibraries(orderedOptions);
         /*
         // Collect the read libraries
         for (auto& libFmtStr : libFmtStrs) {
@@ -427,12 +606,33 @@ int mainQuantify( int argc, char *argv[] ) {
         }
         */
         bfs::path indexBasePath(vm["index"].as<string>());
-        bfs::path outputBasePath(vm["out"].as<string>());
+        vector<QuantSample> samples;
+        if (vm.count("batch")) {
+            if (!readLibraries.empty() or vm.count("out")) {
+                throw std::invalid_argument("with --batch, the reads and output directory of each sample "
+                                            "are given in the manifest");
+            }
+            samples = readBatchManifest(vm["batch"].as<string>(), generic);
+        } else {
+            if (!vm.count("out")) { throw std::invalid_argument("no output directory (--out) given"); }
+            QuantSample sample;
+            sample.readLibraries = readLibraries;
+            sample.outputBasePath = vm["out"].as<string>();
+            samples.push_back(sample);
+        }
         //string tgmap = vm["tgmap"].as<string>();
         //string tgmap = indexBase+".tgm";
         uint32_t numThreads = vm["threads"].as<uint32_t>();
         bool force = vm["force"].as<bool>();
         bool discardPolyA = vm["polya"].as<bool>();
+        bool shardCounts = vm["shard_counts"].as<bool>();
+        bool perfCounters = vm["perf_counters"].as<bool>();
+        bool numa = vm["numa"].as<bool>();
+        // Set before counting begins; the counting process is forked from
+        // this one, and so inherits the setting
+        if (vm.count("shared_index")) {
+            MemoryMappedFile::setSharedDirectory(vm["shared_index"].as<string>());
+        }
 
         /*
         ("index,i", po::value<string>(), "transcript index file [Sailfish format]")
@@ -441,43 +641,43 @@ int mainQuantify( int argc, char *argv[] ) {
         ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
         */
 
-        if (bfs::exists(outputBasePath) and !bfs::is_directory(outputBasePath)) {
-            std::cerr << "The provided output path [" << outputBasePath << "] " <<
-                         "already exists and is not a directory\n.";
-            std::cerr << "Please either provide a different path or " <<
-                         "delete the existing file.\n";
-            std::exit(1);
+        bfs::path indexPath(indexBasePath); indexPath /= "transcriptome";
+        bfs::path lutBasePath(indexBasePath); lutBasePath /= "transcriptome";
+
+        if (indexUpdateInterrupted(indexBasePath)) {
+            std::cerr << "The index in [" << indexBasePath.string() << "] was left inconsistent by an "
+                         "interrupted update; rebuild it with sailfish index --force\n";
+            return 1;
         }
 
-        bool mustRecount = false;
-        if (!bfs::exists(outputBasePath)) {
-            mustRecount = true;
-            try {
-                bool success = bfs::create_directory(outputBasePath);
-                if (!success) { throw std::runtime_error("unspecified error creating file."); }
-            } catch ( std::exception& e ) {
-                std::cerr << "Creation of " << outputBasePath << " failed [" << e.what() << "]\n.";
-                std::cerr << "Exiting.\n";
+        for (auto& sample : samples) {
+            auto& outputBasePath = sample.outputBasePath;
+            if (bfs::exists(outputBasePath) and !bfs::is_directory(outputBasePath)) {
+                std::cerr << "The provided output path [" << outputBasePath << "] " <<
+                             "already exists and is not a directory\n.";
+                std::cerr << "Please either provide a different path or " <<
+                             "delete the existing file.\n";
                 std::exit(1);
             }
-        }
-        
-        // create the directory for log files
-        bfs::path logDir = outputBasePath / "logs";
-        boost::filesystem::create_directory(logDir);
 
-        //string countFileOut = outputBase + ".sfc";
-        bfs::path countFilePath(outputBasePath); countFilePath /= "reads.sfc";
-        bfs::path indexPath(indexBasePath); indexPath /= "transcriptome";
+            if (!bfs::exists(outputBasePath)) {
+                try {
+                    bool success = bfs::create_directory(outputBasePath);
+                    if (!success) { throw std::runtime_error("unspecified error creating file."); }
+                } catch ( std::exception& e ) {
+                    std::cerr << "Creation of " << outputBasePath << " failed [" << e.what() << "]\n.";
+                    std::cerr << "Exiting.\n";
+                    std::exit(1);
+                }
+            }
 
-        mustRecount = (force or !boost::filesystem::exists(countFilePath));
-        if (mustRecount) {
-            //          runKmerCounter(sfCommand, numThreads, indexPath.string(), undirReadFiles, fwdReadFiles, revReadFiles, countFilePath.string(), discardPolyA);
-            runKmerCounter(sfCommand, numThreads, indexPath.string(), readLibraries, countFilePath.string(), discardPolyA);
+            // create the directory for log files
+            bfs::path logDir = outputBasePath / "logs";
+            boost::filesystem::create_directory(logDir);
 
+            sample.mustRecount = (force or !boost::filesystem::exists(outputBasePath / "reads.sfc"));
         }
 
-
         /*
         //("genes,g", po::value< std::vector<string> >(), "gene sequences")
         ("counts,c", po::value<string>(), "count file")
@@ -492,11 +692,81 @@ int mainQuantify( int argc, char *argv[] ) {
         ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
         */
 
-        bfs::path lutBasePath(indexBasePath); lutBasePath /= "transcriptome";
-        bfs::path estFilePath(outputBasePath); estFilePath /= "quant.sf";
-        runSailfishEstimation(sfCommand, numThreads, countFilePath, indexPath,
-                              iterations, lutBasePath, estFilePath,
-                              noBiasCorrect, minAbundance, maxDelta);
+        // A previous output directory is warm-started from its snapshot
+        // (if it has one) or else from its quant.sf
+        std::string warmStart;
+        if (vm.count("warm_start")) {
+            bfs::path warmStartPath(vm["warm_start"].as<string>());
+            if (bfs::is_directory(warmStartPath)) {
+                warmStartPath = bfs::exists(warmStartPath / "quant.snapshot") ?
+                                (warmStartPath / "quant.snapshot") : (warmStartPath / "quant.sf");
+            }
+            if (!bfs::exists(warmStartPath)) {
+                std::cerr << "The warm start [" << warmStartPath << "] does not exist\n";
+                std::exit(1);
+            }
+            warmStart = warmStartPath.string();
+        }
+
+        // In a batch, the index is mapped once, here; the estimation of every
+        // sample, and the counting process forked for each, re-use it
+        if (samples.size() > 1) {
+            MemoryMappedFile::setRetainMappings(true);
+            for (auto& f : {indexPath.string() + ".sfi", lutBasePath.string() + ".klut",
+                            (indexBasePath / "kmerEquivClasses.bin").string()}) {
+                if (bfs::exists(f)) { MemoryMappedFile::openShared(f)->willNeed(); }
+            }
+        }
+
+        // In a batch, the reads of the next sample are counted while the
+        // abundances of this one are estimated
+        std::unique_ptr<BatchCounter> batchCounter;
+        if (samples.size() > 1) {
+            batchCounter.reset(new BatchCounter([&](size_t i) -> int {
+                auto& sample = samples[i];
+                std::cerr << "Counting the k-mers of the reads for " << sample.outputBasePath << "\n";
+                return mainCount(numThreads, indexPath.string(), sample.readLibraries,
+                                 (sample.outputBasePath / "reads.sfc").string(),
+                                 discardPolyA, shardCounts, perfCounters, numa);
+            }));
+            if (samples.front().mustRecount) { batchCounter->start(0); }
+        }
+
+        size_t numFailed{0};
+        for (size_t i = 0; i < samples.size(); ++i) {
+            auto& sample = samples[i];
+            bool counted = true;
+            if (batchCounter) {
+                if (sample.mustRecount) { counted = (batchCounter->wait() == 0); }
+                if (i + 1 < samples.size() and samples[i + 1].mustRecount) { batchCounter->start(i + 1); }
+            } else if (sample.mustRecount) {
+                runKmerCounter(sfCommand, numThreads, indexPath.string(), sample.readLibraries,
+                               (sample.outputBasePath / "reads.sfc").string(),
+                               discardPolyA, shardCounts, perfCounters, numa);
+            }
+
+            if (!counted) {
+                std::cerr << "Counting the reads for " << sample.outputBasePath << " failed; skipping it\n";
+                ++numFailed;
+                continue;
+            }
+
+            bfs::path countFilePath(sample.outputBasePath); countFilePath /= "reads.sfc";
+            bfs::path estFilePath(sample.outputBasePath); estFilePath /= "quant.sf";
+            int estRet = runSailfishEstimation(sfCommand, numThreads, countFilePath, indexPath,
+                                               iterations, lutBasePath, estFilePath,
+                                               noBiasCorrect, minAbundance, maxDelta,
+                                               vm["active_set"].as<bool>(), warmStart,
+                                               vm["num_bootstraps"].as<size_t>(), numa);
+            if (estRet != 0) {
+                std::cerr << "Estimating the abundances for " << sample.outputBasePath << " failed\n";
+                ++numFailed;
+            }
+        }
+        if (numFailed > 0) {
+            std::cerr << numFailed << " of " << samples.size() << " samples could not be quantified\n";
+            return 1;
+        }
 
     } catch (po::error &e) {
         std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
@@ -0,0 +1,399 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "ReadInputStream.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <stdexcept>
+
+#include "unistd.h"
+#include "fcntl.h"
+
+#include "zlib.h"
+#include "tbb/concurrent_queue.h"
+
+namespace bfs = boost::filesystem;
+
+int fifoRead(int f, void* buf, int n) {
+  char* a;
+  int m, t;
+  a = static_cast<char*>(buf);
+  t = 0;
+  while (t < n) {
+    m = ::read(f, a+t, n-t);
+    if (m <= 0) {
+      if (t == 0) {
+        return m;
+      }
+      std::cerr << "hit eof!\n";
+      break;
+    }
+    t += m;
+  }
+  return t;
+}
+
+/**
+ * The file (or named pipe) itself.
+ */
+class FdInputStream : public ReadInputStream {
+public:
+    FdInputStream(const bfs::path& file) : fd_(open(file.c_str(), O_RDONLY)) {
+        if (fd_ < 0) { throw std::runtime_error("could not open " + file.string() + " for reading"); }
+    }
+    ~FdInputStream() { close(fd_); }
+    int read(void* buf, int n) override { return fifoRead(fd_, buf, n); }
+private:
+    int fd_;
+};
+
+/**
+ * Buffers of decompressed data, which may be produced out of order (by
+ * multiple threads), but which are consumed in order.  At most capacity
+ * buffers are held at once; a producer of a buffer too far ahead of the
+ * consumer waits until there is room for it.
+ */
+class OrderedBufferQueue {
+public:
+    OrderedBufferQueue(size_t capacity) : slots_(capacity), filled_(capacity, false),
+                                          next_(0), total_(0), finished_(false) {}
+
+    void put(size_t seq, std::vector<char>& buf) {
+        std::unique_lock<std::mutex> l(mutex_);
+        notFull_.wait(l, [this, seq]() { return seq < next_ + slots_.size(); });
+        size_t slot = seq % slots_.size();
+        std::swap(slots_[slot], buf);
+        filled_[slot] = true;
+        notEmpty_.notify_all();
+    }
+
+    // No more than total buffers will be produced
+    void finish(size_t total) {
+        std::unique_lock<std::mutex> l(mutex_);
+        total_ = total;
+        finished_ = true;
+        notEmpty_.notify_all();
+    }
+
+    // Get the next buffer in order; returns false at the end of the stream
+    bool take(std::vector<char>& buf) {
+        std::unique_lock<std::mutex> l(mutex_);
+        size_t slot = next_ % slots_.size();
+        notEmpty_.wait(l, [this, slot]() { return filled_[slot] or (finished_ and next_ >= total_); });
+        if (!filled_[slot]) { return false; }
+        std::swap(slots_[slot], buf);
+        filled_[slot] = false;
+        ++next_;
+        notFull_.notify_all();
+        return true;
+    }
+
+private:
+    std::vector<std::vector<char>> slots_;
+    std::vector<bool> filled_;
+    size_t next_;
+    size_t total_;
+    bool finished_;
+    std::mutex mutex_;
+    std::condition_variable notFull_;
+    std::condition_variable notEmpty_;
+};
+
+/**
+ * A stream whose bytes come, in order, from an OrderedBufferQueue.  If the
+ * producer fails at some buffer, the stream ends (with an error) just
+ * before it.
+ */
+class QueuedInputStream : public ReadInputStream {
+public:
+    QueuedInputStream(size_t capacity) : queue_(capacity), pos_(0), numTaken_(0),
+                                         failedAt_(std::numeric_limits<size_t>::max()) {}
+
+    int read(void* buf, int n) override {
+        char* out = static_cast<char*>(buf);
+        int t = 0;
+        while (t < n) {
+            if (pos_ == current_.size()) {
+                pos_ = 0;
+                current_.clear();
+                if (numTaken_ >= failedAt_) { return (t > 0) ? t : -1; }
+                if (!queue_.take(current_)) { break; }
+                ++numTaken_;
+            }
+            size_t m = std::min(static_cast<size_t>(n - t), current_.size() - pos_);
+            memcpy(out + t, current_.data() + pos_, m);
+            pos_ += m; t += m;
+        }
+        return t;
+    }
+
+    bool failed() const override { return numTaken_ >= failedAt_; }
+
+protected:
+    // The buffers from seq on are not to be read
+    void fail_(size_t seq) {
+        size_t cur = failedAt_;
+        while (seq < cur and !failedAt_.compare_exchange_weak(cur, seq)) {}
+    }
+
+    OrderedBufferQueue queue_;
+
+private:
+    std::vector<char> current_;
+    size_t pos_;
+    size_t numTaken_;
+    std::atomic<size_t> failedAt_;
+};
+
+/**
+ * A gzip file.  The stream is inflated serially (gzip offers no independent
+ * entry points), but by a dedicated thread, so that decompression and
+ * parsing are pipelined.
+ */
+class GzipInputStream : public QueuedInputStream {
+public:
+    GzipInputStream(const bfs::path& file) : QueuedInputStream(8), file_(file) {
+        in_ = gzopen(file.c_str(), "rb");
+        if (in_ == nullptr) { throw std::runtime_error("could not open " + file.string() + " for reading"); }
+        gzbuffer(in_, 1 << 18);
+        inflater_ = std::thread([this]() -> void {
+            size_t seq{0};
+            while (true) {
+                std::vector<char> buf(BufferSize);
+                int n = gzread(in_, buf.data(), BufferSize);
+                if (n <= 0) {
+                    if (n < 0) {
+                        int err;
+                        std::cerr << "error decompressing " << file_ << ": " << gzerror(in_, &err) << "\n";
+                        fail_(seq);
+                    }
+                    break;
+                }
+                buf.resize(n);
+                queue_.put(seq++, buf);
+            }
+            queue_.finish(seq);
+        });
+    }
+
+    ~GzipInputStream() {
+        // Drain anything still queued so that the inflater can finish
+        std::vector<char> buf;
+        while (queue_.take(buf)) {}
+        inflater_.join();
+        gzclose(in_);
+    }
+
+private:
+    static constexpr int BufferSize = 1 << 20;
+    bfs::path file_;
+    gzFile in_;
+    std::thread inflater_;
+};
+
+/**
+ * A BGZF file, which is a series of independently compressed gzip members
+ * (blocks) of at most 64KB, each recording its own compressed size.  A
+ * reader thread splits the file into batches of blocks, which are inflated
+ * in parallel by a pool of threads and then reassembled in order.
+ */
+class BGZFInputStream : public QueuedInputStream {
+    struct Batch {
+        size_t seq;
+        std::vector<unsigned char> data;
+        // The offset of each block in data, and the offset one past the last
+        std::vector<size_t> offsets;
+    };
+
+public:
+    BGZFInputStream(const bfs::path& file, uint32_t numInflaters) :
+        QueuedInputStream(4 * numInflaters), file_(file) {
+        in_ = fopen(file.c_str(), "rb");
+        if (in_ == nullptr) { throw std::runtime_error("could not open " + file.string() + " for reading"); }
+        work_.set_capacity(2 * numInflaters);
+
+        for (uint32_t i = 0; i < numInflaters; ++i) {
+            inflaters_.emplace_back([this]() -> void {
+                Batch* b{nullptr};
+                std::vector<char> out;
+                while (true) {
+                    work_.pop(b);
+                    if (b == nullptr) { break; }
+                    if (!inflateBatch_(*b, out)) { fail_(b->seq); }
+                    queue_.put(b->seq, out);
+                    delete b;
+                }
+            });
+        }
+
+        reader_ = std::thread([this, numInflaters]() -> void {
+            size_t seq{0};
+            int more{1};
+            while (more > 0) {
+                Batch* b = new Batch;
+                b->seq = seq;
+                b->offsets.push_back(0);
+                while (b->offsets.size() <= BlocksPerBatch and (more = readBlock_(b->data)) > 0) {
+                    b->offsets.push_back(b->data.size());
+                }
+                if (b->offsets.size() > 1) { work_.push(b); ++seq; } else { delete b; }
+                // The blocks before a bad one are still read
+                if (more < 0) { fail_(seq); }
+            }
+            for (uint32_t i = 0; i < numInflaters; ++i) { work_.push(nullptr); }
+            for (auto& t : inflaters_) { t.join(); }
+            queue_.finish(seq);
+        });
+    }
+
+    ~BGZFInputStream() {
+        std::vector<char> buf;
+        while (queue_.take(buf)) {}
+        reader_.join();
+        fclose(in_);
+    }
+
+private:
+    static constexpr size_t BlocksPerBatch = 64;
+    static constexpr size_t HeaderSize = 12;
+
+    // Append the next (complete, compressed) block of the file to data;
+    // returns 1 if there was one, 0 at the end of the file and -1 on error
+    int readBlock_(std::vector<unsigned char>& data) {
+        unsigned char header[HeaderSize];
+        size_t n = fread(header, 1, HeaderSize, in_);
+        if (n == 0) { return 0; }
+        if (n != HeaderSize or header[0] != 31 or header[1] != 139 or !(header[3] & 4)) {
+            std::cerr << "error decompressing " << file_ << ": not a valid BGZF block\n";
+            return -1;
+        }
+        size_t xlen = header[10] | (header[11] << 8);
+        std::vector<unsigned char> extra(xlen);
+        if (fread(extra.data(), 1, xlen, in_) != xlen) {
+            std::cerr << "error decompressing " << file_ << ": truncated BGZF block\n";
+            return -1;
+        }
+
+        // Find the 'BC' subfield, which holds the total block size - 1
+        size_t bsize{0};
+        for (size_t i = 0; i + 4 <= xlen; ) {
+            size_t slen = extra[i + 2] | (extra[i + 3] << 8);
+            if (extra[i] == 'B' and extra[i + 1] == 'C' and slen == 2 and i + 6 <= xlen) {
+                bsize = (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+            }
+            i += 4 + slen;
+        }
+        if (bsize < HeaderSize + xlen + 8) {
+            std::cerr << "error decompressing " << file_ << ": BGZF block has no size\n";
+            return -1;
+        }
+
+        size_t start = data.size();
+        data.resize(start + bsize);
+        memcpy(&data[start], header, HeaderSize);
+        memcpy(&data[start + HeaderSize], extra.data(), xlen);
+        size_t rest = bsize - HeaderSize - xlen;
+        if (fread(&data[start + HeaderSize + xlen], 1, rest, in_) != rest) {
+            std::cerr << "error decompressing " << file_ << ": truncated BGZF block\n";
+            return -1;
+        }
+        return 1;
+    }
+
+    // Inflate the blocks of b into out; returns false if any is corrupt
+    bool inflateBatch_(Batch& b, std::vector<char>& out) {
+        out.clear();
+        bool ok{true};
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -15);
+        for (size_t i = 0; i + 1 < b.offsets.size(); ++i) {
+            unsigned char* block = &b.data[b.offsets[i]];
+            size_t bsize = b.offsets[i + 1] - b.offsets[i];
+            size_t xlen = block[10] | (block[11] << 8);
+            // The trailer holds the CRC32 and then the uncompressed size
+            unsigned char* trailer = block + bsize - 8;
+            uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+            size_t isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | (size_t(trailer[7]) << 24);
+            // (e.g. the empty block that marks the end of the file)
+            if (isize == 0) { continue; }
+
+            size_t start = out.size();
+            out.resize(start + isize);
+            inflateReset(&zs);
+            zs.next_in = block + HeaderSize + xlen;
+            zs.avail_in = bsize - HeaderSize - xlen - 8;
+            zs.next_out = reinterpret_cast<unsigned char*>(out.data() + start);
+            zs.avail_out = isize;
+            int ret = inflate(&zs, Z_FINISH);
+            auto data = reinterpret_cast<const unsigned char*>(out.data() + start);
+            if (ret != Z_STREAM_END or zs.avail_out != 0 or crc32(0L, data, isize) != crc) {
+                std::cerr << "error decompressing " << file_ << ": corrupt BGZF block\n";
+                out.resize(start);
+                ok = false;
+                break;
+            }
+        }
+        inflateEnd(&zs);
+        return ok;
+    }
+
+    bfs::path file_;
+    FILE* in_;
+    tbb::concurrent_bounded_queue<Batch*> work_;
+    std::vector<std::thread> inflaters_;
+    std::thread reader_;
+};
+
+InputCompression detectCompression(const bfs::path& file) {
+    if (!bfs::is_regular_file(file)) { return InputCompression::NONE; }
+
+    unsigned char header[16];
+    FILE* in = fopen(file.c_str(), "rb");
+    if (in == nullptr) { return InputCompression::NONE; }
+    size_t n = fread(header, 1, sizeof(header), in);
+    fclose(in);
+
+    if (n < 10 or header[0] != 31 or header[1] != 139) { return InputCompression::NONE; }
+    // BGZF files are gzip files whose first member carries the 'BC' extra subfield
+    bool isBGZF = (n >= 16) and (header[3] & 4) and header[12] == 'B' and header[13] == 'C';
+    return (isBGZF) ? InputCompression::BGZF : InputCompression::GZIP;
+}
+
+std::unique_ptr<ReadInputStream> openReadInputStream(const bfs::path& file, uint32_t numInflaters) {
+    switch (detectCompression(file)) {
+        case InputCompression::BGZF:
+            return std::unique_ptr<ReadInputStream>(new BGZFInputStream(file, std::max(numInflaters, 1u)));
+        case InputCompression::GZIP:
+            return std::unique_ptr<ReadInputStream>(new GzipInputStream(file));
+        default:
+            return std::unique_ptr<ReadInputStream>(new FdInputStream(file));
+    }
+}
@@ -117,6 +117,13 @@ int runIterativeOptimizer(int argc, char* argv[] ) {
       ("iterations,n", po::value<size_t>(&numIter)->default_value(1000), "number of iterations to run the optimzation")
       ("lutfile,l", po::value<string>(), "Lookup table prefix")
       ("threads,p", po::value<uint32_t>()->default_value(maxThreads), "The number of threads to use when counting kmers")
+      ("active_set", po::bool_switch(), "once the optimization is close to converging, skip the k-mer classes whose "
+       "transcripts have stopped changing")
+      ("warm_start", po::value<string>(), "start the optimization from this previous solution (a quant.snapshot or "
+       "quant.sf file)")
+      ("num_bootstraps", po::value<size_t>()->default_value(0), "the number of bootstrap replicates from which to "
+       "estimate confidence intervals of the abundances")
+      ("numa", po::bool_switch(), "pin the threads to the NUMA nodes, and place the state of the optimizer on them")
       ;
 
     po::options_description programOptions("combined");
@@ -210,11 +217,28 @@ int runIterativeOptimizer(int argc, char* argv[] ) {
     // IterativeOptimizer<CountDBNew, CountDBNew> solver( hash, transcriptHash, tgm, bidx );
     std::cerr << "done\n";
 
+    // Keep a record of the progress of each iteration of the optimizer
+    boost::system::error_code logDirError;
+    bfs::create_directories(logDir, logDirError);
+    solver.setTelemetryFile((logDir / "optimizer.jsonl").string());
+    solver.setActiveSet(vm["active_set"].as<bool>());
+    solver.setNUMA(vm["numa"].as<bool>());
+    if (vm.count("warm_start")) { solver.setWarmStart(vm["warm_start"].as<string>()); }
+
     std::cerr << "optimizing using iterative optimization [" << numIter << "] iterations";
 
     // EM
     bool haveCI{false};
     solver.optimize(klutfname, tlutfname, kmerEquivClassFname.string(), numIter, minMean, maxDelta);
+    if (!solver.writeSnapshot(outputFilePath.parent_path() / "quant.snapshot")) { return 1; }
+
+    size_t numBootstraps = vm["num_bootstraps"].as<size_t>();
+    if (numBootstraps > 0) {
+        if (!solver.bootstrap(numBootstraps, numIter, maxDelta, outputFilePath.parent_path() / "bootstraps.bin")) {
+            return 1;
+        }
+        haveCI = true;
+    }
 
     // VB
     //bool haveCI{true};
@@ -276,13 +300,19 @@ int runIterativeOptimizer(int argc, char* argv[] ) {
         }
     }
 
+  // The estimate may be one of several run by a batch (see quant --batch),
+  // so a failure is returned rather than ending the process
   } catch (po::error &e){
-    std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
-    std::exit(1);
+    std::cerr << "exception : [" << e.what() << "].\n";
+    return 1;
+  } catch (std::exception& e) {
+    std::cerr << "ERROR: [" << e.what() << "]\n";
+    std::cerr << argv[0] << " " << cmdString << " failed.\n";
+    return 1;
   } catch (...) {
     std::cerr << argv[0] << " " << cmdString << " was invoked improperly.\n";
-    std::cerr << "For usage information, try " << argv[0] << " " << cmdString << " --help\nExiting.\n";
-    std::exit(1);
+    std::cerr << "For usage information, try " << argv[0] << " " << cmdString << " --help\n";
+    return 1;
   }
 
   return 0;
@@ -418,13 +448,15 @@ int main( int argc, char* argv[] ) {
     argv2[0] = argv[0];
     std::copy_n( &argv[topLevelArgc], argc-topLevelArgc, &argv2[1] );
 
+    int ret{0};
     auto cmdMain = cmds.find(cmd);
     if (cmdMain == cmds.end()) {
       help(subCommandArgc, argv2);
     } else {
-      cmdMain->second(subCommandArgc, argv2);
+      ret = cmdMain->second(subCommandArgc, argv2);
     }
     delete[] argv2;
+    return ret;
 
   } catch (po::error &e) {
     std::cerr << "Program Option Error (main) : [" << e.what() << "].\n Exiting.\n";
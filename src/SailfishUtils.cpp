@@ -171,7 +171,6 @@ TranscriptGeneMap transcriptToGeneMapFromFasta( const std::string& transcriptsFi
 
     using std::vector;
     NameVector transcriptNames;
-    NameVector geneNames {"gene"};
 
     vector<bfs::path> paths{transcriptsFile};
     StreamingReadParser parser(paths);
@@ -189,6 +188,12 @@ TranscriptGeneMap transcriptToGeneMapFromFasta( const std::string& transcriptsFi
       producer.finishedWithRead(s);
     }
 
+    return transcriptToGeneMapFromNames(transcriptNames);
+}
+
+TranscriptGeneMap transcriptToGeneMapFromNames( NameVector transcriptNames ) {
+    NameVector geneNames {"gene"};
+
     // Sort the transcript names
     std::sort(transcriptNames.begin(), transcriptNames.end());
 
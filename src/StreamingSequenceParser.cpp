@@ -37,31 +37,16 @@
 #include "tbb/concurrent_queue.h"
 
 
-int fifoRead(int f, void* buf, int n) {
-  char* a;
-  int m, t;
-  a = static_cast<char*>(buf);
-  t = 0;
-  while (t < n) {
-    m = read(f, a+t, n-t);
-    if (m <= 0) {
-      if (t == 0) {
-        return m;
-      }
-      std::cerr << "hit eof!\n";
-      break;
-    }
-    t += m;
-  }
-  return t;
-}
+int streamRead(ReadInputStream* in, void* buf, int n) { return in->read(buf, n); }
 
-KSEQ_INIT(int, fifoRead)
+KSEQ_INIT(ReadInputStream*, streamRead)
 
 namespace bfs = boost::filesystem;
 
-StreamingReadParser::StreamingReadParser( std::vector<bfs::path>& files ): inputStreams_(files),
-        parsing_(false), parsingThread_(nullptr)
+StreamingReadParser::StreamingReadParser( std::vector<bfs::path>& files, uint32_t numInflaters,
+                                          size_t queueCapacity ):
+        inputStreams_(files), parsing_(false), failed_(false), parsingThread_(nullptr),
+        queueCapacity_(queueCapacity), numInflaters_(numInflaters)
     {
         readStructs_ = new ReadSeq[queueCapacity_];
         readQueue_.set_capacity(queueCapacity_);
@@ -90,14 +75,16 @@ bool StreamingReadParser::start() {
                 std::cerr << "reading from " << this->inputStreams_.size() << " streams\n";
                 for (auto file : this->inputStreams_) {
                     std::cerr << "reading from " << file.native() << "\n";
-                    // open the file and init the parser
-                    struct pollfd pfd;
-                    pfd.events = POLLERR;
-                    pfd.fd = open(file.c_str(), O_RDONLY);
-
-
-                    //FILE* fdstream = fdopen(fp, "r");
-                    seq = kseq_init(pfd.fd);
+                    // open the file (decompressing it if necessary) and init the parser
+                    std::unique_ptr<ReadInputStream> stream;
+                    try {
+                        stream = openReadInputStream(file, this->numInflaters_);
+                    } catch (std::exception& e) {
+                        std::cerr << "ERROR: " << e.what() << "\n";
+                        this->failed_ = true;
+                        continue;
+                    }
+                    seq = kseq_init(stream.get());
                       int ksv = kseq_read(seq);
                       while (ksv >= 0) {
                         this->seqContainerQueue_.pop(s);
@@ -122,9 +109,13 @@ bool StreamingReadParser::start() {
                         ksv = kseq_read(seq);
                       }
 
+                    // kseq can't tell an error from the end of the stream
+                    if (stream->failed()) {
+                        std::cerr << "ERROR: could not read all of " << file.native() << "\n";
+                        this->failed_ = true;
+                    }
                     // destroy the parser and close the file
                     kseq_destroy(seq);
-                    close(pfd.fd);
                 }
 
 
@@ -0,0 +1,134 @@
+/**
+>HEADER
+    Copyright (c) 2013 Rob Patro robp@cs.cmu.edu
+
+    This file is part of Sailfish.
+
+    Sailfish is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Sailfish is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Sailfish.  If not, see <http://www.gnu.org/licenses/>.
+<HEADER
+**/
+
+
+#include "TranscriptStore.hpp"
+
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+#include "StreamingSequenceParser.hpp"
+#include "ReadProducer.hpp"
+
+namespace {
+  // The 2-bit code of each character; CODE_RESET for anything but a
+  // nucleotide, and CODE_IGNORE for line breaks
+  constexpr uint8_t CODE_IGNORE = 5;
+
+  struct CodeTable {
+    uint8_t codes[256];
+    CodeTable() {
+      for (size_t i = 0; i < 256; ++i) { codes[i] = TranscriptStore::CODE_RESET; }
+      codes['A'] = codes['a'] = 0;
+      codes['C'] = codes['c'] = 1;
+      codes['G'] = codes['g'] = 2;
+      codes['T'] = codes['t'] = 3;
+      codes['\n'] = codes['\r'] = CODE_IGNORE;
+    }
+  };
+  const CodeTable codeTable;
+}
+
+TranscriptStore::TranscriptStore(const std::vector<std::string>& files) : offsets_{0}, resetOffsets_{0} {
+    namespace bfs = boost::filesystem;
+    std::vector<bfs::path> paths(files.begin(), files.end());
+    StreamingReadParser parser(paths);
+    parser.start();
+
+    // The parser decompresses and splits the records in its own thread; here
+    // they are only packed, in the order in which they appear in the files
+    ReadProducer<StreamingReadParser> producer(parser);
+    ReadSeq* s;
+    while (producer.nextRead(s)) {
+        append_(s->name, s->nlen, s->seq, s->len);
+        producer.finishedWithRead(s);
+    }
+
+    std::cerr << "read " << size() << " transcripts (" << totalLength() << " bases, packed into "
+              << sizeInBytes() << " bytes)\n";
+}
+
+void TranscriptStore::append_(const char* name, size_t nameLen, const char* seq, size_t len) {
+    std::string fullHeader(name, nameLen);
+    names_.emplace_back(fullHeader.substr(0, fullHeader.find(' ')));
+
+    uint64_t pos = offsets_.back();
+    uint32_t i{0};
+    for (size_t j = 0; j < len; ++j) {
+        uint8_t c = codeTable.codes[static_cast<uint8_t>(seq[j])];
+        if (c == CODE_IGNORE) { continue; }
+        if (c == CODE_RESET) {
+            resets_.push_back(i);
+            c = 0;
+        }
+        if (pos % BasesPerWord == 0) { packed_.push_back(0); }
+        packed_.back() |= static_cast<uint64_t>(c) << (2 * (pos % BasesPerWord));
+        ++pos;
+        ++i;
+    }
+    offsets_.push_back(pos);
+    resetOffsets_.push_back(resets_.size());
+}
+
+void TranscriptStore::codes(size_t i, std::vector<uint8_t>& out) const {
+    uint64_t begin = offsets_[i];
+    uint64_t end = offsets_[i + 1];
+    out.resize(end - begin);
+    for (uint64_t p = begin; p < end; ++p) {
+        out[p - begin] = (packed_[p / BasesPerWord] >> (2 * (p % BasesPerWord))) & 0x3;
+    }
+    for (uint64_t r = resetOffsets_[i]; r < resetOffsets_[i + 1]; ++r) { out[resets_[r]] = CODE_RESET; }
+}
+
+uint64_t TranscriptStore::fingerprint(size_t i) const {
+    // The finalizer of MurmurHash3
+    auto mix = [](uint64_t k) -> uint64_t {
+        k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+
+    uint64_t begin = offsets_[i];
+    uint64_t end = offsets_[i + 1];
+    uint64_t h = mix(end - begin);
+    // The bases are hashed a word (of 32) at a time, whatever their
+    // alignment within the store
+    for (uint64_t p = begin; p < end; p += BasesPerWord) {
+        size_t shift = 2 * (p % BasesPerWord);
+        uint64_t word = packed_[p / BasesPerWord] >> shift;
+        if (shift > 0 and p / BasesPerWord + 1 < packed_.size()) {
+            word |= packed_[p / BasesPerWord + 1] << (64 - shift);
+        }
+        if (end - p < BasesPerWord) { word &= (1ULL << (2 * (end - p))) - 1; }
+        h = mix(h ^ word) + 0x9E3779B97F4A7C15ULL;
+    }
+    for (uint64_t r = resetOffsets_[i]; r < resetOffsets_[i + 1]; ++r) {
+        h = mix(h ^ (resets_[r] + 1)) + 0x9E3779B97F4A7C15ULL;
+    }
+    return (h == 0) ? 1 : h;
+}
+
+size_t TranscriptStore::sizeInBytes() const {
+    return packed_.size() * sizeof(uint64_t) + offsets_.size() * sizeof(uint64_t) +
+           resetOffsets_.size() * sizeof(uint64_t) + resets_.size() * sizeof(uint32_t);
+}